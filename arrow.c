@@ -0,0 +1,474 @@
+#include "arrow.h"
+#include "model_internal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Start and end of an Arrow file, the start padded to 8 bytes
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_MAGIC_SIZE 6
+
+// Rows per record batch, the model lock is held while one batch is gathered
+#define ARROW_BATCH_ROWS 65536
+
+// Marks the start of each message, a zero length after it ends the stream
+#define ARROW_CONTINUATION 0xFFFFFFFFu
+
+// Values from the Arrow flatbuffer schemas
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_UTF8 5
+#define ARROW_PRECISION_DOUBLE 2
+
+// Most fields in any table written here
+#define ARROW_MAX_FIELDS 6
+
+///// GROWABLE BYTE BUFFER
+// Holds a flatbuffer or the body of a record batch while it is built
+typedef struct {
+    char *bytes;
+    size_t size;
+    size_t capacity;
+} arrow_buffer;
+
+///// FLATBUFFER TABLE FIELD
+// Absent when 'size' is 0. Offset fields are written as 0 and patched once their object is written,
+// 'position' is where the field ended up.
+typedef struct {
+    size_t size;
+    uint64_t value;
+    size_t position;
+} table_field;
+
+///// FLATBUFFER STRUCTS
+// Laid out as the Arrow schemas define them
+typedef struct {
+    int64_t length;
+    int64_t null_count;
+} field_node;
+
+typedef struct {
+    int64_t offset;
+    int64_t length;
+} body_buffer;
+
+typedef struct {
+    int64_t offset;
+    int32_t metadata_length;
+    int32_t padding;
+    int64_t body_length;
+} file_block;
+
+/////////////////////////////////////////////////// BUFFER FUNCTIONS ///////////////////////////////////////////////////
+
+//// PUT FUNCTION
+// Appends 'size' bytes, zeros if 'data' is NULL, returns where they start
+static size_t put(arrow_buffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        while (buffer->size + size > buffer->capacity) {
+            buffer->capacity = buffer->capacity == 0 ? 4096 : buffer->capacity * 2;
+        }
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    }
+
+    size_t position = buffer->size;
+    if (data != NULL) {
+        memcpy(buffer->bytes + position, data, size);
+    }
+    else {
+        memset(buffer->bytes + position, 0, size);
+    }
+    buffer->size += size;
+    return position;
+}
+
+//// PAD FUNCTION
+// Appends zeros until the size is 'remainder' past a multiple of 'alignment'
+static void pad(arrow_buffer *buffer, size_t alignment, size_t remainder) {
+    size_t missing = (remainder + alignment - buffer->size % alignment) % alignment;
+    put(buffer, NULL, missing);
+}
+
+/////////////////////////////////////////////////// FLATBUFFER FUNCTIONS ///////////////////////////////////////////////////
+
+// Flatbuffers are written front to back here: every table comes before the objects it points at, so its offsets
+// are patched forward once they are written. All scalars are little endian and aligned to their size.
+
+//// PATCH OFFSET FUNCTION
+static void patch_offset(arrow_buffer *buffer, size_t field, size_t target) {
+    uint32_t offset = (uint32_t) (target - field);
+    memcpy(buffer->bytes + field, &offset, sizeof(offset));
+}
+
+//// WRITE TABLE FUNCTION
+// Writes the vtable and then the table, fields ordered from largest to smallest so each is aligned
+static size_t write_table(arrow_buffer *buffer, table_field *fields, int count) {
+    uint16_t vtable[2 + ARROW_MAX_FIELDS] = {0};
+    uint16_t table_size = 4;
+    for (size_t size = 8; size >= 1; size /= 2) {
+        for (int i = 0; i < count; i++) {
+            if (fields[i].size == size) {
+                vtable[2 + i] = table_size;
+                table_size += (uint16_t) size;
+            }
+        }
+    }
+    vtable[0] = (uint16_t) (4 + 2 * count);
+    vtable[1] = table_size;
+
+    pad(buffer, 2, 0);
+    size_t vtable_position = put(buffer, vtable, vtable[0]);
+
+    // The table starts 4 bytes before an 8 byte boundary, its first field is on it
+    pad(buffer, 8, 4);
+    int32_t vtable_offset = (int32_t) (buffer->size - vtable_position);
+    size_t table = put(buffer, &vtable_offset, sizeof(vtable_offset));
+    put(buffer, NULL, table_size - 4);
+    for (int i = 0; i < count; i++) {
+        if (fields[i].size > 0) {
+            fields[i].position = table + vtable[2 + i];
+            memcpy(buffer->bytes + fields[i].position, &fields[i].value, fields[i].size);
+        }
+    }
+    return table;
+}
+
+//// WRITE VECTOR FUNCTIONS
+// Vectors of structs have their elements 8 byte aligned, after the 4 byte count
+static size_t write_struct_vector(arrow_buffer *buffer, const void *elements, uint32_t count, size_t element_size) {
+    pad(buffer, 8, 4);
+    size_t vector = put(buffer, &count, sizeof(count));
+    put(buffer, elements, count * element_size);
+    return vector;
+}
+
+// Vectors of tables hold offsets, patched through 'elements' once the tables are written
+static size_t write_offset_vector(arrow_buffer *buffer, uint32_t count, size_t *elements) {
+    pad(buffer, 4, 0);
+    size_t vector = put(buffer, &count, sizeof(count));
+    for (uint32_t i = 0; i < count; i++) {
+        elements[i] = put(buffer, NULL, sizeof(uint32_t));
+    }
+    return vector;
+}
+
+static size_t write_string(arrow_buffer *buffer, const char *text) {
+    uint32_t length = (uint32_t) strlen(text);
+    pad(buffer, 4, 0);
+    size_t string = put(buffer, &length, sizeof(length));
+    put(buffer, text, length + 1);
+    return string;
+}
+
+//// COLUMN NAME FUNCTION
+// Column letters as shown in the interface, "AA" after "Z"
+static void column_name(int col, char *name) {
+    char letters[16];
+    int length = 0;
+    for (col++; col > 0; col = (col - 1) / 26) {
+        letters[length++] = (char) ('A' + (col - 1) % 26);
+    }
+    for (int i = 0; i < length; i++) {
+        name[i] = letters[length - 1 - i];
+    }
+    name[length] = '\0';
+}
+
+//// WRITE SCHEMA FUNCTION
+// A Schema table with one nullable field per column, 'types' holds the type of each
+static size_t write_schema(arrow_buffer *buffer, int columns, const uint8_t *types, COL first_col) {
+    // Endianness is left at its default, little
+    table_field schema[2] = {{.size = 0}, {.size = 4}};
+    size_t table = write_table(buffer, schema, 2);
+    size_t *elements = malloc((columns > 0 ? columns : 1) * sizeof(size_t));
+    patch_offset(buffer, schema[1].position, write_offset_vector(buffer, (uint32_t) columns, elements));
+
+    for (int c = 0; c < columns; c++) {
+        // Name, nullable, type union, dictionary, children
+        table_field field[6] = {{.size = 4}, {.size = 1, .value = 1}, {.size = 1, .value = types[c]}, {.size = 4},
+                                 {.size = 0}, {.size = 4}};
+        patch_offset(buffer, elements[c], write_table(buffer, field, 6));
+
+        char name[16];
+        column_name((int) first_col + c, name);
+        patch_offset(buffer, field[0].position, write_string(buffer, name));
+
+        // FloatingPoint has its precision, Utf8 is an empty table
+        table_field precision[1] = {{.size = 2, .value = ARROW_PRECISION_DOUBLE}};
+        size_t type = types[c] == ARROW_TYPE_FLOATING_POINT ? write_table(buffer, precision, 1)
+                                                            : write_table(buffer, NULL, 0);
+        patch_offset(buffer, field[3].position, type);
+        patch_offset(buffer, field[5].position, write_offset_vector(buffer, 0, NULL));
+    }
+
+    free(elements);
+    return table;
+}
+
+//// START MESSAGE FUNCTION
+// Writes the root offset and a Message table, returns the position of its header offset
+static size_t start_message(arrow_buffer *buffer, int header_type, int64_t body_length) {
+    buffer->size = 0;
+    size_t root = put(buffer, NULL, sizeof(uint32_t));
+
+    // Version, header union and body length
+    table_field message[4] = {{.size = 2, .value = ARROW_METADATA_V5}, {.size = 1, .value = (uint64_t) header_type},
+                              {.size = 4}, {.size = 8, .value = (uint64_t) body_length}};
+    patch_offset(buffer, root, write_table(buffer, message, 4));
+    return message[2].position;
+}
+
+/////////////////////////////////////////////////// BATCH FUNCTIONS ///////////////////////////////////////////////////
+
+//// EXPORTED CELL FUNCTION
+// The cell at a position if it has a value, recalculated first if pending
+static cell *exported_cell(ROW row, COL col) {
+    cell *current = find_cell(row, col);
+    if (current == NULL || current->original_input[0] == '\0') {
+        return NULL;
+    }
+    if (current->dirty && current->formula != NULL) {
+        recalc_cell(current);
+    }
+    return current;
+}
+
+//// GATHER FLOAT COLUMN FUNCTION
+// Validity bitmap and values of a float64 column, anything that isn't a number is null
+static void gather_numbers(arrow_buffer *body, body_buffer *buffers, field_node *node, ROW first_row, long rows,
+                           COL col) {
+    size_t bitmap_size = ((size_t) rows + 7) / 8;
+    size_t validity = put(body, NULL, bitmap_size);
+    pad(body, 8, 0);
+    size_t values = put(body, NULL, (size_t) rows * sizeof(double));
+    pad(body, 8, 0);
+
+    node->length = rows;
+    node->null_count = 0;
+    for (long r = 0; r < rows; r++) {
+        cell *current = exported_cell((ROW) (first_row + r), col);
+        if (current == NULL || current->type != NUMBER) {
+            node->null_count++;
+            continue;
+        }
+        body->bytes[validity + r / 8] |= (char) (1 << (r % 8));
+        memcpy(body->bytes + values + r * sizeof(double), &current->content.number_value, sizeof(double));
+    }
+
+    buffers[0] = (body_buffer) {(int64_t) validity, (int64_t) bitmap_size};
+    buffers[1] = (body_buffer) {(int64_t) values, (int64_t) (rows * sizeof(double))};
+}
+
+//// GATHER TEXT COLUMN FUNCTION
+// Validity bitmap, offsets and characters of a utf8 column, numbers are written as text
+static void gather_text(arrow_buffer *body, body_buffer *buffers, field_node *node, ROW first_row, long rows,
+                        COL col) {
+    size_t bitmap_size = ((size_t) rows + 7) / 8;
+    size_t validity = put(body, NULL, bitmap_size);
+    pad(body, 8, 0);
+    size_t offsets = put(body, NULL, ((size_t) rows + 1) * sizeof(int32_t));
+    pad(body, 8, 0);
+    size_t characters = body->size;
+
+    node->length = rows;
+    node->null_count = 0;
+    for (long r = 0; r < rows; r++) {
+        cell *current = exported_cell((ROW) (first_row + r), col);
+        if (current == NULL) {
+            node->null_count++;
+        }
+        else {
+            body->bytes[validity + r / 8] |= (char) (1 << (r % 8));
+
+            // Plain numbers as they were typed, formula results with every digit they need
+            char number[32];
+            const char *text = current->original_input;
+            if (current->type == TEXT || current->type == ERROR) {
+                text = current->content.text_value;
+            }
+            else if (current->formula != NULL) {
+                snprintf(number, sizeof(number), "%.17g", current->content.number_value);
+                text = number;
+            }
+            put(body, text, strlen(text));
+        }
+
+        int32_t end = (int32_t) (body->size - characters);
+        memcpy(body->bytes + offsets + (r + 1) * sizeof(int32_t), &end, sizeof(end));
+    }
+
+    buffers[0] = (body_buffer) {(int64_t) validity, (int64_t) bitmap_size};
+    buffers[1] = (body_buffer) {(int64_t) offsets, (int64_t) (((size_t) rows + 1) * sizeof(int32_t))};
+    buffers[2] = (body_buffer) {(int64_t) characters, (int64_t) (body->size - characters)};
+    pad(body, 8, 0);
+}
+
+/////////////////////////////////////////////////// EXPORT ///////////////////////////////////////////////////
+
+//// WRITE MESSAGE FUNCTION
+// Writes the continuation marker, the metadata padded to 8 bytes and the body, fills in the file block
+static int write_message(FILE *out, int64_t *offset, arrow_buffer *metadata, arrow_buffer *body, file_block *block) {
+    pad(metadata, 8, 0);
+    uint32_t prefix[2] = {ARROW_CONTINUATION, (uint32_t) metadata->size};
+    int failed = fwrite(prefix, 1, sizeof(prefix), out) != sizeof(prefix) ||
+                 fwrite(metadata->bytes, 1, metadata->size, out) != metadata->size ||
+                 (body != NULL && fwrite(body->bytes, 1, body->size, out) != body->size);
+
+    if (block != NULL) {
+        block->offset = *offset;
+        block->metadata_length = (int32_t) (sizeof(prefix) + metadata->size);
+        block->padding = 0;
+        block->body_length = body != NULL ? (int64_t) body->size : 0;
+    }
+    *offset += (int64_t) (sizeof(prefix) + metadata->size + (body != NULL ? body->size : 0));
+    return failed ? -1 : 0;
+}
+
+//// ARROW EXPORT FUNCTION
+long arrow_export(const char *path, ROW first_row, COL first_col, ROW last_row, COL last_col) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+
+    // Find the end of an open range and which columns hold text, pending formulas are brought up to date
+    model_lock_acquire();
+    flag_pending_cells();
+    int max_row = (int) first_row - 1;
+    int max_col = (int) first_col - 1;
+    int text_columns_size = 64;
+    uint8_t *text_columns = calloc(text_columns_size, 1);
+    cell_list in_range = {0};
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            int row = (int) current->row;
+            int col = (int) current->col;
+            if (row < (int) first_row || col < (int) first_col || ((int) last_row >= 0 && row > (int) last_row) ||
+                ((int) last_col >= 0 && col > (int) last_col) || current->original_input[0] == '\0') {
+                continue;
+            }
+            max_row = row > max_row ? row : max_row;
+            max_col = col > max_col ? col : max_col;
+            cell_list_push(&in_range, current);
+        }
+    }
+
+    // Recalculating may page tiles in and add cells to the map, so it waits until the walk is done
+    for (int i = 0; i < in_range.count; i++) {
+        cell *current = in_range.cells[i];
+        int col = (int) current->col;
+        if (current->dirty && current->formula != NULL) {
+            recalc_cell(current);
+        }
+        if (current->type == TEXT) {
+            if (col - (int) first_col >= text_columns_size) {
+                int old_size = text_columns_size;
+                while (col - (int) first_col >= text_columns_size) {
+                    text_columns_size *= 2;
+                }
+                text_columns = realloc(text_columns, text_columns_size);
+                memset(text_columns + old_size, 0, text_columns_size - old_size);
+            }
+            text_columns[col - (int) first_col] = 1;
+        }
+    }
+    cell_list_free(&in_range);
+
+    // Paged out tiles only widen an open range
+    if ((int) last_row < 0 || (int) last_col < 0) {
+        tiles_extent(&max_row, &max_col);
+    }
+    model_lock_release();
+    last_row = (int) last_row < 0 ? (ROW) max_row : last_row;
+    last_col = (int) last_col < 0 ? (COL) max_col : last_col;
+    long rows = (int) last_row >= (int) first_row ? (long) last_row - (long) first_row + 1 : 0;
+    int columns = (int) last_col >= (int) first_col ? (int) last_col - (int) first_col + 1 : 0;
+
+    uint8_t *types = malloc(columns > 0 ? columns : 1);
+    int buffer_count = 0;
+    for (int c = 0; c < columns; c++) {
+        int text = c < text_columns_size && text_columns[c];
+        types[c] = text ? ARROW_TYPE_UTF8 : ARROW_TYPE_FLOATING_POINT;
+        buffer_count += text ? 3 : 2;
+    }
+    free(text_columns);
+
+    // The file starts with the magic and the schema message
+    arrow_buffer metadata = {0};
+    arrow_buffer body = {0};
+    int64_t offset = 8;
+    char magic[8] = ARROW_MAGIC;
+    int failed = fwrite(magic, 1, sizeof(magic), out) != sizeof(magic);
+    size_t header = start_message(&metadata, ARROW_HEADER_SCHEMA, 0);
+    patch_offset(&metadata, header, write_schema(&metadata, columns, types, first_col));
+    failed = failed || write_message(out, &offset, &metadata, NULL, NULL) != 0;
+
+    // One record batch per slice of rows, gathered with the model lock held and written without it
+    field_node *nodes = malloc((columns > 0 ? columns : 1) * sizeof(field_node));
+    body_buffer *buffers = malloc((buffer_count > 0 ? buffer_count : 1) * sizeof(body_buffer));
+    file_block *blocks = NULL;
+    int block_count = 0;
+    for (long start = 0; start < rows && !failed; start += ARROW_BATCH_ROWS) {
+        long batch_rows = rows - start < ARROW_BATCH_ROWS ? rows - start : ARROW_BATCH_ROWS;
+        body.size = 0;
+
+        model_lock_acquire();
+        flag_pending_cells();
+        for (int c = 0, b = 0; c < columns; c++) {
+            ROW batch_row = (ROW) ((long) first_row + start);
+            COL col = (COL) ((int) first_col + c);
+            if (types[c] == ARROW_TYPE_UTF8) {
+                gather_text(&body, buffers + b, nodes + c, batch_row, batch_rows, col);
+                b += 3;
+            }
+            else {
+                gather_numbers(&body, buffers + b, nodes + c, batch_row, batch_rows, col);
+                b += 2;
+            }
+        }
+        model_lock_release();
+
+        // RecordBatch: length, field nodes, buffers
+        header = start_message(&metadata, ARROW_HEADER_RECORD_BATCH, (int64_t) body.size);
+        table_field batch[3] = {{.size = 8, .value = (uint64_t) batch_rows}, {.size = 4}, {.size = 4}};
+        patch_offset(&metadata, header, write_table(&metadata, batch, 3));
+        patch_offset(&metadata, batch[1].position,
+                     write_struct_vector(&metadata, nodes, (uint32_t) columns, sizeof(field_node)));
+        patch_offset(&metadata, batch[2].position,
+                     write_struct_vector(&metadata, buffers, (uint32_t) buffer_count, sizeof(body_buffer)));
+
+        blocks = realloc(blocks, (block_count + 1) * sizeof(file_block));
+        failed = write_message(out, &offset, &metadata, &body, &blocks[block_count++]) != 0;
+    }
+
+    // End of stream, then the footer: version, schema, dictionaries and the record batch blocks
+    uint32_t end_of_stream[2] = {ARROW_CONTINUATION, 0};
+    failed = failed || fwrite(end_of_stream, 1, sizeof(end_of_stream), out) != sizeof(end_of_stream);
+    metadata.size = 0;
+    size_t root = put(&metadata, NULL, sizeof(uint32_t));
+    table_field footer[4] = {{.size = 2, .value = ARROW_METADATA_V5}, {.size = 4}, {.size = 0}, {.size = 4}};
+    patch_offset(&metadata, root, write_table(&metadata, footer, 4));
+    patch_offset(&metadata, footer[1].position, write_schema(&metadata, columns, types, first_col));
+    patch_offset(&metadata, footer[3].position,
+                 write_struct_vector(&metadata, blocks, (uint32_t) block_count, sizeof(file_block)));
+    pad(&metadata, 8, 0);
+    int32_t footer_size = (int32_t) metadata.size;
+    failed = failed || fwrite(metadata.bytes, 1, metadata.size, out) != metadata.size ||
+             fwrite(&footer_size, 1, sizeof(footer_size), out) != sizeof(footer_size) ||
+             fwrite(ARROW_MAGIC, 1, ARROW_MAGIC_SIZE, out) != ARROW_MAGIC_SIZE;
+
+    free(metadata.bytes);
+    free(body.bytes);
+    free(nodes);
+    free(buffers);
+    free(blocks);
+    free(types);
+    if (fclose(out) != 0 || failed) {
+        return -1;
+    }
+    return rows;
+}
@@ -0,0 +1,20 @@
+#ifndef ASSIGNMENT_ARROW_H
+#define ASSIGNMENT_ARROW_H
+
+#include "defs.h"
+
+// Exports the cells from 'first_row', 'first_col' to 'last_row', 'last_col'
+// (inclusive) to an Arrow IPC file at 'path', one column per sheet column,
+// named by its letter. A negative 'last_row' or 'last_col' extends the range
+// to the last cell of the sheet.
+//
+// Columns holding text are utf8, every other column is float64. Formulas are
+// written as their results, recalculated first if they are pending. Empty
+// cells are nulls, and so are errors in float64 columns. Rows are written in
+// record batches of ARROW_BATCH_ROWS, with every buffer 8 byte aligned, so a
+// reader can map the file and use the columns where they lie.
+//
+// Returns the number of rows written, or -1 if the file can't be written.
+long arrow_export(const char *path, ROW first_row, COL first_col, ROW last_row, COL last_col);
+
+#endif //ASSIGNMENT_ARROW_H
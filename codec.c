@@ -0,0 +1,689 @@
+#include "codec.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#define CODEC_MAGIC "SHEETCMP"
+#define CODEC_VERSION 1
+
+// Image bytes per block, a multiple of every column width
+#define CODEC_BLOCK_SIZE (1 << 18)
+
+// Images at least this large are coded by several threads, smaller ones are not worth starting them for
+#define CODEC_PARALLEL_SIZE (4 << 20)
+#define CODEC_MAX_THREADS 16
+
+// Widest values that are bitpacked, one unaligned 64 bit load always holds a whole value
+#define CODEC_MAX_BITS 56
+
+// Zero bytes after bitpacked values, so the last one can be loaded like the others
+#define CODEC_PADDING 8
+
+// Doubles are packed as integers when scaling them by a power of ten up to
+// this one makes them integers no larger than the limit, which divide back exactly
+#define CODEC_MAX_SCALE 9
+#define CODEC_EXACT_LIMIT 9007199254740992.0
+
+// Block flags
+#define CODEC_DELTA 1
+#define CODEC_DOUBLES 2
+
+///// BLOCK METHODS
+typedef enum {
+    METHOD_RAW,
+    METHOD_PACKED,
+    METHOD_DICTIONARY
+} codec_method;
+
+///// COMPRESSED HEADER
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_count;
+    uint64_t image_size;
+} codec_header;
+
+///// BLOCK ENTRY
+// Blocks follow each other in the image, each one's payload is wherever its offset says
+typedef struct {
+    uint64_t offset;
+    // First or smallest value of packed blocks, bytes in the dictionary of string blocks
+    uint64_t base;
+    uint32_t size;
+    uint32_t image_size;
+    // Values or strings in the block, and strings in its dictionary
+    uint32_t count;
+    uint32_t entries;
+    uint8_t method;
+    uint8_t width;
+    uint8_t bits;
+    uint8_t flags;
+    // Power of ten packed doubles were multiplied by
+    uint8_t scale;
+    uint8_t padding[3];
+    // FNV-1a of the payload
+    uint64_t checksum;
+} codec_block;
+
+///// BLOCK JOB
+// A block being compressed, its payload kept apart until the blocks are put together
+typedef struct {
+    const char *data;
+    codec_kind kind;
+    codec_block entry;
+    char *payload;
+} codec_job;
+
+///// THREAD WORK
+// The range of blocks one thread codes
+typedef struct {
+    pthread_t thread;
+    codec_job *jobs;
+    codec_block *blocks;
+    const char *data;
+    char *image;
+    uint64_t *starts;
+    uint32_t first;
+    uint32_t stop;
+    int failed;
+} codec_work;
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+// Powers of ten, exact as doubles
+static const double powers_of_ten[CODEC_MAX_SCALE + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+//// CHECKSUM FUNCTION
+static uint64_t checksum(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (uint8_t) data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+//// BIT LENGTH FUNCTION
+static int bit_length(uint64_t value) {
+    int bits = 0;
+    while (value != 0) {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+//// ZIGZAG FUNCTIONS
+// Small negative and positive differences both become small numbers
+static uint64_t zigzag(uint64_t value) {
+    return (value << 1) ^ (uint64_t) -(int64_t) (value >> 63);
+}
+
+static uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (uint64_t) -(int64_t) (value & 1);
+}
+
+//// PACK FUNCTION
+// Writes 'count' values of 'bits' bits each, lowest bits first, followed by the padding
+static size_t pack(char *out, const uint64_t *values, size_t count, int bits) {
+    size_t size = 0;
+    uint64_t buffer = 0;
+    int filled = 0;
+    for (size_t i = 0; i < count; i++) {
+        buffer |= values[i] << filled;
+        filled += bits;
+        while (filled >= 8) {
+            out[size++] = (char) (buffer & 0xff);
+            buffer >>= 8;
+            filled -= 8;
+        }
+    }
+    if (filled > 0) {
+        out[size++] = (char) buffer;
+    }
+    memset(out + size, 0, CODEC_PADDING);
+    return size + CODEC_PADDING;
+}
+
+//// UNPACK FUNCTION
+// Reads value 'index' of 'bits' bits, the padding keeps the load inside the payload
+static inline uint64_t unpack(const char *in, size_t index, int bits, uint64_t mask) {
+    size_t bit = index * (size_t) bits;
+    uint64_t word;
+    memcpy(&word, in + (bit >> 3), sizeof(word));
+    return (word >> (bit & 7)) & mask;
+}
+
+//// PACKED SIZE FUNCTION
+static size_t packed_size(size_t count, int bits) {
+    return (count * (size_t) bits + 7) / 8 + CODEC_PADDING;
+}
+
+//// READ VALUE FUNCTION
+// Reads an element of the given width, zero extended
+static uint64_t read_value(const char *data, size_t index, int width) {
+    if (width == 1) {
+        return (uint8_t) data[index];
+    }
+    if (width == 4) {
+        uint32_t value;
+        memcpy(&value, data + index * 4, 4);
+        return value;
+    }
+    uint64_t value;
+    memcpy(&value, data + index * 8, 8);
+    return value;
+}
+
+//// WIDTH FUNCTION
+static int kind_width(codec_kind kind) {
+    switch (kind) {
+        case CODEC_SMALL:
+            return 1;
+        case CODEC_INT32:
+            return 4;
+        case CODEC_UINT64:
+        case CODEC_DOUBLE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+//// SCALE DOUBLE FUNCTION
+// Stores the double multiplied by 10^scale as an integer in 'scaled', returns -1 if it doesn't come back exactly.
+// The sign of -0.0 would be lost, and so is anything that isn't a number.
+static int scale_double(double number, int scale, int64_t *scaled) {
+    double product = number * powers_of_ten[scale];
+    if (!(product >= -CODEC_EXACT_LIMIT && product <= CODEC_EXACT_LIMIT)) {
+        return -1;
+    }
+    int64_t integer = (int64_t) (product < 0 ? product - 0.5 : product + 0.5);
+    double back = scale == 0 ? (double) integer : (double) integer / powers_of_ten[scale];
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    if (back != number || (number == 0 && bits != 0)) {
+        return -1;
+    }
+    *scaled = integer;
+    return 0;
+}
+
+//// DOUBLE SCALE FUNCTION
+// Smallest power of ten that makes every double an integer, -1 if there is none
+static int find_scale(const char *data, size_t count) {
+    int scale = 0;
+    int64_t scaled;
+    for (size_t i = 0; i < count; i++) {
+        double number;
+        memcpy(&number, data + i * sizeof(double), sizeof(number));
+        while (scale_double(number, scale, &scaled) != 0) {
+            if (++scale > CODEC_MAX_SCALE) {
+                return -1;
+            }
+        }
+    }
+    return scale;
+}
+
+/////////////////////////////////////////////////// ENCODING ///////////////////////////////////////////////////
+
+//// STORE RAW FUNCTION
+static void store_raw(codec_job *job) {
+    job->entry.method = METHOD_RAW;
+    job->entry.size = job->entry.image_size;
+    job->payload = malloc(job->entry.image_size > 0 ? job->entry.image_size : 1);
+    memcpy(job->payload, job->data, job->entry.image_size);
+}
+
+//// ENCODE PACKED FUNCTION
+// Packs the values as offsets from the smallest one, or as differences from the one before, whichever is narrower
+static int encode_packed(codec_job *job) {
+    int width = kind_width(job->kind);
+    size_t count = job->entry.image_size / width;
+    if (count == 0 || count * width != job->entry.image_size) {
+        return -1;
+    }
+
+    // Doubles are packed as integers once a common power of ten makes every one of them exact
+    int doubles = job->kind == CODEC_DOUBLE;
+    int scale = doubles ? find_scale(job->data, count) : 0;
+    if (scale < 0) {
+        return -1;
+    }
+    uint64_t *values = malloc(count * sizeof(uint64_t));
+    for (size_t i = 0; i < count; i++) {
+        values[i] = read_value(job->data, i, width);
+        if (doubles) {
+            double number;
+            int64_t scaled;
+            memcpy(&number, &values[i], sizeof(number));
+            if (scale_double(number, scale, &scaled) != 0) {
+                free(values);
+                return -1;
+            }
+            values[i] = (uint64_t) scaled;
+        }
+    }
+
+    uint64_t smallest = values[0];
+    uint64_t largest = values[0];
+    uint64_t widest_delta = 0;
+    for (size_t i = 1; i < count; i++) {
+        smallest = values[i] < smallest ? values[i] : smallest;
+        largest = values[i] > largest ? values[i] : largest;
+        uint64_t delta = zigzag(values[i] - values[i - 1]);
+        widest_delta = delta > widest_delta ? delta : widest_delta;
+    }
+    int offset_bits = bit_length(largest - smallest);
+    int delta_bits = bit_length(widest_delta);
+    int delta = delta_bits < offset_bits;
+    int bits = delta ? delta_bits : offset_bits;
+    if (bits > CODEC_MAX_BITS || packed_size(count, bits) >= job->entry.image_size) {
+        free(values);
+        return -1;
+    }
+
+    // Rewritten in place, each difference only needs the value before it
+    uint64_t base = delta ? values[0] : smallest;
+    if (delta) {
+        for (size_t i = count - 1; i > 0; i--) {
+            values[i] = zigzag(values[i] - values[i - 1]);
+        }
+        values[0] = 0;
+    }
+    else {
+        for (size_t i = 0; i < count; i++) {
+            values[i] -= smallest;
+        }
+    }
+
+    job->payload = malloc(packed_size(count, bits));
+    job->entry.size = (uint32_t) pack(job->payload, values, count, bits);
+    job->entry.method = METHOD_PACKED;
+    job->entry.base = base;
+    job->entry.count = (uint32_t) count;
+    job->entry.width = (uint8_t) width;
+    job->entry.bits = (uint8_t) bits;
+    job->entry.flags = (uint8_t) ((delta ? CODEC_DELTA : 0) | (doubles ? CODEC_DOUBLES : 0));
+    job->entry.scale = (uint8_t) scale;
+    free(values);
+    return 0;
+}
+
+//// ENCODE DICTIONARY FUNCTION
+// Stores each distinct string once, in order of appearance, and every string as its bitpacked index
+static int encode_dictionary(codec_job *job) {
+    const char *data = job->data;
+    size_t size = job->entry.image_size;
+    if (size == 0 || data[size - 1] != '\0') {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (const char *end = data; end < data + size; end = (const char *) memchr(end, '\0', data + size - end) + 1) {
+        count++;
+    }
+
+    // Open addressing table of dictionary entries, holding their number plus one
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    uint32_t *table = calloc(capacity, sizeof(uint32_t));
+    uint32_t *starts = malloc(count * sizeof(uint32_t));
+    uint32_t *lengths = malloc(count * sizeof(uint32_t));
+    uint64_t *indices = malloc(count * sizeof(uint64_t));
+    uint32_t entries = 0;
+    size_t dictionary_size = 0;
+
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(data + start) + 1;
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t b = 0; b < length; b++) {
+            hash = (hash ^ (uint8_t) data[start + b]) * 1099511628211ull;
+        }
+
+        size_t slot = hash & (capacity - 1);
+        while (table[slot] != 0) {
+            uint32_t entry = table[slot] - 1;
+            if (lengths[entry] == length && memcmp(data + starts[entry], data + start, length) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (table[slot] == 0) {
+            starts[entries] = (uint32_t) start;
+            lengths[entries] = (uint32_t) length;
+            dictionary_size += length;
+            table[slot] = ++entries;
+        }
+        indices[i] = table[slot] - 1;
+        start += length;
+    }
+
+    int bits = bit_length(entries - 1);
+    int result = -1;
+    if (dictionary_size + packed_size(count, bits) < size) {
+        job->payload = malloc(dictionary_size + packed_size(count, bits));
+        char *out = job->payload;
+        for (uint32_t e = 0; e < entries; e++) {
+            memcpy(out, data + starts[e], lengths[e]);
+            out += lengths[e];
+        }
+        job->entry.size = (uint32_t) (dictionary_size + pack(out, indices, count, bits));
+        job->entry.method = METHOD_DICTIONARY;
+        job->entry.base = dictionary_size;
+        job->entry.count = (uint32_t) count;
+        job->entry.entries = entries;
+        job->entry.bits = (uint8_t) bits;
+        result = 0;
+    }
+
+    free(table);
+    free(starts);
+    free(lengths);
+    free(indices);
+    return result;
+}
+
+//// ENCODE BLOCK FUNCTION
+static void encode_block(codec_job *job) {
+    int encoded = -1;
+    if (job->kind == CODEC_STRINGS) {
+        encoded = encode_dictionary(job);
+    }
+    else if (job->kind != CODEC_BYTES) {
+        encoded = encode_packed(job);
+    }
+    if (encoded != 0) {
+        store_raw(job);
+    }
+    job->entry.checksum = checksum(job->payload, job->entry.size);
+}
+
+//// ENCODE THREAD FUNCTION
+static void *encode_range(void *argument) {
+    codec_work *work = argument;
+    for (uint32_t b = work->first; b < work->stop; b++) {
+        encode_block(&work->jobs[b]);
+    }
+    return NULL;
+}
+
+//// SPLIT REGION FUNCTION
+// Cuts a region into blocks, string blocks end after a terminator where one is close enough
+static size_t split_region(const codec_region *region, codec_job *jobs) {
+    size_t count = 0;
+    size_t start = 0;
+    while (start < region->size) {
+        size_t stop = region->size - start > CODEC_BLOCK_SIZE ? start + CODEC_BLOCK_SIZE : region->size;
+        if (region->kind == CODEC_STRINGS && stop < region->size) {
+            size_t cut = stop;
+            while (cut > start && region->data[cut - 1] != '\0') {
+                cut--;
+            }
+            stop = cut > start ? cut : stop;
+        }
+
+        if (jobs != NULL) {
+            codec_job *job = &jobs[count];
+            memset(job, 0, sizeof(codec_job));
+            job->data = region->data + start;
+            job->kind = region->kind;
+            job->entry.image_size = (uint32_t) (stop - start);
+        }
+        count++;
+        start = stop;
+    }
+    return count;
+}
+
+//// RUN THREADS FUNCTION
+// Splits the blocks between threads by count, the first range runs on this thread
+static int run_threads(codec_work *shared, uint32_t block_count, size_t image_size, void *(*function)(void *)) {
+    int threads = 1;
+#ifndef _WIN32
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (image_size >= CODEC_PARALLEL_SIZE && cores > 1) {
+        threads = cores < CODEC_MAX_THREADS ? (int) cores : CODEC_MAX_THREADS;
+    }
+#else
+    (void) image_size;
+#endif
+    if ((uint32_t) threads > block_count) {
+        threads = block_count > 0 ? (int) block_count : 1;
+    }
+
+    codec_work *work = malloc(threads * sizeof(codec_work));
+    for (int t = 0; t < threads; t++) {
+        work[t] = *shared;
+        work[t].first = (uint32_t) ((uint64_t) block_count * t / threads);
+        work[t].stop = (uint32_t) ((uint64_t) block_count * (t + 1) / threads);
+    }
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&work[t].thread, NULL, function, &work[t]);
+    }
+    function(&work[0]);
+    int failed = work[0].failed;
+    for (int t = 1; t < threads; t++) {
+        pthread_join(work[t].thread, NULL);
+        failed |= work[t].failed;
+    }
+    free(work);
+    return failed ? -1 : 0;
+}
+
+//// COMPRESS FUNCTION
+char *codec_compress(const codec_region *regions, int count, size_t *compressed_size) {
+    size_t block_count = 0;
+    size_t image_size = 0;
+    for (int r = 0; r < count; r++) {
+        block_count += split_region(&regions[r], NULL);
+        image_size += regions[r].size;
+    }
+    codec_job *jobs = calloc(block_count > 0 ? block_count : 1, sizeof(codec_job));
+    size_t next = 0;
+    for (int r = 0; r < count; r++) {
+        next += split_region(&regions[r], jobs + next);
+    }
+
+    codec_work shared = {0};
+    shared.jobs = jobs;
+    run_threads(&shared, (uint32_t) block_count, image_size, encode_range);
+
+    // Header, block table, then the payloads in order
+    size_t total = sizeof(codec_header) + block_count * sizeof(codec_block);
+    for (size_t b = 0; b < block_count; b++) {
+        jobs[b].entry.offset = total;
+        total += jobs[b].entry.size;
+    }
+    char *out = malloc(total);
+    codec_header header = {0};
+    memcpy(header.magic, CODEC_MAGIC, sizeof(header.magic));
+    header.version = CODEC_VERSION;
+    header.block_count = (uint32_t) block_count;
+    header.image_size = image_size;
+    memcpy(out, &header, sizeof(header));
+    for (size_t b = 0; b < block_count; b++) {
+        memcpy(out + sizeof(codec_header) + b * sizeof(codec_block), &jobs[b].entry, sizeof(codec_block));
+        memcpy(out + jobs[b].entry.offset, jobs[b].payload, jobs[b].entry.size);
+        free(jobs[b].payload);
+    }
+    free(jobs);
+
+    *compressed_size = total;
+    return out;
+}
+
+/////////////////////////////////////////////////// DECODING ///////////////////////////////////////////////////
+
+//// DECODE PACKED FUNCTION
+static int decode_packed(const codec_block *block, const char *in, char *out) {
+    int width = block->width;
+    int bits = block->bits;
+    size_t count = block->count;
+    if ((width != 1 && width != 4 && width != 8) || bits > CODEC_MAX_BITS || count * width != block->image_size ||
+        packed_size(count, bits) > block->size || ((block->flags & CODEC_DOUBLES) && width != 8) ||
+        block->scale > CODEC_MAX_SCALE) {
+        return -1;
+    }
+
+    uint64_t mask = bits == 0 ? 0 : (~(uint64_t) 0 >> (64 - bits));
+    int delta = block->flags & CODEC_DELTA;
+    int doubles = block->flags & CODEC_DOUBLES;
+    double divisor = powers_of_ten[block->scale];
+    uint64_t value = block->base;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t packed = unpack(in, i, bits, mask);
+        value = delta ? value + unzigzag(packed) : block->base + packed;
+
+        if (width == 1) {
+            out[i] = (char) value;
+        }
+        else if (width == 4) {
+            uint32_t narrow = (uint32_t) value;
+            memcpy(out + i * 4, &narrow, 4);
+        }
+        else if (doubles) {
+            double number = block->scale == 0 ? (double) (int64_t) value : (double) (int64_t) value / divisor;
+            memcpy(out + i * 8, &number, 8);
+        }
+        else {
+            memcpy(out + i * 8, &value, 8);
+        }
+    }
+    return 0;
+}
+
+//// DECODE DICTIONARY FUNCTION
+static int decode_dictionary(const codec_block *block, const char *in, char *out) {
+    size_t dictionary_size = block->base;
+    uint32_t entries = block->entries;
+    int bits = block->bits;
+    if (entries == 0 || bits > CODEC_MAX_BITS || dictionary_size == 0 || dictionary_size > block->size ||
+        packed_size(block->count, bits) > block->size - dictionary_size || in[dictionary_size - 1] != '\0') {
+        return -1;
+    }
+
+    // Find where each entry starts, there must be exactly as many as the block says
+    uint32_t *starts = malloc((size_t) entries * sizeof(uint32_t));
+    uint32_t *lengths = malloc((size_t) entries * sizeof(uint32_t));
+    size_t start = 0;
+    uint32_t found = 0;
+    while (start < dictionary_size && found < entries) {
+        const char *end = memchr(in + start, '\0', dictionary_size - start);
+        starts[found] = (uint32_t) start;
+        lengths[found] = (uint32_t) (end - in - start + 1);
+        start += lengths[found++];
+    }
+
+    int result = found == entries && start == dictionary_size ? 0 : -1;
+    const char *packed = in + dictionary_size;
+    uint64_t mask = bits == 0 ? 0 : (~(uint64_t) 0 >> (64 - bits));
+    size_t written = 0;
+    for (size_t i = 0; i < block->count && result == 0; i++) {
+        uint64_t entry = unpack(packed, i, bits, mask);
+        if (entry >= entries || lengths[entry] > block->image_size - written) {
+            result = -1;
+            break;
+        }
+        memcpy(out + written, in + starts[entry], lengths[entry]);
+        written += lengths[entry];
+    }
+    if (written != block->image_size) {
+        result = -1;
+    }
+
+    free(starts);
+    free(lengths);
+    return result;
+}
+
+//// DECODE THREAD FUNCTION
+static void *decode_range(void *argument) {
+    codec_work *work = argument;
+    for (uint32_t b = work->first; b < work->stop && !work->failed; b++) {
+        const codec_block *block = &work->blocks[b];
+        const char *in = work->data + block->offset;
+        char *out = work->image + work->starts[b];
+
+        if (checksum(in, block->size) != block->checksum) {
+            work->failed = 1;
+        }
+        else if (block->method == METHOD_RAW) {
+            work->failed = block->size != block->image_size;
+            if (!work->failed) {
+                memcpy(out, in, block->size);
+            }
+        }
+        else if (block->method == METHOD_PACKED) {
+            work->failed = decode_packed(block, in, out) != 0;
+        }
+        else if (block->method == METHOD_DICTIONARY) {
+            work->failed = decode_dictionary(block, in, out) != 0;
+        }
+        else {
+            work->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+//// DETECT FUNCTION
+int codec_detect(const char *data, size_t size) {
+    return size >= sizeof(codec_header) && memcmp(data, CODEC_MAGIC, 8) == 0;
+}
+
+//// DECOMPRESS FUNCTION
+char *codec_decompress(const char *data, size_t size, size_t *image_size) {
+    if (!codec_detect(data, size)) {
+        return NULL;
+    }
+    codec_header header;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != CODEC_VERSION ||
+        header.block_count > (size - sizeof(codec_header)) / sizeof(codec_block)) {
+        return NULL;
+    }
+
+    // The blocks must cover the image exactly, with their payloads inside the data
+    uint32_t block_count = header.block_count;
+    codec_block *blocks = malloc((block_count > 0 ? block_count : 1) * sizeof(codec_block));
+    uint64_t *starts = malloc((block_count > 0 ? block_count : 1) * sizeof(uint64_t));
+    memcpy(blocks, data + sizeof(codec_header), block_count * sizeof(codec_block));
+    uint64_t covered = 0;
+    int damaged = 0;
+    for (uint32_t b = 0; b < block_count && !damaged; b++) {
+        starts[b] = covered;
+        covered += blocks[b].image_size;
+        damaged = blocks[b].offset > size || blocks[b].size > size - blocks[b].offset ||
+                  covered > header.image_size;
+    }
+    char *image = NULL;
+    if (!damaged && covered == header.image_size && header.image_size <= SIZE_MAX) {
+        image = malloc(header.image_size > 0 ? (size_t) header.image_size : 1);
+    }
+
+    if (image != NULL) {
+        codec_work shared = {0};
+        shared.blocks = blocks;
+        shared.data = data;
+        shared.image = image;
+        shared.starts = starts;
+        if (run_threads(&shared, block_count, (size_t) header.image_size, decode_range) != 0) {
+            free(image);
+            image = NULL;
+        }
+    }
+
+    free(blocks);
+    free(starts);
+    *image_size = (size_t) header.image_size;
+    return image;
+}
@@ -0,0 +1,44 @@
+#ifndef ASSIGNMENT_CODEC_H
+#define ASSIGNMENT_CODEC_H
+
+#include <stddef.h>
+
+// How the bytes of a region are encoded: as they are, as columns of integers
+// or doubles of the given width, or as a pool of '\0' terminated strings
+typedef enum {
+    CODEC_BYTES,
+    CODEC_SMALL,
+    CODEC_INT32,
+    CODEC_UINT64,
+    CODEC_DOUBLE,
+    CODEC_STRINGS
+} codec_kind;
+
+// A piece of the image to compress, the regions follow each other in order
+typedef struct {
+    const char *data;
+    size_t size;
+    codec_kind kind;
+} codec_region;
+
+// Compresses the image made of 'regions' into blocks of at most
+// CODEC_BLOCK_SIZE bytes, each encoded on its own: integer columns as deltas
+// or offsets from their smallest value, bitpacked; doubles the same way when a
+// power of ten turns them all into integers; strings as a dictionary and
+// bitpacked indices. A block that doesn't get smaller is stored as it is, and
+// every block has a checksum.
+//
+// Returns the compressed data and its size in 'compressed_size', to be freed
+// by the caller.
+char *codec_compress(const codec_region *regions, int count, size_t *compressed_size);
+
+// Returns non-zero if 'data' starts like compressed data.
+int codec_detect(const char *data, size_t size);
+
+// Decompresses 'data' into a newly allocated image, its size in 'image_size'.
+// Large images are decoded by several threads, a block at a time.
+//
+// Returns NULL if a block is damaged or 'data' is not compressed data.
+char *codec_decompress(const char *data, size_t size, size_t *image_size);
+
+#endif //ASSIGNMENT_CODEC_H
@@ -0,0 +1,771 @@
+#include "csv.h"
+#include "model.h"
+#include "model_internal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CSV_MMAP 1
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CSV_AVX2 1
+#endif
+
+// Bytes parsed at a time, the model lock is held while one block is stored
+#define CSV_BLOCK_SIZE (1 << 16)
+
+// Mapped files at least this large are split between threads, smaller ones are not worth starting them for
+#define CSV_PARALLEL_SIZE (4 << 20)
+#define CSV_MAX_THREADS 16
+
+// Fields stored per lock while merging the threads' results, split between the threads
+#define CSV_MERGE_SLICE (1 << 16)
+
+// Rows exported per lock, and the output collected before it is written
+#define CSV_EXPORT_ROWS 1024
+#define CSV_EXPORT_BUFFER (1 << 20)
+
+// Longest number the exporter writes, snprintf's output for huge fixed precision values is cut off here
+#define CSV_NUMBER_SIZE 352
+
+// Finds the first delimiter, quote or line break between 'c' and 'end', or returns 'end'
+typedef const char *(*scan_function)(const char *c, const char *end, char delimiter);
+
+///// BUFFER OF PARSED FIELDS
+// Fields parsed by a thread, waiting to be stored. Their rows are counted from the start of the thread's chunk.
+typedef struct {
+    cell_input *fields;
+    size_t count;
+    size_t capacity;
+} csv_buffer;
+
+///// IMPORT STATE
+// Carried from one block to the next, a field or record may span blocks
+typedef struct {
+    char delimiter;
+    scan_function scan;
+
+    // Parsed fields go here instead of the model when set
+    csv_buffer *out;
+
+    // Position the next field is stored at
+    ROW row;
+    COL col;
+    COL first_col;
+
+    // Text of the current field, reused for every field
+    char *field;
+    size_t length;
+    size_t capacity;
+
+    // Inside a quoted field, and whether the last character in it was a quote
+    int quoted;
+    int quote_seen;
+
+    // Characters seen in the current record, so blank lines are not records
+    int record_started;
+    long records;
+} csv_state;
+
+/////////////////////////////////////////////////// BYTE SCANNING ///////////////////////////////////////////////////
+
+//// SCALAR SCAN FUNCTION
+static const char *scan_plain_scalar(const char *c, const char *end, char delimiter) {
+    while (c < end && *c != delimiter && *c != '\n' && *c != '\r' && *c != '"') {
+        c++;
+    }
+    return c;
+}
+
+#if defined(__SSE2__)
+//// SSE2 SCAN FUNCTION
+// Compares 16 bytes at a time against the four special characters
+static const char *scan_plain_sse2(const char *c, const char *end, char delimiter) {
+    const __m128i delimiters = _mm_set1_epi8(delimiter);
+    const __m128i newlines = _mm_set1_epi8('\n');
+    const __m128i returns = _mm_set1_epi8('\r');
+    const __m128i quotes = _mm_set1_epi8('"');
+
+    while (end - c >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) c);
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, delimiters), _mm_cmpeq_epi8(bytes, newlines)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(bytes, returns), _mm_cmpeq_epi8(bytes, quotes)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return c + __builtin_ctz(mask);
+        }
+        c += 16;
+    }
+
+    // The tail is shorter than a vector
+    return scan_plain_scalar(c, end, delimiter);
+}
+#endif
+
+#if defined(CSV_AVX2)
+//// AVX2 SCAN FUNCTION
+// Same as the SSE2 scan with 32 bytes at a time, only used when the processor has AVX2
+__attribute__((target("avx2")))
+static const char *scan_plain_avx2(const char *c, const char *end, char delimiter) {
+    const __m256i delimiters = _mm256_set1_epi8(delimiter);
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    const __m256i returns = _mm256_set1_epi8('\r');
+    const __m256i quotes = _mm256_set1_epi8('"');
+
+    while (end - c >= 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) c);
+        __m256i special = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, delimiters), _mm256_cmpeq_epi8(bytes, newlines)),
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, returns), _mm256_cmpeq_epi8(bytes, quotes)));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(special);
+        if (mask != 0) {
+            return c + __builtin_ctz(mask);
+        }
+        c += 32;
+    }
+
+    return scan_plain_scalar(c, end, delimiter);
+}
+#endif
+
+//// PICK SCAN FUNCTION
+// The widest scan the processor supports
+static scan_function pick_scan() {
+#if defined(CSV_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_plain_avx2;
+    }
+#endif
+#if defined(__SSE2__)
+    return scan_plain_sse2;
+#else
+    return scan_plain_scalar;
+#endif
+}
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// APPEND TO FIELD FUNCTION
+static void append_field(csv_state *state, const char *text, size_t length) {
+    if (state->length + length + 1 > state->capacity) {
+        while (state->length + length + 1 > state->capacity) {
+            state->capacity = state->capacity == 0 ? 64 : state->capacity * 2;
+        }
+        state->field = realloc(state->field, state->capacity);
+    }
+    memcpy(state->field + state->length, text, length);
+    state->length += length;
+}
+
+//// STORE FIELD FUNCTION
+// Stores the text in the current cell and moves to the next column. Fields off the sheet are dropped, a
+// thread's rows only grow when its chunk is merged so merging drops the rest.
+static void store_field(csv_state *state, const char *field, size_t length) {
+    // The cell owns its input, the only allocation per field
+    if (length > 0 && (int) state->col < SHEET_COLS && (int) state->row < SHEET_ROWS) {
+        char *text = malloc(length + 1);
+        memcpy(text, field, length);
+        text[length] = '\0';
+
+        // A thread keeps the field until its chunk is merged
+        if (state->out != NULL) {
+            csv_buffer *out = state->out;
+            if (out->count == out->capacity) {
+                out->capacity = out->capacity == 0 ? 1024 : out->capacity * 2;
+                out->fields = realloc(out->fields, out->capacity * sizeof(cell_input));
+            }
+            out->fields[out->count].row = state->row;
+            out->fields[out->count].col = state->col;
+            out->fields[out->count].text = text;
+            out->count++;
+        }
+        else {
+            store_cell_input(state->row, state->col, text);
+        }
+    }
+
+    state->col++;
+    state->length = 0;
+    state->quote_seen = 0;
+}
+
+//// END OF RECORD FUNCTION
+// Stores the last field of the record and moves to the next row
+static void end_record(csv_state *state, const char *field, size_t length) {
+    if (state->record_started) {
+        store_field(state, field, length);
+        state->records++;
+        state->row++;
+    }
+    state->col = state->first_col;
+    state->record_started = 0;
+}
+
+//// PARSE BLOCK FUNCTION
+// Splits a block into fields. A field that is whole in the block goes straight
+// to its cell, only fields split across blocks or with quotes use the field buffer.
+static void parse_block(csv_state *state, const char *block, size_t size) {
+    const char *end = block + size;
+    const char *c = block;
+
+    while (c < end) {
+        if (state->quoted) {
+            // A quote ends the field unless another one follows it
+            if (state->quote_seen) {
+                state->quote_seen = 0;
+                if (*c == '"') {
+                    append_field(state, "\"", 1);
+                    c++;
+                    continue;
+                }
+                state->quoted = 0;
+                continue;
+            }
+
+            // Copy up to the next quote, delimiters and line breaks included
+            const char *quote = memchr(c, '"', end - c);
+            const char *stop = quote == NULL ? end : quote;
+            append_field(state, c, stop - c);
+            c = stop;
+            if (quote != NULL) {
+                state->quote_seen = 1;
+                c++;
+            }
+            continue;
+        }
+
+        // Find the next character that means something
+        const char *run = c;
+        c = state->scan(c, end, state->delimiter);
+        if (c > run) {
+            state->record_started = 1;
+        }
+
+        // The field continues in the next block
+        if (c == end) {
+            append_field(state, run, c - run);
+            break;
+        }
+
+        // The field is the run, unless part of it is already in the field buffer
+        const char *field = run;
+        size_t length = c - run;
+        if (state->length > 0 || *c == '"' || *c == '\r') {
+            append_field(state, run, c - run);
+            field = state->field;
+            length = state->length;
+        }
+
+        if (*c == state->delimiter) {
+            state->record_started = 1;
+            store_field(state, field, length);
+        }
+        else if (*c == '\n') {
+            end_record(state, field, length);
+        }
+
+        // A quote opens a quoted field, quotes inside a plain field are kept
+        else if (*c == '"') {
+            if (state->length == 0) {
+                state->quoted = 1;
+            }
+            else {
+                append_field(state, "\"", 1);
+            }
+            state->record_started = 1;
+        }
+
+        // A '\r' is dropped, so CRLF line endings work
+        c++;
+    }
+}
+
+/////////////////////////////////////////////////// IMPORT ///////////////////////////////////////////////////
+
+//// IMPORT BLOCKS FUNCTION
+// Parses 'size' bytes one block at a time, letting the interface in between blocks
+static void import_blocks(csv_state *state, const char *text, size_t size) {
+    while (size > 0) {
+        size_t block = size < CSV_BLOCK_SIZE ? size : CSV_BLOCK_SIZE;
+        model_lock_acquire();
+        parse_block(state, text, block);
+        model_lock_release();
+        text += block;
+        size -= block;
+    }
+}
+
+//// SKIP BYTE ORDER MARK FUNCTION
+// Returns how many bytes of a UTF-8 byte order mark start the text
+static size_t byte_order_mark(const char *text, size_t size) {
+    return size >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+}
+
+#if defined(CSV_MMAP)
+///// CHUNK OF A MAPPED FILE
+// Parsed by its own thread, as if it started at the beginning of a record
+typedef struct {
+    const char *text;
+    size_t size;
+    csv_state state;
+    csv_buffer buffer;
+    pthread_t thread;
+} csv_chunk;
+
+//// PARSE CHUNK FUNCTION (thread)
+static void *parse_chunk(void *argument) {
+    csv_chunk *chunk = argument;
+    parse_block(&chunk->state, chunk->text, chunk->size);
+    return NULL;
+}
+
+//// MERGE CHUNK FUNCTION
+// Stores a chunk's fields in order, its first record going into row 'row'. The cells are created by 'threads'
+// threads, each in its own part of the cells. Fields that end up past the last row are dropped.
+static void merge_chunk(csv_chunk *chunk, ROW row, int threads) {
+    for (size_t f = 0; f < chunk->buffer.count; f++) {
+        if ((long) chunk->buffer.fields[f].row + (int) row >= SHEET_ROWS) {
+            for (size_t g = f; g < chunk->buffer.count; g++) {
+                free(chunk->buffer.fields[g].text);
+            }
+            chunk->buffer.count = f;
+            break;
+        }
+        chunk->buffer.fields[f].row += row;
+    }
+    for (size_t i = 0; i < chunk->buffer.count; i += CSV_MERGE_SLICE) {
+        size_t stop = i + CSV_MERGE_SLICE < chunk->buffer.count ? i + CSV_MERGE_SLICE : chunk->buffer.count;
+        model_lock_acquire();
+        store_raw_inputs(chunk->buffer.fields + i, (int) (stop - i), threads);
+        model_lock_release();
+    }
+    free(chunk->buffer.fields);
+}
+
+//// IMPORT PARALLEL FUNCTION
+// Splits the text after line breaks and parses the pieces on separate threads.
+// A split is only a guess, the line break may be inside a quoted field. Each
+// chunk is checked when the one before it is merged: if that one did not end
+// cleanly between records, the chunk is parsed again in order.
+static void import_parallel(csv_state *state, const char *text, size_t size, int threads) {
+    csv_chunk *chunks = calloc(threads, sizeof(csv_chunk));
+
+    // Cut after the first line break past each even split
+    size_t start = 0;
+    for (int i = 0; i < threads; i++) {
+        size_t stop = size;
+        if (i < threads - 1 && size * (i + 1) / threads > start) {
+            const char *newline = memchr(text + size * (i + 1) / threads, '\n', size - size * (i + 1) / threads);
+            stop = newline == NULL ? size : (size_t) (newline - text) + 1;
+        }
+        if (stop < start) {
+            stop = start;
+        }
+
+        csv_chunk *chunk = &chunks[i];
+        chunk->text = text + start;
+        chunk->size = stop - start;
+        chunk->state = *state;
+        chunk->state.out = &chunk->buffer;
+        chunk->state.row = 0;
+        start = stop;
+    }
+
+    // Parse every chunk on its own thread, the first one on this thread
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&chunks[i].thread, NULL, parse_chunk, &chunks[i]);
+    }
+    parse_chunk(&chunks[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(chunks[i].thread, NULL);
+    }
+
+    // Merge in order. After a chunk that did not end between records, the next
+    // one is parsed again from where it really is, until one ends cleanly again.
+    ROW row = state->row;
+    long records = 0;
+    csv_state carry = {0};
+    int carrying = 0;
+    for (int i = 0; i < threads; i++) {
+        csv_chunk *chunk = &chunks[i];
+        csv_state *ended = &chunk->state;
+
+        if (!carrying) {
+            merge_chunk(chunk, row, threads);
+            row += chunk->state.records;
+            records += chunk->state.records;
+        }
+
+        // Drop what the thread parsed from a wrong guess, parse it with the real state
+        else {
+            for (size_t f = 0; f < chunk->buffer.count; f++) {
+                free(chunk->buffer.fields[f].text);
+            }
+            free(chunk->buffer.fields);
+            free(chunk->state.field);
+            import_blocks(&carry, chunk->text, chunk->size);
+            row = carry.row;
+            records = carry.records;
+            ended = &carry;
+        }
+
+        // The last chunk's state is handed back, it may hold an unfinished record
+        int clean = !ended->quoted && !ended->record_started;
+        if (i == threads - 1 || !clean) {
+            if (!carrying) {
+                carry = chunk->state;
+                carry.out = NULL;
+                carry.row = row;
+                carry.records = records;
+            }
+            carrying = 1;
+        }
+        else {
+            free(ended->field);
+            carrying = 0;
+        }
+    }
+
+    *state = carry;
+    free(chunks);
+}
+
+//// IMPORT MAPPED FUNCTION
+// Maps the whole file and parses it in place, returns -1 if it can't be mapped
+static int import_mapped(const char *path, csv_state *state) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Only regular, non-empty files can be mapped
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t) info.st_size;
+    char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        return -1;
+    }
+
+    // The file is read once from front to back
+    madvise(text, size, MADV_SEQUENTIAL);
+
+    // Large files are split between threads when there is more than one core
+    size_t skip = byte_order_mark(text, size);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (size - skip >= CSV_PARALLEL_SIZE && cores > 1) {
+        import_parallel(state, text + skip, size - skip, cores < CSV_MAX_THREADS ? (int) cores : CSV_MAX_THREADS);
+    }
+    else {
+        import_blocks(state, text + skip, size - skip);
+    }
+    munmap(text, size);
+    return 0;
+}
+#endif
+
+//// IMPORT STREAMED FUNCTION
+// Reads the file one block at a time, returns -1 if it can't be read
+static int import_streamed(const char *path, csv_state *state) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    char *block = malloc(CSV_BLOCK_SIZE);
+    size_t size;
+    int first_block = 1;
+    while ((size = fread(block, 1, CSV_BLOCK_SIZE, in)) > 0) {
+        size_t skip = first_block ? byte_order_mark(block, size) : 0;
+        first_block = 0;
+        import_blocks(state, block + skip, size - skip);
+    }
+
+    int failed = ferror(in);
+    fclose(in);
+    free(block);
+    return failed ? -1 : 0;
+}
+
+//// CSV IMPORT FUNCTION
+long csv_import(const char *path, char delimiter, ROW first_row, COL first_col) {
+    csv_state state = {0};
+    state.delimiter = delimiter;
+    state.scan = pick_scan();
+    state.row = first_row;
+    state.col = first_col;
+    state.first_col = first_col;
+
+    // Everything imported is parsed, linked and recalculated together at the end
+    model_begin_import();
+
+    // Map the file when possible, else fall back to reading it
+    int failed = -1;
+#if defined(CSV_MMAP)
+    failed = import_mapped(path, &state);
+#endif
+    if (failed) {
+        failed = import_streamed(path, &state);
+    }
+
+    // The last record may not end with a line break
+    model_lock_acquire();
+    end_record(&state, state.field, state.length);
+    model_lock_release();
+    model_commit_batch();
+
+    // Records past the last row of the sheet were not stored
+    free(state.field);
+    long rows = SHEET_ROWS - (long) first_row;
+    return failed ? -1 : state.records < rows ? state.records : rows;
+}
+
+/////////////////////////////////////////////////// EXPORT ///////////////////////////////////////////////////
+
+///// OUTPUT BUFFER
+// Records are formatted here and written out in large pieces
+typedef struct {
+    char *bytes;
+    size_t size;
+    size_t capacity;
+} csv_output;
+
+// Two digit pairs per index, so numbers are written two digits at a time
+static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+// Doubles from here on are not all integers
+#define CSV_EXACT_LIMIT 9007199254740992.0
+
+// Powers of ten that are exact as doubles
+static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+                                       1e14, 1e15, 1e16, 1e17};
+
+//// RESERVE OUTPUT FUNCTION
+static char *reserve_output(csv_output *output, size_t size) {
+    if (output->size + size > output->capacity) {
+        while (output->size + size > output->capacity) {
+            output->capacity = output->capacity == 0 ? CSV_EXPORT_BUFFER : output->capacity * 2;
+        }
+        output->bytes = realloc(output->bytes, output->capacity);
+    }
+    return output->bytes + output->size;
+}
+
+//// FORMAT DIGITS FUNCTION
+// Writes 'value' with at least 'min_digits' digits, zero padded, returns the end
+static char *format_digits(char *out, uint64_t value, int min_digits) {
+    char digits[24];
+    char *start = digits + sizeof(digits);
+    while (value >= 100) {
+        start -= 2;
+        memcpy(start, digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, digit_pairs + value * 2, 2);
+    }
+    else {
+        *--start = (char) ('0' + value);
+    }
+    while (digits + sizeof(digits) - start < min_digits) {
+        *--start = '0';
+    }
+
+    size_t length = digits + sizeof(digits) - start;
+    memcpy(out, start, length);
+    return out + length;
+}
+
+//// FORMAT NUMBER FUNCTION
+// Writes 'value' with 'precision' decimals, or with a negative precision the fewest digits that read back as
+// the same double. Values that don't fit the integer fast paths go through snprintf. Returns the length.
+static int format_number(char *out, double value, int precision) {
+    char *end = out;
+    double magnitude = value < 0 ? -value : value;
+    // Scaled to an integer, 'decimals' of its digits go after the point
+    double scaled = -1;
+    int decimals = 0;
+    int powers = (int) (sizeof(powers_of_ten) / sizeof(double));
+    if (precision >= 0 && precision < powers && magnitude * powers_of_ten[precision] < CSV_EXACT_LIMIT) {
+        scaled = (double) (uint64_t) (magnitude * powers_of_ten[precision] + 0.5);
+        decimals = precision;
+    }
+
+    // The first scale that is an exact integer and divides back to the value, correctly rounded both ways
+    else if (precision < 0) {
+        for (int k = 0; k < powers && magnitude * powers_of_ten[k] < CSV_EXACT_LIMIT; k++) {
+            double candidate = (double) (uint64_t) (magnitude * powers_of_ten[k] + 0.5);
+            if (candidate / powers_of_ten[k] == magnitude) {
+                scaled = candidate;
+                decimals = k;
+                break;
+            }
+        }
+    }
+
+    // Too large or too precise for the fast path
+    if (scaled < 0) {
+        if (precision >= 0) {
+            int length = snprintf(out, CSV_NUMBER_SIZE, "%.*f", precision, value);
+            return length < CSV_NUMBER_SIZE ? length : CSV_NUMBER_SIZE - 1;
+        }
+        for (int digits = 15; digits < 17; digits++) {
+            int length = snprintf(out, CSV_NUMBER_SIZE, "%.*g", digits, value);
+            if (strtod(out, NULL) == value) {
+                return length;
+            }
+        }
+        return snprintf(out, CSV_NUMBER_SIZE, "%.17g", value);
+    }
+
+    if (value < 0) {
+        *end++ = '-';
+    }
+    uint64_t integer = (uint64_t) scaled;
+    uint64_t divisor = (uint64_t) powers_of_ten[decimals];
+    end = format_digits(end, integer / divisor, 1);
+    if (decimals > 0) {
+        *end++ = '.';
+        end = format_digits(end, integer % divisor, decimals);
+    }
+    return (int) (end - out);
+}
+
+//// WRITE TEXT FIELD FUNCTION
+// Quoted when it holds a delimiter, quote or line break, with quotes doubled
+static void write_text(csv_output *output, const char *text, char delimiter) {
+    size_t length = strlen(text);
+    int quotes = 0;
+    int special = 0;
+    for (size_t i = 0; i < length; i++) {
+        quotes += text[i] == '"';
+        special |= text[i] == delimiter || text[i] == '"' || text[i] == '\n' || text[i] == '\r';
+    }
+
+    char *out = reserve_output(output, length + quotes + 2);
+    if (!special) {
+        memcpy(out, text, length);
+        output->size += length;
+        return;
+    }
+
+    char *start = out;
+    *out++ = '"';
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '"') {
+            *out++ = '"';
+        }
+        *out++ = text[i];
+    }
+    *out++ = '"';
+    output->size += out - start;
+}
+
+//// WRITE CELL FUNCTION
+static void write_cell(csv_output *output, cell *current, char delimiter, int inputs, int precision) {
+    // Plain cells are written as they were typed either way
+    if (inputs || current->formula == NULL) {
+        write_text(output, current->original_input, delimiter);
+        return;
+    }
+
+    // A formula still waiting for the worker is brought up to date first
+    if (current->dirty) {
+        recalc_cell(current);
+    }
+    if (current->type == NUMBER) {
+        char *out = reserve_output(output, CSV_NUMBER_SIZE);
+        output->size += format_number(out, current->content.number_value, precision);
+    }
+    else if (current->type == TEXT || current->type == ERROR) {
+        write_text(output, current->content.text_value, delimiter);
+    }
+}
+
+//// FLUSH OUTPUT FUNCTION
+static int flush_output(csv_output *output, FILE *out) {
+    int failed = output->size > 0 && fwrite(output->bytes, 1, output->size, out) != output->size;
+    output->size = 0;
+    return failed ? -1 : 0;
+}
+
+//// CSV EXPORT FUNCTION
+long csv_export(const char *path, char delimiter, ROW first_row, COL first_col, ROW last_row, COL last_col,
+                int inputs, int precision) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+
+    // An open end reaches the last cell of the sheet
+    model_lock_acquire();
+    if ((int) last_row < 0 || (int) last_col < 0) {
+        int max_row = -1;
+        int max_col = -1;
+        for (int i = 0; i < spreadsheet_size; i++) {
+            for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+                max_row = (int) entry->value.row > max_row ? (int) entry->value.row : max_row;
+                max_col = (int) entry->value.col > max_col ? (int) entry->value.col : max_col;
+            }
+        }
+        tiles_extent(&max_row, &max_col);
+        last_row = (int) last_row < 0 ? (ROW) max_row : last_row;
+        last_col = (int) last_col < 0 ? (COL) max_col : last_col;
+    }
+    model_lock_release();
+
+    // Rows are formatted a slice at a time with the model lock held, and written without it
+    csv_output output = {0};
+    int failed = 0;
+    long rows = 0;
+    for (long row = (int) first_row; row <= (int) last_row && !failed; ) {
+        model_lock_acquire();
+        flag_pending_cells();
+        for (long slice_end = row + CSV_EXPORT_ROWS; row <= (int) last_row && row < slice_end; row++, rows++) {
+            for (long col = (int) first_col; col <= (int) last_col; col++) {
+                if (col > (int) first_col) {
+                    *reserve_output(&output, 1) = delimiter;
+                    output.size++;
+                }
+                cell *current = find_cell((ROW) row, (COL) col);
+                if (current != NULL) {
+                    write_cell(&output, current, delimiter, inputs, precision);
+                }
+            }
+            *reserve_output(&output, 1) = '\n';
+            output.size++;
+        }
+        model_lock_release();
+
+        if (output.size >= CSV_EXPORT_BUFFER) {
+            failed = flush_output(&output, out);
+        }
+    }
+
+    failed = failed || flush_output(&output, out) != 0;
+    free(output.bytes);
+    if (fclose(out) != 0 || failed) {
+        return -1;
+    }
+    return rows;
+}
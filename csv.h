@@ -0,0 +1,42 @@
+#ifndef ASSIGNMENT_CSV_H
+#define ASSIGNMENT_CSV_H
+
+#include "defs.h"
+
+// Imports the delimited file at 'path' into the model, ',' for CSV or '\t'
+// for TSV. The first record goes into 'first_row', its first field into
+// 'first_col'.
+//
+// Regular files are memory mapped and parsed in place, anything else is read
+// in fixed size blocks, so the file may be larger than memory either way.
+// Large mapped files are split into chunks parsed by one thread per core, and
+// the chunks are stored in row order, the same threads each creating the
+// cells in their share of the cell store.
+// Quoted fields may contain delimiters, line breaks and doubled quotes. Each
+// field is stored as if it was typed into its cell, empty fields leave their
+// cell as it was. Fields past the last column of the sheet, and records past
+// its last row, are skipped. Everything is parsed, and formulas linked to their
+// precedents and recalculated, once, after the whole file.
+//
+// Returns the number of records imported, or -1 if the file can't be read.
+long csv_import(const char *path, char delimiter, ROW first_row, COL first_col);
+
+// Exports the cells from 'first_row', 'first_col' to 'last_row', 'last_col'
+// (inclusive) to the file at 'path', one record per row, separated by
+// 'delimiter'. A negative 'last_row' or 'last_col' extends the range to the
+// last cell of the sheet.
+//
+// With 'inputs' set, every cell is written as it was typed. Otherwise
+// formulas are written as their results, recalculated first if they are
+// pending: numbers with 'precision' decimals, or with the fewest digits that
+// read back as the same value if 'precision' is negative. Empty cells are
+// empty fields, and fields with delimiters, quotes or line breaks are quoted.
+//
+// Rows are formatted a slice at a time, so edits and recalculation go on
+// during a long export, and written out in large blocks.
+//
+// Returns the number of records written, or -1 if the file can't be written.
+long csv_export(const char *path, char delimiter, ROW first_row, COL first_col, ROW last_row, COL last_col,
+                int inputs, int precision);
+
+#endif //ASSIGNMENT_CSV_H
@@ -4,6 +4,10 @@
 #define NUM_ROWS 10
 #define NUM_COLS 7
 
+// Rows and columns a sheet can hold. Formulas name columns by a single letter.
+#define SHEET_ROWS 1048576
+#define SHEET_COLS 26
+
 // Rows of the spreadsheet.
 // NOTE: enums are 0-based, so the constant 'ROW_1' has the numerical value 0.
 typedef enum {
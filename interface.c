@@ -1,5 +1,12 @@
 #include "interface.h"
+#include "arrow.h"
+#include "csv.h"
+#include "journal.h"
+#include "json.h"
 #include "model.h"
+#include "snapshot.h"
+#include "tiles.h"
+#include "workbook.h"
 
 #include <ctype.h>
 #include <errno.h>
@@ -9,13 +16,40 @@
 
 #define DEFAULT_EDIT_SIZE 128
 
+// Number of entries per section in the profiling report.
+#define PROFILE_REPORT_SIZE 20
+
+// How often results from the recalculation worker are drawn while waiting for a key.
+#define DISPLAY_REFRESH_MS 50
+
 // Current cur_row and column.
 static ROW cur_row = ROW_1;
 static COL cur_col = COL_A;
 
+// First row and column in view, and how many fit in the terminal.
+static ROW view_top = ROW_1;
+static COL view_left = COL_A;
+static int grid_rows = NUM_ROWS;
+static int grid_cols = NUM_COLS;
+
+// Size of the drawn grid, and a line of blanks as wide.
+static size_t total_width = 0;
+static size_t total_height = 0;
+static char *blanks = NULL;
+
 // Column to return to when pressing <enter>.
 static COL return_col = COL_A;
 
+// File the recalculation profile is written to on exit, if profiling.
+static const char *profile_path = NULL;
+
+// Formats a workbook can be saved in, chosen by the extension of its file.
+typedef enum { WORKBOOK_TEXT, WORKBOOK_SNAPSHOT, WORKBOOK_COMPRESSED, WORKBOOK_TILES } workbook_format;
+
+// Workbook given on the command line, saved with Ctrl+S, and its format.
+static const char *workbook_path = NULL;
+static workbook_format workbook_kind = WORKBOOK_TEXT;
+
 // Current editable text.
 static char *edit_text = NULL;
 static size_t edit_text_capacity = 0;
@@ -24,8 +58,8 @@ static size_t edit_position = 0;
 static size_t edit_display_offset = 0;
 
 static void set_cell_attr(attr_t attr) {
-    mvchgat(2 * ((int) cur_row + 2) + 1, (CELL_DISPLAY_WIDTH + 1) * (cur_col + 1) + 1, CELL_DISPLAY_WIDTH, attr, 0,
-            NULL);
+    mvchgat(2 * ((int) (cur_row - view_top) + 2) + 1, (CELL_DISPLAY_WIDTH + 1) * (cur_col - view_left + 1) + 1,
+            CELL_DISPLAY_WIDTH, attr, 0, NULL);
 }
 
 static void ensure_edit_text_capacity(size_t capacity) {
@@ -47,30 +81,77 @@ static void ensure_edit_text_capacity(size_t capacity) {
     edit_text_capacity = capacity;
 }
 
-int main() {
-    /* INITIALIZATION */
+// Loads or saves the workbook in its format.
+static int load_workbook(void) {
+    if (workbook_kind == WORKBOOK_SNAPSHOT || workbook_kind == WORKBOOK_COMPRESSED)
+        return snapshot_load(workbook_path);
+    if (workbook_kind == WORKBOOK_TILES)
+        return tiles_load(workbook_path);
+    return workbook_load(workbook_path);
+}
 
-    // Initialize NCURSES.
-    initscr();
+static int save_workbook(void) {
+    if (workbook_kind == WORKBOOK_SNAPSHOT)
+        return snapshot_save(workbook_path);
+    if (workbook_kind == WORKBOOK_COMPRESSED)
+        return snapshot_save_compressed(workbook_path);
+    if (workbook_kind == WORKBOOK_TILES)
+        return tiles_save(workbook_path);
+    return workbook_save(workbook_path);
+}
 
-    // Enable raw characters for control sequences.
-    raw();
+// Restores the terminal before exiting.
+static void finish(void) {
+    endwin();
+    journal_close();
+    if (profile_path != NULL)
+        model_profile_report(profile_path, PROFILE_REPORT_SIZE);
+}
 
-    // Disable automatic echo of typed characters.
-    noecho();
+// Reads the next key, drawing results from the recalculation worker while waiting.
+static int read_key(bool highlight) {
+    while (true) {
+        // Flushing moves the cursor and overwrites the highlight, so restore both.
+        int y, x;
+        getyx(stdscr, y, x);
+        if (model_flush_display() > 0 && highlight)
+            set_cell_attr(A_REVERSE);
+        move(y, x);
+        refresh();
 
-    // Enable input of function keys.
-    keypad(stdscr, true);
+        int c = getch();
+        if (c != ERR)
+            return c;
+    }
+}
 
-    /* DRAW BORDERS */
+// Sizes the grid to the terminal, leaving a line below it for the instructions.
+static void fit_grid(void) {
+    grid_rows = (LINES - 2) / 2 - 2;
+    grid_cols = COLS / (CELL_DISPLAY_WIDTH + 1) - 1;
+    if (grid_rows < 1)
+        grid_rows = 1;
+    if (grid_rows > SHEET_ROWS)
+        grid_rows = SHEET_ROWS;
+    if (grid_cols < 1)
+        grid_cols = 1;
+    if (grid_cols > SHEET_COLS)
+        grid_cols = SHEET_COLS;
 
     // Include extra column to the left for cur_row numbers.
-    const size_t total_width = (NUM_COLS + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
+    total_width = (size_t) (grid_cols + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
     // Include two extra rows on top for edit field and cur_row numbers.
-    const size_t total_height = (NUM_ROWS + 2) * 2 + 1;
+    total_height = (size_t) (grid_rows + 2) * 2 + 1;
 
-    // Resize window.
-    resizeterm(total_height + 1, total_width);
+    // String of blanks used by main loop.
+    blanks = realloc(blanks, total_width + 1);
+    memset(blanks, ' ', total_width);
+    blanks[total_width] = 0;
+}
+
+// Draws the lines of the grid and the instructions below it.
+static void draw_borders(void) {
+    erase();
 
     // Draw the top line.
     addch(ACS_ULCORNER);
@@ -79,10 +160,10 @@ int main() {
     addch(ACS_URCORNER);
 
     // Draw the left/right and interior lines.
-    for (size_t i = 0; i < NUM_ROWS + 2; i++) {
+    for (size_t i = 0; i < (size_t) grid_rows + 2; i++) {
         if (i > 0) {
             mvaddch(2 * i, 0, ACS_LTEE);
-            for (size_t j = 0; j < NUM_COLS + 1; j++) {
+            for (size_t j = 0; j < (size_t) grid_cols + 1; j++) {
                 if (j > 0)
                     addch(i == 1 ? ACS_TTEE : ACS_PLUS);
                 for (size_t k = 0; k < CELL_DISPLAY_WIDTH; k++)
@@ -92,14 +173,14 @@ int main() {
         }
         mvaddch(2 * i + 1, 0, ACS_VLINE);
         if (i > 0)
-            for (size_t j = 1; j < NUM_COLS + 1; j++)
+            for (size_t j = 1; j < (size_t) grid_cols + 1; j++)
                 mvaddch(2 * i + 1, (CELL_DISPLAY_WIDTH + 1) * j, ACS_VLINE);
         mvaddch(2 * i + 1, total_width - 1, ACS_VLINE);
     }
 
     // Draw the bottom line.
     mvaddch(total_height - 1, 0, ACS_LLCORNER);
-    for (size_t i = 0; i < NUM_COLS + 1; i++) {
+    for (size_t i = 0; i < (size_t) grid_cols + 1; i++) {
         if (i > 0)
             addch(ACS_BTEE);
         for (size_t j = 0; j < CELL_DISPLAY_WIDTH; j++)
@@ -107,35 +188,153 @@ int main() {
     }
     addch(ACS_LRCORNER);
 
-    // Draw exit instructions.
-    mvaddstr(total_height, 0, "Press Ctrl+C to exit.");
-
-    /* HEADERS */
+    // Draw exit instructions, and how to save when a workbook was given.
+    mvaddstr(total_height, 0, workbook_path != NULL ? "Press Ctrl+S to save, Ctrl+E to export, Ctrl+C to exit."
+                                                    : "Press Ctrl+C to exit.");
+}
 
+// Draws the headers of the rows and columns in view and blanks their cells. The model then
+// queues the cells there that hold something, so a scroll costs the same however large the sheet.
+static void show_viewport(void) {
     // Print the column headers.
-    for (COL col = COL_A; col < NUM_COLS; col++)
-        mvaddch(3, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + CELL_DISPLAY_WIDTH / 2 + 1, col + 'A');
+    for (int col = 0; col < grid_cols; col++) {
+        mvaddnstr(3, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + 1, blanks, CELL_DISPLAY_WIDTH);
+        mvaddch(3, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + CELL_DISPLAY_WIDTH / 2 + 1, view_left + col + 'A');
+    }
+
+    // Print the cur_row headers, and clear what the rows showed before.
+    for (int row = 0; row < grid_rows; row++) {
+        mvprintw(2 * (row + 2) + 1, 1, "%*d", CELL_DISPLAY_WIDTH, (int) view_top + row + 1);
+        for (int col = 0; col < grid_cols; col++)
+            mvaddnstr(2 * (row + 2) + 1, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + 1, blanks, CELL_DISPLAY_WIDTH);
+    }
+
+    model_set_viewport(view_top, view_left, grid_rows, grid_cols);
+}
 
-    // Generate the format specifier for the cur_row headers.
-    char format_buffer[8];
-    snprintf(format_buffer, sizeof(format_buffer), "%%%dd", CELL_DISPLAY_WIDTH);
+// Scrolls as little as needed to bring the current cell into view.
+static void scroll_to_cursor(void) {
+    ROW top = view_top;
+    COL left = view_left;
+    if (cur_row < view_top)
+        view_top = cur_row;
+    else if (cur_row >= view_top + grid_rows)
+        view_top = cur_row - grid_rows + 1;
+    if (cur_col < view_left)
+        view_left = cur_col;
+    else if (cur_col >= view_left + grid_cols)
+        view_left = cur_col - grid_cols + 1;
+    if (view_top != top || view_left != left)
+        show_viewport();
+}
+
+// Fits the grid to a resized terminal and draws it again.
+static void resize_grid(void) {
+    fit_grid();
+    draw_borders();
+    if (view_left + grid_cols > SHEET_COLS)
+        view_left = SHEET_COLS - grid_cols;
+    show_viewport();
+    scroll_to_cursor();
+}
+
+int main(int argc, char **argv) {
+    /* INITIALIZATION */
+
+    // Initialize NCURSES.
+    initscr();
+
+    // Enable raw characters for control sequences.
+    raw();
 
-    // Print the cur_row headers.
-    for (ROW row = ROW_1; row < NUM_ROWS; row++)
-        mvprintw(2 * ((int) row + 2) + 1, 1, format_buffer, row + 1);
+    // Disable automatic echo of typed characters.
+    noecho();
+
+    // Enable input of function keys.
+    keypad(stdscr, true);
+
+    // Return from getch periodically so recalculated cells can be drawn.
+    timeout(DISPLAY_REFRESH_MS);
+
+    // Draw exit instructions, and how to save when a workbook was given.
+    const char *import_path = NULL;
+    char import_delimiter = ',';
+    bool import_json = false;
+    if (argc > 1) {
+        // CSV, TSV and JSON lines files are imported, anything else is a workbook, binary if it ends in
+        // ".snap", compressed if ".snapz", tiled if ".tiles".
+        const char *extension = strrchr(argv[1], '.');
+        if (extension != NULL && (strcmp(extension, ".csv") == 0 || strcmp(extension, ".tsv") == 0)) {
+            import_path = argv[1];
+            import_delimiter = extension[1] == 't' ? '\t' : ',';
+        } else if (extension != NULL && (strcmp(extension, ".jsonl") == 0 || strcmp(extension, ".ndjson") == 0)) {
+            import_path = argv[1];
+            import_json = true;
+        } else {
+            workbook_path = argv[1];
+            if (extension != NULL && strcmp(extension, ".snap") == 0)
+                workbook_kind = WORKBOOK_SNAPSHOT;
+            else if (extension != NULL && strcmp(extension, ".snapz") == 0)
+                workbook_kind = WORKBOOK_COMPRESSED;
+            else if (extension != NULL && strcmp(extension, ".tiles") == 0)
+                workbook_kind = WORKBOOK_TILES;
+        }
+    }
+
+    /* DRAW GRID */
+
+    // Size the grid to the terminal and draw it.
+    fit_grid();
+    draw_borders();
 
     /* MAIN LOOP */
 
-    // Initialize data structure.
+    // Initialize data structure, the model fills in the cells in view.
     model_init();
+    show_viewport();
+
+    // Profile recalculation when asked to, the report is written on exit.
+    profile_path = getenv("SPREADSHEET_PROFILE");
+    if (profile_path != NULL)
+        model_set_profiling(true);
+
+    // Circular references are iterated when asked to, "100" passes at most, or "100,0.001" to also stop
+    // once no value changes by more than that.
+    const char *iterative = getenv("SPREADSHEET_ITERATIVE");
+    if (iterative != NULL) {
+        int max_iterations = 100;
+        double max_change = 0.001;
+        sscanf(iterative, "%d,%lf", &max_iterations, &max_change);
+        if (max_iterations > 0 && max_change >= 0)
+            model_set_iterative(true, max_iterations, max_change);
+    }
 
-    // String of blanks used by main loop.
-    char blanks[total_width + 1];
-    for (size_t i = 0; i < total_width; i++)
-        blanks[i] = ' ';
-    blanks[total_width] = 0;
+    // A tiled workbook is paged in and out of memory when given a budget in megabytes. Paged edits are
+    // only kept by saving, the journal's checkpoints need every cell in memory.
+    const char *memory_budget = getenv("SPREADSHEET_MEMORY_MB");
+    bool paged = workbook_path != NULL && workbook_kind == WORKBOOK_TILES && memory_budget != NULL &&
+                 tiles_page(workbook_path, (size_t) strtoul(memory_budget, NULL, 10) << 20) == 0;
+
+    // Open the workbook, a file that does not exist yet is created on the first save. Edits since it
+    // was saved are kept in a journal next to it, and replayed after a crash on top of the workbook or
+    // of the journal's last checkpoint.
+    if (workbook_path != NULL && !paged) {
+        char *journal_path = malloc(strlen(workbook_path) + sizeof(".journal"));
+        sprintf(journal_path, "%s.journal", workbook_path);
+        if (journal_load_checkpoint(journal_path) != 0)
+            load_workbook();
+        journal_open(journal_path);
+        free(journal_path);
+    }
+    if (import_path != NULL && import_json)
+        json_import(import_path, ROW_1, COL_A);
+    else if (import_path != NULL)
+        csv_import(import_path, import_delimiter, ROW_1, COL_A);
 
     while (true) {
+        // Keep the current cell in view.
+        scroll_to_cursor();
+
         // Print the current cell coordinates in top-left corner.
         mvaddnstr(3, 1, blanks, CELL_DISPLAY_WIDTH);
         mvprintw(3, CELL_DISPLAY_WIDTH / 2, "%c%d", cur_col + 'A', cur_row + 1);
@@ -155,21 +354,37 @@ int main() {
         refresh();
 
         // Read next key.
-        int c = getch();
+        int c = read_key(true);
         set_cell_attr(A_NORMAL);
 
         // Handle key.
         handle_key:
         switch (c) {
             case 3: // Ctrl+C
-                endwin();
+                finish();
                 return 0;
+            case 19: // Ctrl+S
+                // Once the workbook has every edit, the journal starts over.
+                if (workbook_path != NULL && save_workbook() == 0)
+                    journal_saved();
+                continue;
+            case 5: // Ctrl+E
+                // The computed values of the whole sheet go to CSV and Arrow files next to the workbook.
+                if (workbook_path != NULL) {
+                    char *export_path = malloc(strlen(workbook_path) + sizeof(".arrow"));
+                    sprintf(export_path, "%s.csv", workbook_path);
+                    csv_export(export_path, ',', ROW_1, COL_A, -1, -1, false, -1);
+                    sprintf(export_path, "%s.arrow", workbook_path);
+                    arrow_export(export_path, ROW_1, COL_A, -1, -1);
+                    free(export_path);
+                }
+                continue;
             case KEY_UP:
                 if (cur_row > ROW_1)
                     cur_row--;
                 continue;
             case KEY_DOWN:
-                if (cur_row < NUM_ROWS - 1)
+                if (cur_row < SHEET_ROWS - 1)
                     cur_row++;
                 continue;
             case KEY_LEFT:
@@ -178,33 +393,37 @@ int main() {
                 return_col = cur_col;
                 continue;
             case KEY_RIGHT:
-                if (cur_col < NUM_COLS - 1)
+                if (cur_col < SHEET_COLS - 1)
                     cur_col++;
                 return_col = cur_col;
                 continue;
             case KEY_PPAGE:
-                cur_row = ROW_1;
+                // Move a screen at a time.
+                cur_row = cur_row > (ROW) grid_rows ? cur_row - (ROW) grid_rows : ROW_1;
                 continue;
             case KEY_NPAGE:
-                cur_row = NUM_ROWS - 1;
+                cur_row = cur_row + (ROW) grid_rows < SHEET_ROWS ? cur_row + (ROW) grid_rows : SHEET_ROWS - 1;
                 continue;
             case KEY_HOME:
                 cur_col = COL_A;
                 return_col = COL_A;
                 continue;
             case KEY_END:
-                cur_col = NUM_COLS - 1;
-                return_col = NUM_COLS - 1;
+                cur_col = SHEET_COLS - 1;
+                return_col = SHEET_COLS - 1;
+                continue;
+            case KEY_RESIZE:
+                resize_grid();
                 continue;
             case '\t':
-                if (cur_col < NUM_COLS - 1)
+                if (cur_col < SHEET_COLS - 1)
                     cur_col++;
                 continue;
             case KEY_DC:
                 clear_cell(cur_row, cur_col);
                 continue;
             case '\n':
-                if (cur_row < NUM_ROWS - 1) {
+                if (cur_row < SHEET_ROWS - 1) {
                     cur_row++;
                     cur_col = return_col;
                 }
@@ -242,11 +461,11 @@ int main() {
             move(1, edit_position - edit_display_offset + 1);
 
             // Read next key of input.
-            c = getch();
+            c = read_key(false);
 
             switch (c) {
                 case 3: // Ctrl+C
-                    endwin();
+                    finish();
                     return 0;
                 case KEY_LEFT:
                     if (edit_position > 0)
@@ -262,6 +481,9 @@ int main() {
                 case KEY_END:
                     edit_position = edit_text_length;
                     continue;
+                case KEY_RESIZE:
+                    resize_grid();
+                    continue;
                 case KEY_UP:
                 case KEY_DOWN:
                 case KEY_PPAGE:
@@ -314,12 +536,13 @@ int main() {
 }
 
 void update_cell_display(ROW row, COL col, const char *text) {
-    int console_row = 2 * ((int) row + 2) + 1;
-    int console_col = (CELL_DISPLAY_WIDTH + 1) * (col + 1) + 1;
-    char blanks[CELL_DISPLAY_WIDTH + 1];
-    for (size_t i = 0; i < CELL_DISPLAY_WIDTH; i++)
-        blanks[i] = ' ';
-    blanks[CELL_DISPLAY_WIDTH] = '\0';
-    mvaddstr(console_row, console_col, blanks);
-    mvaddnstr(console_row, console_col, text, CELL_DISPLAY_WIDTH);
+    // Only cells in view have a place on the screen.
+    if (row < view_top || row >= view_top + grid_rows || col < view_left || col >= view_left + grid_cols)
+        return;
+
+    int console_row = 2 * ((int) (row - view_top) + 2) + 1;
+    int console_col = (CELL_DISPLAY_WIDTH + 1) * (col - view_left + 1) + 1;
+
+    // Padded to the cell's width, so the old text is overwritten in the same write.
+    mvprintw(console_row, console_col, "%-*.*s", CELL_DISPLAY_WIDTH, CELL_DISPLAY_WIDTH, text);
 }
@@ -0,0 +1,471 @@
+#include "journal.h"
+#include "model.h"
+#include "model_internal.h"
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Longest an edit waits before its group is written, and the size that writes a group early
+#define JOURNAL_GROUP_MS 20
+#define JOURNAL_GROUP_BYTES (64 << 10)
+
+// Growth of the journal since the last checkpoint that starts the next one
+#define JOURNAL_CHECKPOINT_BYTES (4 << 20)
+
+// Bytes before the text of a record: length, checksum, operation, row and column
+#define JOURNAL_HEADER_SIZE 17
+
+///// JOURNAL STATE
+// Edits are appended to 'pending' under the journal mutex, the writer thread takes the whole buffer at once
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t journal_thread;
+static int journal_fd = -1;
+static int journal_closing = 0;
+static int journal_failed = 0;
+
+static char *pending = NULL;
+static size_t pending_size = 0;
+static size_t pending_capacity = 0;
+
+// Bytes recorded since the journal was started, including what was replayed, and how many of them are written.
+// The first 'dropped' of them were removed by checkpoints, the file starts after them.
+static uint64_t appended = 0;
+static uint64_t written = 0;
+static uint64_t dropped = 0;
+
+///// CHECKPOINT STATE
+// A checkpoint is a snapshot of the model as it was when 'appended' was 'checkpoint_start', written by its own
+// thread. Once it is on disk the writer drops the journal up to 'compact_end'.
+static char *journal_path = NULL;
+static pthread_t checkpoint_thread;
+static int checkpoint_started = 0;
+static int checkpoint_running = 0;
+static uint64_t checkpoint_start = 0;
+static int compact_pending = 0;
+static uint64_t compact_end = 0;
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// RECORD CHECKSUM FUNCTION (FNV-1a)
+// Over everything in the record after the checksum itself, so a torn record is noticed
+static uint32_t record_checksum(const unsigned char *bytes, size_t length) {
+    uint32_t checksum = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+//// WRITE ALL FUNCTION
+static int write_all(int fd, const char *bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= (size_t) written;
+    }
+    return 0;
+}
+
+//// CHECKPOINT PATH FUNCTION
+// The checkpoint of a journal is kept next to it
+static char *checkpoint_path(const char *path) {
+    char *checkpoint = malloc(strlen(path) + sizeof(".checkpoint"));
+    sprintf(checkpoint, "%s.checkpoint", path);
+    return checkpoint;
+}
+
+//// COMPACT FUNCTION
+// Copies the journal from 'from' to 'end' into a new file that replaces it, returns the new descriptor or -1.
+// The old journal stays as it was if anything fails, it only replays edits the checkpoint already has.
+static int compact(int fd, off_t from, off_t end) {
+    char *temp_path = malloc(strlen(journal_path) + sizeof(".tmp"));
+    sprintf(temp_path, "%s.tmp", journal_path);
+    int compacted = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (compacted < 0) {
+        free(temp_path);
+        return -1;
+    }
+
+    // The tail is the edits made while the checkpoint was written, usually small
+    char buffer[64 << 10];
+    int failed = lseek(fd, from, SEEK_SET) < 0;
+    while (!failed && from < end) {
+        size_t wanted = end - from < (off_t) sizeof(buffer) ? (size_t) (end - from) : sizeof(buffer);
+        ssize_t got = read(fd, buffer, wanted);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        failed = got <= 0 || write_all(compacted, buffer, (size_t) got) != 0;
+        from += got;
+    }
+    failed = failed || fsync(compacted) != 0;
+
+    // Windows can't rename over an open file
+#ifdef _WIN32
+    if (!failed) {
+        close(fd);
+        remove(journal_path);
+    }
+#endif
+    if (failed || rename(temp_path, journal_path) != 0) {
+        close(compacted);
+        remove(temp_path);
+        free(temp_path);
+        return -1;
+    }
+#ifndef _WIN32
+    close(fd);
+#endif
+    free(temp_path);
+    return compacted;
+}
+
+//// CHECKPOINT WRITER FUNCTION (thread)
+// Writes the captured snapshot, then asks the journal writer to drop what it covers
+static void *checkpoint_writer(void *argument) {
+    char *path = checkpoint_path(journal_path);
+    int failed = snapshot_write(argument, path, 0) != 0;
+    free(path);
+
+    pthread_mutex_lock(&journal_mutex);
+    if (!failed) {
+        compact_pending = 1;
+        compact_end = checkpoint_start;
+        pthread_cond_signal(&journal_wakeup);
+    }
+    checkpoint_running = 0;
+    pthread_mutex_unlock(&journal_mutex);
+    return NULL;
+}
+
+//// START CHECKPOINT FUNCTION
+// Called with the model lock and the journal mutex held, before the edit being recorded is applied
+static void start_checkpoint() {
+    checkpoint_running = 1;
+    checkpoint_start = appended;
+
+    // The model lock keeps other edits out, the writer may go on while the cells are copied
+    pthread_mutex_unlock(&journal_mutex);
+    if (checkpoint_started) {
+        pthread_join(checkpoint_thread, NULL);
+    }
+    snapshot_image *image = snapshot_capture();
+    pthread_create(&checkpoint_thread, NULL, checkpoint_writer, image);
+    checkpoint_started = 1;
+    pthread_mutex_lock(&journal_mutex);
+}
+
+//// JOURNAL WRITER FUNCTION (thread)
+// Waits for a group of edits to collect, then writes and flushes it in one go
+static void *journal_writer(void *argument) {
+    (void) argument;
+    char *writing = NULL;
+    size_t writing_capacity = 0;
+
+    pthread_mutex_lock(&journal_mutex);
+    while (1) {
+        while (pending_size == 0 && !compact_pending && !journal_closing) {
+            pthread_cond_wait(&journal_wakeup, &journal_mutex);
+        }
+        if (pending_size == 0 && !compact_pending) {
+            break;
+        }
+
+        // Give the group time to fill, an edit that fills it or closing cuts the wait short
+        if (pending_size > 0 && pending_size < JOURNAL_GROUP_BYTES && !journal_closing) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += JOURNAL_GROUP_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&journal_wakeup, &journal_mutex, &deadline);
+        }
+
+        // Swap buffers, edits keep collecting while this group is written
+        if (pending_size > 0) {
+            char *group = pending;
+            size_t group_size = pending_size;
+            size_t group_capacity = pending_capacity;
+            pending = writing;
+            pending_capacity = writing_capacity;
+            pending_size = 0;
+            writing = group;
+            writing_capacity = group_capacity;
+            pthread_mutex_unlock(&journal_mutex);
+
+            int failed = write_all(journal_fd, group, group_size) != 0 || fsync(journal_fd) != 0;
+
+            pthread_mutex_lock(&journal_mutex);
+            journal_failed |= failed;
+            written += group_size;
+        }
+
+        // Drop the edits a finished checkpoint covers, once they are all written. Only this thread uses the file.
+        if (compact_pending && written >= compact_end) {
+            compact_pending = 0;
+            uint64_t end = compact_end;
+            pthread_mutex_unlock(&journal_mutex);
+
+            int compacted = compact(journal_fd, (off_t) (end - dropped), (off_t) (written - dropped));
+
+            pthread_mutex_lock(&journal_mutex);
+            if (compacted >= 0) {
+                journal_fd = compacted;
+                dropped = end;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    free(writing);
+    return NULL;
+}
+
+//// REPLAY FUNCTION
+// Applies every whole record in the file, returns how many and where the last one ends through 'valid_end'
+static long replay(int fd, off_t *valid_end) {
+    // Read the whole journal, it only holds the edits since it was started
+    char *bytes = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    while (1) {
+        if (size == capacity) {
+            capacity = capacity == 0 ? (64 << 10) : capacity * 2;
+            bytes = realloc(bytes, capacity);
+        }
+        ssize_t got = read(fd, bytes + size, capacity - size);
+        if (got <= 0) {
+            break;
+        }
+        size += (size_t) got;
+    }
+
+    // Apply the edits as one import, parsed and recalculated once at the end
+    long records = 0;
+    size_t offset = 0;
+    model_begin_import();
+    while (size - offset >= JOURNAL_HEADER_SIZE) {
+        const unsigned char *record = (const unsigned char *) bytes + offset;
+        uint32_t length, checksum;
+        int32_t row, col;
+        memcpy(&length, record, 4);
+        memcpy(&checksum, record + 4, 4);
+        memcpy(&row, record + 9, 4);
+        memcpy(&col, record + 13, 4);
+
+        // Stop at a record cut off or damaged by a crash, or with a cell off the sheet
+        if (length > size - offset - JOURNAL_HEADER_SIZE ||
+            record_checksum(record + 8, JOURNAL_HEADER_SIZE - 8 + length) != checksum || row < 0 ||
+            row >= SHEET_ROWS || col < 0 || col >= SHEET_COLS) {
+            break;
+        }
+
+        if (record[8] == 'S') {
+            char *text = malloc(length + 1);
+            memcpy(text, record + JOURNAL_HEADER_SIZE, length);
+            text[length] = '\0';
+            set_cell_value((ROW) row, (COL) col, text);
+        }
+        else if (record[8] == 'C') {
+            clear_cell((ROW) row, (COL) col);
+        }
+
+        offset += JOURNAL_HEADER_SIZE + length;
+        records++;
+    }
+    model_commit_batch();
+
+    free(bytes);
+    *valid_end = (off_t) offset;
+    return records;
+}
+
+/////////////////////////////////////////////////// JOURNAL FUNCTIONS ///////////////////////////////////////////////////
+
+//// LOAD CHECKPOINT FUNCTION
+int journal_load_checkpoint(const char *path) {
+    char *checkpoint = checkpoint_path(path);
+    int result = snapshot_load(checkpoint);
+    free(checkpoint);
+    return result;
+}
+
+//// JOURNAL OPEN FUNCTION
+long journal_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Replay what is there, not recorded again as the journal isn't started yet. Then drop
+    // a torn record at the end, so new records follow the last whole one.
+    off_t valid_end;
+    long records = replay(fd, &valid_end);
+    if (ftruncate(fd, valid_end) != 0 || lseek(fd, valid_end, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+    journal_fd = fd;
+    journal_path = strdup(path);
+    journal_closing = 0;
+    journal_failed = 0;
+    appended = written = (uint64_t) valid_end;
+    dropped = 0;
+    checkpoint_start = 0;
+    compact_pending = 0;
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_create(&journal_thread, NULL, journal_writer, NULL);
+    return records;
+}
+
+//// JOURNAL SAVED FUNCTION
+void journal_saved() {
+    pthread_mutex_lock(&journal_mutex);
+    if (journal_fd < 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        return;
+    }
+
+    // A checkpoint being written would reappear after it is removed, and is older than the workbook
+    if (checkpoint_started) {
+        pthread_mutex_unlock(&journal_mutex);
+        pthread_join(checkpoint_thread, NULL);
+        pthread_mutex_lock(&journal_mutex);
+        checkpoint_started = 0;
+    }
+    char *checkpoint = checkpoint_path(journal_path);
+    remove(checkpoint);
+    free(checkpoint);
+
+    // The writer drops every edit recorded so far once it is written. Replaying them again after a crash
+    // before that only sets the cells to what the workbook already holds.
+    compact_pending = 1;
+    compact_end = appended;
+    checkpoint_start = appended;
+    pthread_cond_signal(&journal_wakeup);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+//// JOURNAL CLOSE FUNCTION
+int journal_close() {
+    pthread_mutex_lock(&journal_mutex);
+    if (journal_fd < 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        return 0;
+    }
+
+    // A checkpoint being written finishes first, so the writer can still drop what it covers
+    if (checkpoint_started) {
+        pthread_mutex_unlock(&journal_mutex);
+        pthread_join(checkpoint_thread, NULL);
+        pthread_mutex_lock(&journal_mutex);
+        checkpoint_started = 0;
+    }
+
+    // The writer flushes what is left before it stops
+    journal_closing = 1;
+    pthread_cond_signal(&journal_wakeup);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(journal_thread, NULL);
+
+    pthread_mutex_lock(&journal_mutex);
+    int failed = journal_failed || close(journal_fd) != 0;
+    journal_fd = -1;
+    free(journal_path);
+    journal_path = NULL;
+    pthread_mutex_unlock(&journal_mutex);
+    free(pending);
+    pending = NULL;
+    pending_size = pending_capacity = 0;
+    return failed ? -1 : 0;
+}
+
+//// APPEND RECORD FUNCTION
+// Adds a record to the pending group, called with the journal mutex held
+static void append_record(char operation, ROW row, COL col, const char *text) {
+    // Record: length of the text, checksum, operation, row, column, text
+    uint32_t length = text == NULL ? 0 : (uint32_t) strlen(text);
+    int32_t position[2] = {row, col};
+    size_t needed = pending_size + JOURNAL_HEADER_SIZE + length;
+    if (needed > pending_capacity) {
+        while (needed > pending_capacity) {
+            pending_capacity = pending_capacity == 0 ? 4096 : pending_capacity * 2;
+        }
+        pending = realloc(pending, pending_capacity);
+    }
+
+    unsigned char *record = (unsigned char *) pending + pending_size;
+    memcpy(record, &length, 4);
+    record[8] = (unsigned char) operation;
+    memcpy(record + 9, position, 8);
+    if (length > 0) {
+        memcpy(record + JOURNAL_HEADER_SIZE, text, length);
+    }
+    uint32_t checksum = record_checksum(record + 8, JOURNAL_HEADER_SIZE - 8 + length);
+    memcpy(record + 4, &checksum, 4);
+    pending_size = needed;
+    appended += JOURNAL_HEADER_SIZE + length;
+
+    // Wake the writer for the first edit of a group, or when the group is full
+    if (pending_size == JOURNAL_HEADER_SIZE + length || pending_size >= JOURNAL_GROUP_BYTES) {
+        pthread_cond_signal(&journal_wakeup);
+    }
+}
+
+//// JOURNAL RECORD FUNCTION
+void journal_record(char operation, ROW row, COL col, const char *text) {
+    pthread_mutex_lock(&journal_mutex);
+    if (journal_fd < 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        return;
+    }
+
+    // Once the journal has grown enough, checkpoint the cells as they are before this edit. The cells of
+    // an open import are not parsed yet, the first edit after it takes the checkpoint instead.
+    if (!checkpoint_running && !batch_import && appended - checkpoint_start >= JOURNAL_CHECKPOINT_BYTES) {
+        start_checkpoint();
+    }
+    append_record(operation, row, col, text);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+//// JOURNAL RECORD INPUTS FUNCTION
+// Only called while an import is open, so no checkpoint is due
+void journal_record_inputs(const cell_input *inputs, int count) {
+    pthread_mutex_lock(&journal_mutex);
+    if (journal_fd >= 0) {
+        for (int i = 0; i < count; i++) {
+            append_record('S', inputs[i].row, inputs[i].col, inputs[i].text);
+        }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
@@ -0,0 +1,41 @@
+#ifndef ASSIGNMENT_JOURNAL_H
+#define ASSIGNMENT_JOURNAL_H
+
+// Replays the edits in the journal at 'path' onto the model, then records
+// every edit made after it (cell values set, cells cleared, imported fields)
+// at the end of the same file.
+//
+// Edits are written and flushed to disk in groups by a background thread, at
+// most JOURNAL_GROUP_MS after they are made, or sooner once a group reaches
+// JOURNAL_GROUP_BYTES. A crash loses at most the last group. Replay stops at
+// a record cut off by a crash or naming a cell off the sheet, and drops it
+// and everything after it from the journal.
+//
+// Once the journal has grown by JOURNAL_CHECKPOINT_BYTES, the cells are copied
+// as they are and written to a snapshot at '<path>.checkpoint' by a background
+// thread. When it is on disk, the edits it covers are dropped from the journal,
+// so opening again only replays the edits made since. A checkpoint that falls
+// due during an import waits for the import to be committed.
+//
+// Returns the number of edits replayed, or -1 if the journal can't be opened.
+long journal_open(const char *path);
+
+// Replaces the contents of the model with the last checkpoint of the journal
+// at 'path'. The checkpoint is newer than the workbook the journal belongs to,
+// so it is loaded instead of the workbook when there is one.
+//
+// Returns 0 on success, -1 if there is no checkpoint that can be loaded.
+int journal_load_checkpoint(const char *path);
+
+// Called once the workbook the journal belongs to was saved with every edit
+// recorded so far. Removes the checkpoint and empties the journal, so opening
+// again loads the workbook and replays only the edits made after the save.
+void journal_saved();
+
+// Waits for a checkpoint being written, writes out the edits not yet on disk
+// and stops recording.
+//
+// Returns 0 if every edit reached the disk, -1 if a write failed.
+int journal_close();
+
+#endif //ASSIGNMENT_JOURNAL_H
@@ -0,0 +1,526 @@
+#include "json.h"
+#include "model.h"
+#include "model_internal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes read at a time, a longer line grows the buffer until it fits
+#define JSON_BLOCK_SIZE (1 << 20)
+
+// Bytes of lines parsed per lock, so edits go on during a long import
+#define JSON_SLICE_SIZE (1 << 16)
+
+// Slots the header map starts with, it doubles when half full
+#define JSON_INITIAL_KEYS 64
+
+// Values of a record collected before any of them is stored
+#define JSON_INITIAL_FIELDS 16
+
+// Column of the keys that come after the last column of the sheet, their values are skipped
+#define JSON_NO_COLUMN ((COL) SHEET_COLS)
+
+///// HEADER KEY
+// A key of the header map and the column it was given
+typedef struct {
+    char *name;
+    size_t length;
+    uint64_t hash;
+    COL col;
+} json_key;
+
+///// PARSED FIELD
+// A key and its value as they lie in the line. Strings are unescaped when
+// stored, raw values (numbers, true, false, objects and arrays) are copied.
+typedef struct {
+    const char *key;
+    size_t key_length;
+    int key_escaped;
+    const char *value;
+    size_t value_length;
+    int value_escaped;
+    int value_string;
+} json_field;
+
+///// IMPORT STATE
+typedef struct {
+    // Header map from key names to columns, open addressing
+    json_key *keys;
+    size_t key_capacity;
+    size_t key_count;
+
+    // Fields of the current record, reused for every record
+    json_field *fields;
+    int field_count;
+    int field_capacity;
+
+    // Unescaped key of the field being stored
+    char *scratch;
+    size_t scratch_capacity;
+
+    // Where the header and the records go
+    ROW first_row;
+    COL first_col;
+    long records;
+} json_state;
+
+/////////////////////////////////////////////////// PARSING ///////////////////////////////////////////////////
+
+//// SKIP WHITESPACE FUNCTION
+static const char *skip_space(const char *c, const char *end) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')) {
+        c++;
+    }
+    return c;
+}
+
+//// SCAN STRING FUNCTION
+// 'c' is just past the opening quote. Returns the closing quote, or NULL if
+// the string does not end in the line, and whether it has escapes.
+static const char *scan_string(const char *c, const char *end, int *escaped) {
+    *escaped = 0;
+    while (c < end) {
+        const char *quote = memchr(c, '"', end - c);
+        if (quote == NULL) {
+            return NULL;
+        }
+
+        // The quote ends the string unless a backslash comes first, then look again past the escape
+        const char *slash = memchr(c, '\\', quote - c);
+        if (slash == NULL) {
+            return quote;
+        }
+        *escaped = 1;
+        c = slash + 2;
+    }
+    return NULL;
+}
+
+//// SKIP VALUE FUNCTION
+// Returns the end of the value at 'c', or NULL if it is malformed. Objects
+// and arrays are only checked for balanced brackets, they are kept as text.
+static const char *skip_value(const char *c, const char *end) {
+    int escaped;
+
+    if (*c == '"') {
+        const char *quote = scan_string(c + 1, end, &escaped);
+        return quote == NULL ? NULL : quote + 1;
+    }
+
+    if (*c == '{' || *c == '[') {
+        int depth = 0;
+        while (c < end) {
+            if (*c == '"') {
+                c = scan_string(c + 1, end, &escaped);
+                if (c == NULL) {
+                    return NULL;
+                }
+            }
+            else if (*c == '{' || *c == '[') {
+                depth++;
+            }
+            else if ((*c == '}' || *c == ']') && --depth == 0) {
+                return c + 1;
+            }
+            c++;
+        }
+        return NULL;
+    }
+
+    // Numbers and literals run up to the next separator
+    const char *start = c;
+    while (c < end && *c != ',' && *c != '}' && *c != ']' && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') {
+        c++;
+    }
+    size_t length = c - start;
+    if ((length == 4 && memcmp(start, "true", 4) == 0) || (length == 5 && memcmp(start, "false", 5) == 0) ||
+        (length == 4 && memcmp(start, "null", 4) == 0)) {
+        return c;
+    }
+    for (const char *digit = start; digit < c; digit++) {
+        if (*digit == '\0' || strchr("+-0123456789.eE", *digit) == NULL) {
+            return NULL;
+        }
+    }
+    return length > 0 ? c : NULL;
+}
+
+//// HEX DIGITS FUNCTION
+// Returns the value of the four hex digits at 'c', or -1
+static long hex_value(const char *c, const char *end) {
+    if (end - c < 4) {
+        return -1;
+    }
+    long value = 0;
+    for (int i = 0; i < 4; i++) {
+        char digit = c[i];
+        value <<= 4;
+        if (digit >= '0' && digit <= '9') {
+            value |= digit - '0';
+        }
+        else if (digit >= 'a' && digit <= 'f') {
+            value |= digit - 'a' + 10;
+        }
+        else if (digit >= 'A' && digit <= 'F') {
+            value |= digit - 'A' + 10;
+        }
+        else {
+            return -1;
+        }
+    }
+    return value;
+}
+
+//// UNESCAPE FUNCTION
+// Writes the string from 'c' to 'end' without its escapes into 'out', which
+// needs as many bytes as the escaped string. Returns the length written.
+static size_t unescape(const char *c, const char *end, char *out) {
+    char *start = out;
+    while (c < end) {
+        if (*c != '\\' || end - c < 2) {
+            *out++ = *c++;
+            continue;
+        }
+
+        char escape = c[1];
+        c += 2;
+        if (escape == 'n') {
+            *out++ = '\n';
+        }
+        else if (escape == 't') {
+            *out++ = '\t';
+        }
+        else if (escape == 'r') {
+            *out++ = '\r';
+        }
+        else if (escape == 'b') {
+            *out++ = '\b';
+        }
+        else if (escape == 'f') {
+            *out++ = '\f';
+        }
+        else if (escape != 'u') {
+            *out++ = escape;
+        }
+
+        // A code point as UTF-8, surrogate pairs joined, a malformed one replaced
+        else {
+            long code = hex_value(c, end);
+            if (code < 0) {
+                *out++ = 'u';
+                continue;
+            }
+            c += 4;
+            if (code >= 0xD800 && code <= 0xDBFF && end - c >= 6 && c[0] == '\\' && c[1] == 'u') {
+                long low = hex_value(c + 2, end);
+                if (low >= 0xDC00 && low <= 0xDFFF) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    c += 6;
+                }
+            }
+            if (code >= 0xD800 && code <= 0xDFFF) {
+                code = 0xFFFD;
+            }
+
+            if (code < 0x80) {
+                *out++ = (char) code;
+            }
+            else if (code < 0x800) {
+                *out++ = (char) (0xC0 | code >> 6);
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+            else if (code < 0x10000) {
+                *out++ = (char) (0xE0 | code >> 12);
+                *out++ = (char) (0x80 | (code >> 6 & 0x3F));
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+            else {
+                *out++ = (char) (0xF0 | code >> 18);
+                *out++ = (char) (0x80 | (code >> 12 & 0x3F));
+                *out++ = (char) (0x80 | (code >> 6 & 0x3F));
+                *out++ = (char) (0x80 | (code & 0x3F));
+            }
+        }
+    }
+    return out - start;
+}
+
+//// PARSE RECORD FUNCTION
+// Collects the fields of the object on the line, returns -1 if it is not one
+static int parse_record(json_state *state, const char *c, const char *end) {
+    state->field_count = 0;
+    c = skip_space(c, end);
+    if (c == end || *c != '{') {
+        return -1;
+    }
+    c = skip_space(c + 1, end);
+    if (c < end && *c == '}') {
+        return skip_space(c + 1, end) == end ? 0 : -1;
+    }
+
+    while (c < end) {
+        // The key
+        json_field field;
+        if (*c != '"') {
+            return -1;
+        }
+        const char *quote = scan_string(c + 1, end, &field.key_escaped);
+        if (quote == NULL) {
+            return -1;
+        }
+        field.key = c + 1;
+        field.key_length = quote - field.key;
+        c = skip_space(quote + 1, end);
+        if (c == end || *c != ':') {
+            return -1;
+        }
+
+        // The value, kept where it lies
+        c = skip_space(c + 1, end);
+        const char *stop = c < end ? skip_value(c, end) : NULL;
+        if (stop == NULL) {
+            return -1;
+        }
+        field.value_string = *c == '"';
+        field.value = field.value_string ? c + 1 : c;
+        field.value_length = field.value_string ? (size_t) (stop - c - 2) : (size_t) (stop - c);
+        field.value_escaped = field.value_string && memchr(field.value, '\\', field.value_length) != NULL;
+
+        // Nulls leave the cell as it was
+        if (field.value_string || field.value_length != 4 || memcmp(field.value, "null", 4) != 0) {
+            if (state->field_count == state->field_capacity) {
+                state->field_capacity = state->field_capacity == 0 ? JSON_INITIAL_FIELDS : state->field_capacity * 2;
+                state->fields = realloc(state->fields, state->field_capacity * sizeof(json_field));
+            }
+            state->fields[state->field_count++] = field;
+        }
+
+        // A comma goes on to the next key, the closing brace ends the line
+        c = skip_space(stop, end);
+        if (c < end && *c == ',') {
+            c = skip_space(c + 1, end);
+            continue;
+        }
+        if (c < end && *c == '}') {
+            return skip_space(c + 1, end) == end ? 0 : -1;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+/////////////////////////////////////////////////// HEADER MAP ///////////////////////////////////////////////////
+
+//// HASH KEY FUNCTION
+// FNV-1a over the unescaped name
+static uint64_t hash_key(const char *name, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+//// GROW HEADER MAP FUNCTION
+static void grow_keys(json_state *state) {
+    size_t capacity = state->key_capacity == 0 ? JSON_INITIAL_KEYS : state->key_capacity * 2;
+    json_key *keys = calloc(capacity, sizeof(json_key));
+
+    // Reinsert every key at its slot in the larger table
+    for (size_t i = 0; i < state->key_capacity; i++) {
+        if (state->keys[i].name != NULL) {
+            size_t slot = state->keys[i].hash & (capacity - 1);
+            while (keys[slot].name != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            keys[slot] = state->keys[i];
+        }
+    }
+
+    free(state->keys);
+    state->keys = keys;
+    state->key_capacity = capacity;
+}
+
+//// KEY COLUMN FUNCTION
+// Returns the column of a key, giving a new key the next column and writing its name in the header row.
+// Once the columns run out, new keys are remembered with JSON_NO_COLUMN.
+static COL key_column(json_state *state, const char *name, size_t length) {
+    if (2 * (state->key_count + 1) > state->key_capacity) {
+        grow_keys(state);
+    }
+
+    uint64_t hash = hash_key(name, length);
+    size_t slot = hash & (state->key_capacity - 1);
+    while (state->keys[slot].name != NULL) {
+        json_key *key = &state->keys[slot];
+        if (key->hash == hash && key->length == length && memcmp(key->name, name, length) == 0) {
+            return key->col;
+        }
+        slot = (slot + 1) & (state->key_capacity - 1);
+    }
+
+    json_key *key = &state->keys[slot];
+    key->name = malloc(length + 1);
+    memcpy(key->name, name, length);
+    key->name[length] = '\0';
+    key->length = length;
+    key->hash = hash;
+    key->col = state->first_col + state->key_count < SHEET_COLS ? (COL) (state->first_col + state->key_count)
+                                                                : JSON_NO_COLUMN;
+    state->key_count++;
+
+    // The header shows the name as if it was typed, an empty name leaves the cell as it was
+    if (length > 0 && key->col != JSON_NO_COLUMN) {
+        store_cell_input(state->first_row, key->col, strdup(key->name));
+    }
+    return key->col;
+}
+
+/////////////////////////////////////////////////// IMPORT ///////////////////////////////////////////////////
+
+//// STORE RECORD FUNCTION
+// Stores the collected fields in the next row
+static void store_record(json_state *state) {
+    ROW row = (ROW) (state->first_row + 1 + state->records);
+
+    for (int i = 0; i < state->field_count; i++) {
+        json_field *field = &state->fields[i];
+
+        // Escaped keys are compared unescaped
+        const char *name = field->key;
+        size_t name_length = field->key_length;
+        if (field->key_escaped) {
+            if (field->key_length + 1 > state->scratch_capacity) {
+                state->scratch_capacity = field->key_length + 1;
+                state->scratch = realloc(state->scratch, state->scratch_capacity);
+            }
+            name_length = unescape(field->key, field->key + field->key_length, state->scratch);
+            name = state->scratch;
+        }
+        COL col = key_column(state, name, name_length);
+
+        // Empty strings leave the cell as it was, like empty fields in a CSV file, and keys past the last
+        // column have nowhere to go
+        if (field->value_length == 0 || col == JSON_NO_COLUMN) {
+            continue;
+        }
+
+        // The cell owns its input, the only allocation per value
+        char *text = malloc(field->value_length + 1);
+        size_t length = field->value_length;
+        if (field->value_escaped) {
+            length = unescape(field->value, field->value + field->value_length, text);
+        }
+        else {
+            memcpy(text, field->value, length);
+        }
+        text[length] = '\0';
+        store_cell_input(row, col, text);
+    }
+
+    state->records++;
+}
+
+//// PARSE LINES FUNCTION
+// Imports every line from 'c' to 'end', taking the model lock one slice at a time
+static void parse_lines(json_state *state, const char *c, const char *end) {
+    const char *slice_end = c;
+    model_lock_acquire();
+
+    while (c < end) {
+        if (c >= slice_end) {
+            model_lock_release();
+            model_lock_acquire();
+            slice_end = c + JSON_SLICE_SIZE;
+        }
+
+        const char *newline = memchr(c, '\n', end - c);
+        const char *stop = newline == NULL ? end : newline;
+
+        // Blank lines are not records, nor is anything that is not an object
+        if (skip_space(c, stop) < stop && parse_record(state, c, stop) == 0) {
+            store_record(state);
+        }
+        c = newline == NULL ? end : newline + 1;
+    }
+
+    model_lock_release();
+}
+
+//// LAST LINE BREAK FUNCTION
+// Returns the byte after the last line break in the buffer, or NULL if there is none
+static char *after_last_line(char *buffer, size_t size) {
+    for (size_t i = size; i > 0; i--) {
+        if (buffer[i - 1] == '\n') {
+            return buffer + i;
+        }
+    }
+    return NULL;
+}
+
+//// JSON IMPORT FUNCTION
+long json_import(const char *path, ROW first_row, COL first_col) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    json_state state = {0};
+    state.first_row = first_row;
+    state.first_col = first_col;
+
+    // Inputs are stored raw and parsed, linked and recalculated together at the end
+    model_begin_import();
+
+    // Read a block, parse the whole lines in it where they lie, keep the unfinished one for the next block
+    size_t capacity = JSON_BLOCK_SIZE;
+    char *buffer = malloc(capacity);
+    size_t size = 0;
+    int first_block = 1;
+    int ended = 0;
+    while (!ended) {
+        size_t got = fread(buffer + size, 1, capacity - size, in);
+        ended = got == 0;
+        size += got;
+
+        // A UTF-8 byte order mark is not part of the first record
+        if (first_block) {
+            if (size >= 3 && memcmp(buffer, "\xEF\xBB\xBF", 3) == 0) {
+                size -= 3;
+                memmove(buffer, buffer + 3, size);
+            }
+            first_block = 0;
+        }
+
+        // The last line may not end with a line break
+        char *lines_end = ended ? buffer + size : after_last_line(buffer, size);
+
+        // A line longer than the buffer needs a larger one
+        if (lines_end == NULL) {
+            if (size == capacity) {
+                capacity *= 2;
+                buffer = realloc(buffer, capacity);
+            }
+            continue;
+        }
+
+        parse_lines(&state, buffer, lines_end);
+        size -= lines_end - buffer;
+        memmove(buffer, lines_end, size);
+    }
+
+    model_commit_batch();
+
+    int failed = ferror(in);
+    fclose(in);
+    free(buffer);
+    for (size_t i = 0; i < state.key_capacity; i++) {
+        free(state.keys[i].name);
+    }
+    free(state.keys);
+    free(state.fields);
+    free(state.scratch);
+    return failed ? -1 : state.records;
+}
@@ -0,0 +1,23 @@
+#ifndef ASSIGNMENT_JSON_H
+#define ASSIGNMENT_JSON_H
+
+#include "defs.h"
+
+// Imports the newline-delimited JSON file at 'path' into the model, one
+// object per line into consecutive rows. Keys are mapped to columns in the
+// order they first appear: the first key goes into 'first_col', each new key
+// into the next column, and its name into 'first_row'. Records start on the
+// row below. Keys that would go past the last column of the sheet are skipped.
+//
+// The file is read in large blocks and every line is parsed in place, without
+// building a tree of the record. Numbers are stored as they are written,
+// strings unescaped, true and false as text, and nested objects and arrays as
+// their JSON text. Each value is stored as if it was typed into its cell, null
+// values and missing keys leave their cell as it was. A line that is not an
+// object is skipped. Everything is parsed and recalculated once, after the
+// whole file.
+//
+// Returns the number of records imported, or -1 if the file can't be read.
+long json_import(const char *path, ROW first_row, COL first_col);
+
+#endif //ASSIGNMENT_JSON_H
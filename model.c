@@ -1,79 +1,255 @@
 #include "interface.h"
+#include "model.h"
+#include "model_internal.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
-#define HASH_SIZE 1229
 #define MAX_SIZE 1000
 
-/////////////////////////////////////////////////// STRUCTS AND DEFINITIONS ///////////////////////////////////////////////////
+// Text shown in a cell while it waits for the recalculation worker
+#define PENDING_MARKER "..."
+
+// Incremental updates an aggregate may apply before it is summed exactly again, bounds floating point drift
+#define AGGREGATE_EXACT_INTERVAL 1024
+
+// Dependants an edit marks dirty before it returns, the worker marks the rest in steps of this many, giving
+// the lock up between steps
+#define PROPAGATE_STEP 4096
+
+// Buckets in a stripe of the hash map, the stripes are dealt out to the threads of a partitioned store. A row's
+// cells are next to each other in the map, so every thread gets a share of a run of rows.
+#define STORE_STRIPE 64
+
+/////////////////////////////////////////////////// MODEL STATE ///////////////////////////////////////////////////
+
+node **spreadsheet;
+int spreadsheet_size;
+int spreadsheet_count;
+
+///// RECALCULATION WORKER STATE
+// Every access to the cells happens with the model lock held. The worker gives
+// the lock up between two steps of a chain, so an edit never waits on a whole
+// recalc.
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recalc_wakeup = PTHREAD_COND_INITIALIZER;
+pthread_t recalc_thread;
+atomic_int lock_waiters;
+int recalc_shutdown;
+
+// Cells flagged dirty that the worker still has to recalculate. Cells inside
+// the viewport are recalculated first, the rest when those are done.
+cell_list visible_dirty;
+cell_list offscreen_dirty;
+
+// Cells whose dependants are still to be marked dirty, expanded from 'propagate_next' on, which has its
+// runs done up to row 'propagate_offset' of run 'propagate_run'. An edit marks the first PROPAGATE_STEP
+// cells, the worker the rest.
+cell_list propagate_queue;
+int propagate_next;
+int propagate_run;
+int propagate_offset;
+
+// While a batch is open, edited cells are collected here and their
+// dependants are only marked dirty, once, when the batch is committed
+int batch_depth;
+cell_list batch_edits;
+
+// While an import is open, inputs are stored raw and collected here, to be
+// parsed, linked and ordered together when the batch is committed
+int batch_import;
+cell_list import_edits;
+
+///// SPAN OF AN AGGREGATE INDEX
+// A span of rows of one column, split in halves down to single rows. Each aggregate is kept in the largest spans its
+// range covers, so the aggregates over a cell are those in the spans on the way down to its row.
+typedef struct aggregate_span {
+    aggregate **aggregates;
+    int count;
+    int capacity;
+    struct aggregate_span *halves[2];
+} aggregate_span;
+
+// Every aggregate in the sheet, indexed by the columns and rows of their range so a changed cell only checks the
+// aggregates over it. Spans are created as aggregates are added and freed once empty.
+aggregate_span *aggregate_columns[SHEET_COLS];
+
+// Iterative calculation settings, circular dependencies are errors unless enabled
+int iterative_enabled;
+int iterative_max_iterations = 100;
+double iterative_max_change = 0.001;
+
+// Each recalc advances the epoch by two: a cell whose visit mark equals the
+// epoch is VISITING (on the evaluation stack), epoch + 1 means it is done.
+// Marks left from earlier or interrupted recalcs are stale by construction.
+unsigned long long recalc_epoch;
+
+// Same scheme for cycle component searches: epoch marks reachable cells, epoch + 1 members
+unsigned long long scc_epoch;
+
+// Explicit stack of cells being recalculated, so chain depth is bounded by memory and not the C stack. The
+// worker gives the lock up in the middle of a chain and keeps the stack. An edit made meanwhile flags the
+// cells on it that depend on it dirty again, so they are evaluated once more after this chain.
+cell_list eval_stack;
+
+// Scratch lists used while finding a cycle's component
+cell_list scc_reachable;
+cell_list scc_members;
+
+// Profiling state
+int profiling_enabled;
+long profile_recalcs;
+
+// Part of the sheet currently shown by the interface
+ROW view_row;
+COL view_col;
+int view_rows;
+int view_cols;
+
+// Cells whose displayed text changed since the interface last flushed, only
+// cells in the viewport and each of them once
+display_entry *display_queue;
+int display_count;
+int display_capacity;
+
+// One byte per position of the viewport, set while the cell there is queued
+unsigned char *display_marks;
 
-typedef enum { UNVISITED, VISITING} cell_state;
-typedef enum { NUMBER, TEXT, FORMULA, ERROR} cell_type;
-typedef struct cell cell;
 
-///// CELL STRUCTURE
-struct cell {
-    // Position of cell
-    ROW row;
-    COL col;
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// HASH MAP FUNCTION
+// Cells next to each other in a row land in neighbouring buckets, so filling a
+// sheet in reading order walks the table from front to back. The table size is
+// odd, so every row lands on a different run of buckets.
+unsigned long hash(ROW row, COL col) {
+    unsigned long hash = (unsigned long) (unsigned int) row * 64 + (unsigned int) col;
+
+    // Return modulus to fit in the table
+    return hash % spreadsheet_size;
+}
+
+//// FREE CELL TEXT FUNCTION
+// Text loaded from a snapshot stays in the snapshot, everything else was allocated for the cell
+void free_cell_text(char *text) {
+    if (!snapshot_owns(text)) {
+        free(text);
+    }
+}
 
-    // Cell contains number or string
-    union {
-        double number_value;
-        char *text_value;
-    } content;
+//// GROW HASH MAP FUNCTION
+// Doubles the buckets until there are at least as many as 'cells', nodes are relinked once so cells never move
+void grow_spreadsheet(int cells) {
+    int old_size = spreadsheet_size;
+    node **old_buckets = spreadsheet;
 
-    // Computed value if cell contains formula
-    double computed_value;
+    while (spreadsheet_size < cells) {
+        spreadsheet_size = spreadsheet_size * 2 + 1;
+    }
+    spreadsheet = calloc(spreadsheet_size, sizeof(node *));
+    for (int i = 0; i < old_size; i++) {
+        for (node *current = old_buckets[i]; current != NULL; ) {
+            node *next = current->next;
+            unsigned int index = hash(current->value.row, current->value.col);
+            current->next = spreadsheet[index];
+            spreadsheet[index] = current;
+            current = next;
+        }
+    }
+    free(old_buckets);
+}
 
-    // Formula string and define cell type
-    char *formula;
-    cell_type type;
+//// MODEL LOCK FUNCTIONS
+// Callers announce themselves before locking so the worker steps aside at its
+// next step instead of racing them for the mutex.
+void model_lock_acquire() {
+    atomic_fetch_add(&lock_waiters, 1);
+    pthread_mutex_lock(&model_lock);
+    atomic_fetch_sub(&lock_waiters, 1);
+}
 
-    // The original input of the cell
-    char *original_input;
+void model_lock_release() {
+    // No cell is in use between calls, a paged workbook gives back the tiles over its budget
+    tiles_trim();
 
-    // Array of "dependant" cells (cells that depend on other cells i.e for their formula)
-    cell **dependents;
-    int dependents_count;
-    int dependents_capacity;
+    // Wake the worker in case the caller left new dirty cells behind
+    pthread_cond_signal(&recalc_wakeup);
+    pthread_mutex_unlock(&model_lock);
+}
 
-    // The state of the cell
-    cell_state state;
-};
+//// CELL LIST PUSH FUNCTION
+void cell_list_push(cell_list *list, cell *current) {
+    // Double capacity if list is full, reallocate
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->cells = realloc(list->cells, list->capacity * sizeof(cell *));
+    }
 
-///// NODE STRUCTURE FOR SEPARATE CHAINING HASH
-typedef struct node {
-    // Hash key of node
-    char key[50];
+    list->cells[list->count++] = current;
+}
 
-    // Value of cell
-    cell value;
-    struct node *next;
+//// CELL LIST FREEING FUNCTION
+void cell_list_free(cell_list *list) {
+    free(list->cells);
+    list->cells = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
 
-} node;
+//// VIEWPORT CHECK FUNCTION
+int in_viewport(cell *current) {
+    return current->row >= view_row && current->row < view_row + view_rows &&
+           current->col >= view_col && current->col < view_col + view_cols;
+}
 
-node *spreadsheet[HASH_SIZE];
+//// DISPLAY MARK FUNCTION
+// The byte of 'display_marks' for a position in the viewport
+unsigned char *display_mark(ROW row, COL col) {
+    return &display_marks[(size_t) (row - view_row) * view_cols + (col - view_col)];
+}
 
+//// RESET DISPLAY QUEUE FUNCTION
+// Empties the queue and sizes its marks to the viewport
+void reset_display_queue() {
+    display_count = 0;
+    display_marks = realloc(display_marks, (size_t) view_rows * view_cols);
+    memset(display_marks, 0, (size_t) view_rows * view_cols);
+}
 
-/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+//// QUEUE REDRAW FUNCTION
+// Queues a cell whose text is unchanged, such as one scrolled into view
+void queue_redraw(cell *current) {
+    // Cells out of sight are drawn when the viewport moves over them, and a queued cell is drawn once
+    if (!in_viewport(current) || *display_mark(current->row, current->col)) {
+        return;
+    }
+    *display_mark(current->row, current->col) = 1;
 
-//// HASH MAP FUNCTION (djb2 algorithim)
-unsigned long hash(char *str) {
-    // Set hash value
-    unsigned long hash = 5381;
-    int c;
+    // Double capacity if queue is full, reallocate
+    if (display_count == display_capacity) {
+        display_capacity = display_capacity == 0 ? 64 : display_capacity * 2;
+        display_queue = realloc(display_queue, display_capacity * sizeof(display_entry));
+    }
 
-    // Loop over each character, compute hash value
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
+    // Remember the position, the text is produced when the queue is flushed
+    display_queue[display_count].row = current->row;
+    display_queue[display_count].col = current->col;
+    display_count++;
+}
 
-    // Return modulus to fit in the table
-    return hash % HASH_SIZE;
+//// QUEUE DISPLAY UPDATE FUNCTION
+void queue_display(cell *current) {
+    // A cell whose text changed also changed its tile in a saved workbook
+    tiles_touch(current->row, current->col);
+    queue_redraw(current);
 }
 
 //// ERROR SET FUNCTION
@@ -83,26 +259,209 @@ void set_error_and_update(cell *current, char *error_message) {
 
     // Replace the cell with the error message, update display
     current->content.text_value = strdup(error_message);
-    update_cell_display(current->row, current->col, current->content.text_value);
+    queue_display(current);
 }
 
+//// DISPLAY TEXT FUNCTION
+void format_cell_display(cell *current, char *buffer, size_t size) {
+    // Cells waiting for the worker show the pending marker
+    if (current->dirty) {
+        snprintf(buffer, size, "%s", PENDING_MARKER);
+    }
 
-/////////////////////////////////////////////////// CELL FUNCTIONS ///////////////////////////////////////////////////
+    // Text and errors show their string
+    else if (current->type == TEXT || current->type == ERROR) {
+        snprintf(buffer, size, "%s", current->content.text_value);
+    }
 
-//// CREATE NEW CELL FUNCTION
-cell *create_cell(ROW row, COL col, char *text) {
-    // Create and store key
-    char key[50];
-    snprintf(key, sizeof(key), "%d,%d", row, col);
+    // Formula results are shown with one decimal
+    else if (current->formula != NULL) {
+        snprintf(buffer, size, "%.1f", current->content.number_value);
+    }
+
+    // Else, plain numbers are shown as they were typed
+    else {
+        snprintf(buffer, size, "%s", current->original_input);
+    }
+}
 
-    // Hash key and put into index
-    unsigned int index = hash(key);
 
-    // Allocate memory for a new node
-    node *new_node = malloc(sizeof(node));
+/////////////////////////////////////////////////// AGGREGATE FUNCTIONS ///////////////////////////////////////////////////
+
+cell *find_cell(ROW row, COL col);
+void mark_dirty(cell *current);
+void record_edit(cell *current);
+
+//// RANGE CHECK FUNCTION
+int in_range(aggregate *agg, ROW row, COL col) {
+    return row >= agg->first_row && row <= agg->last_row && col >= agg->first_col && col <= agg->last_col;
+}
+
+//// CELL CONTRIBUTION FUNCTION
+// What a cell adds to the aggregates covering it: numbers count, text and empty cells don't
+contribution cell_contribution(cell *current) {
+    contribution result = {0, 0, 0};
+
+    if (current == NULL) {
+        return result;
+    }
+    if (current->type == NUMBER && (current->formula != NULL || current->original_input[0] != '\0')) {
+        result.number = current->content.number_value;
+        result.is_number = 1;
+    }
+    else if (current->type == ERROR) {
+        result.is_error = 1;
+    }
+    return result;
+}
+
+//// INDEX AGGREGATE FUNCTION
+// Adds an aggregate to the spans under 'span', which covers rows 'first' to 'last'
+void index_aggregate(aggregate_span **span, ROW first, ROW last, aggregate *agg) {
+    if (agg->last_row < first || agg->first_row > last) {
+        return;
+    }
+    if (*span == NULL) {
+        *span = calloc(1, sizeof(aggregate_span));
+    }
+
+    // Keep it here if it covers the whole span, else in the halves it overlaps
+    if (agg->first_row <= first && agg->last_row >= last) {
+        // Double capacity if array is full, reallocate
+        if ((*span)->count == (*span)->capacity) {
+            (*span)->capacity = (*span)->capacity == 0 ? 4 : (*span)->capacity * 2;
+            (*span)->aggregates = realloc((*span)->aggregates, (*span)->capacity * sizeof(aggregate *));
+        }
+        (*span)->aggregates[(*span)->count++] = agg;
+        return;
+    }
+    ROW middle = first + (last - first) / 2;
+    index_aggregate(&(*span)->halves[0], first, middle, agg);
+    index_aggregate(&(*span)->halves[1], middle + 1, last, agg);
+}
+
+//// UNINDEX AGGREGATE FUNCTION
+// Removes an aggregate from the spans under 'span', freeing the spans left empty
+void unindex_aggregate(aggregate_span **span, ROW first, ROW last, aggregate *agg) {
+    if (*span == NULL || agg->last_row < first || agg->first_row > last) {
+        return;
+    }
+
+    // Swap the last aggregate into its place
+    if (agg->first_row <= first && agg->last_row >= last) {
+        for (int i = 0; i < (*span)->count; i++) {
+            if ((*span)->aggregates[i] == agg) {
+                (*span)->aggregates[i] = (*span)->aggregates[--(*span)->count];
+                break;
+            }
+        }
+    }
+    else {
+        ROW middle = first + (last - first) / 2;
+        unindex_aggregate(&(*span)->halves[0], first, middle, agg);
+        unindex_aggregate(&(*span)->halves[1], middle + 1, last, agg);
+    }
+
+    if ((*span)->count == 0 && (*span)->halves[0] == NULL && (*span)->halves[1] == NULL) {
+        free((*span)->aggregates);
+        free(*span);
+        *span = NULL;
+    }
+}
+
+//// NEXT SPAN FUNCTION
+// Steps down from a span covering rows 'first' to 'last' into the half holding 'row', narrowing the rows to it
+aggregate_span *span_toward(aggregate_span *span, ROW row, ROW *first, ROW *last) {
+    ROW middle = *first + (*last - *first) / 2;
+    if (row <= middle) {
+        *last = middle;
+        return span->halves[0];
+    }
+    *first = middle + 1;
+    return span->halves[1];
+}
+
+//// REGISTER AGGREGATE FUNCTION
+void register_aggregate(aggregate *agg) {
+    for (COL col = agg->first_col; col <= agg->last_col; col++) {
+        index_aggregate(&aggregate_columns[col], 0, SHEET_ROWS - 1, agg);
+    }
+}
+
+//// UNREGISTER AGGREGATE FUNCTION
+void unregister_aggregate(aggregate *agg) {
+    for (COL col = agg->first_col; col <= agg->last_col; col++) {
+        unindex_aggregate(&aggregate_columns[col], 0, SHEET_ROWS - 1, agg);
+    }
+
+    cell_list_free(&agg->dirty_members);
+    free(agg);
+}
+
+//// EXACT AGGREGATE FUNCTION
+// Sums the whole range again, done on first use and every AGGREGATE_EXACT_INTERVAL updates
+void recompute_aggregate(aggregate *agg) {
+    agg->sum = 0;
+    agg->numbers = 0;
+    agg->errors = 0;
+
+    for (ROW row = agg->first_row; row <= agg->last_row; row++) {
+        for (COL col = agg->first_col; col <= agg->last_col; col++) {
+            contribution value = cell_contribution(find_cell(row, col));
+            if (value.is_number) {
+                agg->sum += value.number;
+                agg->numbers++;
+            }
+            agg->errors += value.is_error;
+        }
+    }
+
+    agg->updates = 0;
+    agg->exact = 1;
+}
+
+//// UPDATE AGGREGATES FUNCTION
+// Applies the change of a cell's value to every aggregate covering it, given what it contributed before
+void update_aggregates(cell *current, contribution before) {
+    contribution after = cell_contribution(current);
+
+    // Nothing to do if the value did not change
+    if (before.is_number == after.is_number && before.is_error == after.is_error && before.number == after.number) {
+        return;
+    }
+
+    ROW first = 0, last = SHEET_ROWS - 1;
+    for (aggregate_span *span = aggregate_columns[current->col]; span != NULL;
+         span = span_toward(span, current->row, &first, &last)) {
+        for (int i = 0; i < span->count; i++) {
+            aggregate *agg = span->aggregates[i];
+            if (agg->owner == current) {
+                continue;
+            }
+
+            // Take the old value out and put the new one in
+            agg->sum += (after.is_number ? after.number : 0) - (before.is_number ? before.number : 0);
+            agg->numbers += after.is_number - before.is_number;
+            agg->errors += after.is_error - before.is_error;
+            agg->updates++;
+
+            // The owner needs to show the new total, unless it is the cell being evaluated
+            if (!agg->owner->dirty && agg->owner->visit_mark != recalc_epoch) {
+                mark_dirty(agg->owner);
+                record_edit(agg->owner);
+            }
+        }
+    }
+}
 
-    // Copy the key to the new node, insert at beginning of list
-    strcpy(new_node->key, key);
+
+/////////////////////////////////////////////////// CELL FUNCTIONS ///////////////////////////////////////////////////
+
+//// INSERT NEW CELL FUNCTION
+// Puts an empty cell at the front of bucket 'index', without counting it
+static cell *insert_cell(unsigned int index, ROW row, COL col) {
+    // Allocate memory for a new node, insert at beginning of list
+    node *new_node = malloc(sizeof(node));
     new_node->next = spreadsheet[index];
     spreadsheet[index] = new_node;
 
@@ -117,46 +476,104 @@ cell *create_cell(ROW row, COL col, char *text) {
     current->dependents = NULL;
     current->dependents_count = 0;
     current->dependents_capacity = 0;
-
-    // Set original state, set original input to text
-    current->state = UNVISITED;
-    current->original_input = strdup(text);
+    current->dependent_cells = 0;
+
+    // Set original state, the caller fills in the contents
+    current->visit_mark = 0;
+    current->dirty = 0;
+    current->type = NUMBER;
+    current->content.number_value = 0;
+    current->formula = NULL;
+    current->terms = NULL;
+    current->term_count = 0;
+    current->computed_value = 0;
+    current->cycle_head = 0;
+    current->scc_mark = 0;
+    current->scan_term = 0;
+    current->scan_member = 0;
+    current->profile_count = 0;
+    current->profile_time = 0;
+    current->original_input = NULL;
 
     return current;
 }
 
+//// CREATE NEW CELL FUNCTION
+cell *create_cell(ROW row, COL col) {
+    // Keep the chains short as the sheet fills up
+    if (++spreadsheet_count > spreadsheet_size) {
+        grow_spreadsheet(spreadsheet_count);
+    }
+
+    // Hash position and put into index
+    return insert_cell(hash(row, col), row, col);
+}
+
 //// ADD DEPENDANT ARRAY FUNCTION
+// Adds the dependant unless it is already in a run, extending a run when it is next to one
 void add_dependent(cell *current, cell *dependent) {
+    // Already a dependant. Every run is checked before any is extended, an older run may hold the row
+    // next to a newer one.
+    for (int i = 0; i < current->dependents_count; i++) {
+        dependent_run *run = &current->dependents[i];
+        if (run->col == dependent->col && dependent->row >= run->first_row && dependent->row <= run->last_row) {
+            return;
+        }
+    }
+
+    // Newest runs first, a fill-down keeps extending the last one
+    for (int i = current->dependents_count - 1; i >= 0; i--) {
+        dependent_run *run = &current->dependents[i];
+        if (run->col != dependent->col) {
+            continue;
+        }
+
+        // Directly below or above the run, extend it
+        if (dependent->row == run->last_row + 1) {
+            run->last_row++;
+            current->dependent_cells++;
+            tiles_touch(current->row, current->col);
+            return;
+        }
+        if (dependent->row + 1 == run->first_row) {
+            run->first_row--;
+            current->dependent_cells++;
+            tiles_touch(current->row, current->col);
+            return;
+        }
+    }
+
     // Allocate memory for dependant array if uninitialized
     if(current->dependents_capacity == 0){
         current->dependents_capacity = 1;
         current->dependents_count = 0;
-        current->dependents = calloc(1, sizeof(cell*));
+        current->dependents = calloc(1, sizeof(dependent_run));
     }
 
     // Double capacity if array is full, reallocate
     else if (current->dependents_count == current->dependents_capacity) {
         current->dependents_capacity *= 2;
-        current->dependents = realloc(current->dependents, current->dependents_capacity * sizeof(cell));
+        current->dependents = realloc(current->dependents, current->dependents_capacity * sizeof(dependent_run));
     }
 
-    // Add dependent cell
-    current->dependents[current->dependents_count++] = dependent;
+    // Add dependent cell as a new run
+    dependent_run *run = &current->dependents[current->dependents_count++];
+    run->col = dependent->col;
+    run->first_row = dependent->row;
+    run->last_row = dependent->row;
+    current->dependent_cells++;
+    tiles_touch(current->row, current->col);
 }
 
-//// FIND A CELL FUNCTION
-cell *find_cell(ROW row, COL col) {
-    // Store key, format key, compute hash
-    char key[50];
-    sprintf(key, "%d,%d", row, col);
-    unsigned int index = hash(key);
-
-    // Get first node in linked list
-    node *current = spreadsheet[index];
+//// FIND A RESIDENT CELL FUNCTION
+// Looks in memory only, a cell of a paged out tile is not found
+cell *find_resident_cell(ROW row, COL col) {
+    // Compute hash of position, get first node in linked list
+    node *current = spreadsheet[hash(row, col)];
 
     // Loop over the linked list until cell is found
     while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
+        if (current->value.row == row && current->value.col == col) {
             return &current->value;
         }
         current = current->next;
@@ -166,43 +583,171 @@ cell *find_cell(ROW row, COL col) {
     return NULL;
 }
 
-//// CLEAR CELL FUNCTION
-void clear_cell(ROW row, COL col) {
-    // Find cell position
-    cell *current = find_cell(row, col);
+//// FIND A CELL FUNCTION
+cell *find_cell(ROW row, COL col) {
+    cell *current = find_resident_cell(row, col);
 
-    //Check cell type and free corresponding data memory
-    if (current->type == FORMULA) {
-        free(current->formula);
+    // A paged workbook keeps track of the tiles in use, and brings a tile in when a cell of it is missing
+    if (tiles_paging) {
+        if (current != NULL) {
+            tiles_reference(row, col);
+        }
+        else if (tiles_fault(row, col)) {
+            current = find_resident_cell(row, col);
+        }
     }
+    return current;
+}
 
-    else if (current->type == TEXT || current->type == ERROR) {
-        free(current->content.text_value);
+//// FREE CELL CONTENTS FUNCTION
+void release_cell_contents(cell *current) {
+    // Free formula if the cell has one
+    if (current->formula != NULL) {
+        for (int t = 0; t < current->term_count; t++) {
+            if (current->terms[t].kind == TERM_AGGREGATE) {
+                unregister_aggregate(current->terms[t].aggregate);
+            }
+        }
+        free_cell_text(current->formula);
+        if (!snapshot_owns(current->terms)) {
+            free(current->terms);
+        }
+        current->formula = NULL;
+        current->terms = NULL;
+        current->term_count = 0;
     }
 
-    else{
-        current->content.number_value = 0;
+    // Free text data memory
+    if (current->type == TEXT || current->type == ERROR) {
+        free_cell_text(current->content.text_value);
     }
-
-    // Free dependant array
-    free(current->dependents);
+    current->content.number_value = 0;
 
     // Free original input if valid
     if (current->original_input != NULL) {
-        free(current->original_input);
+        free_cell_text(current->original_input);
+        current->original_input = NULL;
+    }
+}
+
+//// MARK DIRTY FUNCTION
+void mark_dirty(cell *current) {
+    // Skip cells already waiting for the worker
+    if (current->dirty) {
+        return;
+    }
+
+    // Flag the cell, queue it by priority, show the pending marker
+    current->dirty = 1;
+    cell_list_push(in_viewport(current) ? &visible_dirty : &offscreen_dirty, current);
+    queue_display(current);
+
+    // Aggregates covering a formula evaluate it before themselves
+    if (current->formula != NULL) {
+        ROW first = 0, last = SHEET_ROWS - 1;
+        for (aggregate_span *span = aggregate_columns[current->col]; span != NULL;
+             span = span_toward(span, current->row, &first, &last)) {
+            for (int i = 0; i < span->count; i++) {
+                if (span->aggregates[i]->owner != current) {
+                    cell_list_push(&span->aggregates[i]->dirty_members, current);
+                }
+            }
+        }
+    }
+}
+
+//// MARK DEPENDANT CELLS DIRTY FUNCTION
+// Expands the cells in the propagate queue, looking at no more than 'limit' dependants. Returns 1 once the
+// queue is empty, 0 if it stopped with cells left.
+int propagate_dirty(int limit) {
+    // Walk the dependants breadth first, each cell is expanded when it is first marked
+    for (; propagate_next < propagate_queue.count; propagate_next++) {
+        cell *dependent = propagate_queue.cells[propagate_next];
+        for (; propagate_run < dependent->dependents_count; propagate_run++) {
+            dependent_run *run = &dependent->dependents[propagate_run];
+            for (; run->first_row + propagate_offset <= run->last_row; propagate_offset++) {
+                if (limit-- == 0) {
+                    return 0;
+                }
+                cell *next_dependent = find_cell(run->first_row + propagate_offset, run->col);
+                if (next_dependent != NULL && !next_dependent->dirty) {
+                    mark_dirty(next_dependent);
+                    cell_list_push(&propagate_queue, next_dependent);
+                }
+            }
+            propagate_offset = 0;
+        }
+        propagate_run = 0;
+
+        // Aggregates depend on their whole range without keeping an edge per cell
+        ROW first = 0, last = SHEET_ROWS - 1;
+        for (aggregate_span *span = aggregate_columns[dependent->col]; span != NULL;
+             span = span_toward(span, dependent->row, &first, &last)) {
+            for (int i = 0; i < span->count; i++) {
+                cell *owner = span->aggregates[i]->owner;
+                if (!owner->dirty && owner != dependent) {
+                    mark_dirty(owner);
+                    cell_list_push(&propagate_queue, owner);
+                }
+            }
+        }
+    }
+
+    propagate_queue.count = 0;
+    propagate_next = 0;
+    return 1;
+}
+
+// The first dependants are marked before the edit returns, the worker marks the rest
+void mark_dependents_dirty(cell *current) {
+    cell_list_push(&propagate_queue, current);
+    propagate_dirty(PROPAGATE_STEP);
+}
+
+//// RECORD AN EDIT FUNCTION
+void record_edit(cell *current) {
+    // Inside a batch the dependants are marked together at commit
+    if (batch_depth > 0) {
+        cell_list_push(&batch_edits, current);
+    }
+
+    // Else, mark them now
+    else {
+        mark_dependents_dirty(current);
+    }
+}
+
+//// CLEAR CELL FUNCTION
+void clear_cell(ROW row, COL col) {
+    model_lock_acquire();
+
+    // Find cell position, nothing to clear if it does not exist
+    cell *current = find_cell(row, col);
+    if (current == NULL) {
+        model_lock_release();
+        return;
     }
+    journal_record('C', row, col, NULL);
+
+    // Free corresponding data memory, keep dependants so they are recalculated
+    contribution before = cell_contribution(current);
+    release_cell_contents(current);
+    current->type = NUMBER;
+    current->original_input = strdup("");
+    current->dirty = 0;
+    update_aggregates(current, before);
 
-    update_cell_display(row, col, "");
+    // Update display, dependants are recalculated by the worker
+    queue_display(current);
+    record_edit(current);
+
+    model_lock_release();
 }
 
 //// FREEING A CELL FUNCTION
 void free_cell(ROW row, COL col) {
-    // Create key
-    char key[50];
-    sprintf(key, "%d,%d", row, col);
-
-    // Compute hash of key, get first node
-    unsigned int index = hash(key);
+    // Compute hash of position, get first node
+    unsigned int index = hash(row, col);
     node *current = spreadsheet[index];
 
     // Set prev node to NULL
@@ -210,8 +755,8 @@ void free_cell(ROW row, COL col) {
 
     // Loop over the nodes in the linked list
     while (current != NULL) {
-        // If the key of the current node matches the key of the cell
-        if (strcmp(current->key, key) == 0) {
+        // If the current node holds the cell
+        if (current->value.row == row && current->value.col == col) {
             // If the current node is the last node remove it
             if (prev == NULL) {
                 spreadsheet[index] = current->next;
@@ -223,11 +768,12 @@ void free_cell(ROW row, COL col) {
             }
 
             // Clear all the values from the cell
-            clear_cell(current->value.row, current->value.col);
+            release_cell_contents(&current->value);
+            free(current->value.dependents);
 
-            // Free node memory, update cell display
+            // Free node memory
             free(current);
-            update_cell_display(row, col, "");
+            spreadsheet_count--;
             return;
         }
 
@@ -239,311 +785,1354 @@ void free_cell(ROW row, COL col) {
     return;
 }
 
-//// EVALUATE A FORMULA IN A CELL FUNCTION
-double evaluate_formula(cell *current, char *formula) {
-    // Set the state of the cell to VISITING to detect circular dependencies
-    current->state = VISITING;
-
-    // Initialize the result of the formula to 0
-    double result = 0;
-    char *result_str = NULL;
-
-    // Tokenize the formula by the '+' operator
-    char *temp_formula = strdup(current->formula);
-    char *token = strtok(temp_formula, "+");
-
-    // Loop over the tokens in the formula
-    while (token != NULL) {
-        // If the token is a cell reference
-        if (isalpha(token[0])) {
-
-            // Compute cell position and find
-            COL col = token[0] - 'A';
-            ROW row = atoi(token + 1) - 1;
-            cell *cell = find_cell(row, col);
-
-            // If the cell does not exist, set an error and return NaN
-            if (cell == NULL) {
-                set_error_and_update(current, "ERROR: invalid cell reference");
-                current->state = UNVISITED;
-                return NAN;
-            }
-
-            // If the cell is currently being visited, set an error for circular dependency and return NaN
-            if (cell->state == VISITING) {
-                set_error_and_update(current, "ERROR: circular dependency");
-                current->state = UNVISITED;
-                return NAN;
-            }
-
-            // If the cell contains a number, add it to the result
-            if (cell->type == NUMBER) {
-                result += cell->content.number_value;
-            }
-
-            // If the cell type is FORMULA, then second formula needs to be evaluated
-            else if (cell->type == FORMULA) {
-                //Accounting for formula inside a formula
-                double sub_formula_result = evaluate_formula(cell, cell->formula);
-
-                //If no sub formula, return
-                if (isnan(sub_formula_result)) {
-                    current->state = UNVISITED;
-                    return NAN;
-                }
+//// POINTER COMPARISON FUNCTIONS
+int compare_cell_pointers(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t) *(cell *const *) a;
+    uintptr_t second = (uintptr_t) *(cell *const *) b;
+    return (first > second) - (first < second);
+}
 
-                //Add results
-                result += sub_formula_result;
-            }
+int compare_aggregate_pointers(const void *a, const void *b) {
+    uintptr_t first = (uintptr_t) *(aggregate *const *) a;
+    uintptr_t second = (uintptr_t) *(aggregate *const *) b;
+    return (first > second) - (first < second);
+}
 
-            // Else, if cell type is TEXT or ERROR, return strings
-            else if (cell->type == TEXT || cell->type == ERROR) {
-                // If result_string is null or cell type is ERROR, set result_string to first string
-                if (result_str == NULL || cell->type == ERROR) {
-                    result_str = strdup(cell->content.text_value);
-                }
+//// FILTER CELL LIST FUNCTION
+// Removes the cells in the sorted 'dropped' list from 'list', keeping the order of the rest
+void filter_cell_list(cell_list *list, cell_list *dropped) {
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (bsearch(&list->cells[i], dropped->cells, dropped->count, sizeof(cell *), compare_cell_pointers) == NULL) {
+            list->cells[kept++] = list->cells[i];
+        }
+    }
+    list->count = kept;
+}
 
-                //Else, make a new combined string by copying both strings
-                else {
-                    char *new_result_str = malloc(strlen(result_str) + strlen(cell->content.text_value) + 1);
-                    strcpy(new_result_str, result_str);
-                    strcat(new_result_str, cell->content.text_value);
-                    free(result_str);
-                    result_str = new_result_str;
+//// DROP CELLS FUNCTION
+// Frees cells of evicted tiles. They are clean, but queues may still hold them from before they were evaluated.
+void drop_cells(cell_list *cells) {
+    qsort(cells->cells, cells->count, sizeof(cell *), compare_cell_pointers);
+    filter_cell_list(&visible_dirty, cells);
+    filter_cell_list(&offscreen_dirty, cells);
+
+    // Only the aggregates over a dropped formula can hold it as a dirty member, each is filtered once
+    aggregate **touched = NULL;
+    int touched_count = 0;
+    int touched_capacity = 0;
+    for (int c = 0; c < cells->count; c++) {
+        cell *current = cells->cells[c];
+        if (current->formula == NULL) {
+            continue;
+        }
+        ROW first = 0, last = SHEET_ROWS - 1;
+        for (aggregate_span *span = aggregate_columns[current->col]; span != NULL;
+             span = span_toward(span, current->row, &first, &last)) {
+            for (int i = 0; i < span->count; i++) {
+                if (span->aggregates[i]->dirty_members.count == 0) {
+                    continue;
                 }
-            }
-
-            // Check if cell is dependency
-            int dependant_check = 0;
-            for(int i = 0; i < cell->dependents_count; i++){
-                if(cell->dependents[i] == current) {
-                    dependant_check = 1;
-                    break;
+                if (touched_count == touched_capacity) {
+                    touched_capacity = touched_capacity == 0 ? 16 : touched_capacity * 2;
+                    touched = realloc(touched, touched_capacity * sizeof(aggregate *));
                 }
+                touched[touched_count++] = span->aggregates[i];
             }
-
-            // If not, add the current cell as a dependent
-            if(dependant_check == 0) {
-                add_dependent(cell, current);
-            }
-
-            // Break out of loop if cell type is ERROR
-            if(cell->type == ERROR){
-                break;
-            }
-        }
-
-        // Else if token is a number, add to result
-        else if(isdigit(token)){
-            result += atof(token);
         }
-
-        //Else, token is not valid, set error
-        else{
-            set_error_and_update(current, "ERROR: invalid cell reference");
-            current->state = UNVISITED;
-            return NAN;
+    }
+    qsort(touched, touched_count, sizeof(aggregate *), compare_aggregate_pointers);
+    for (int i = 0; i < touched_count; i++) {
+        if (i == 0 || touched[i] != touched[i - 1]) {
+            filter_cell_list(&touched[i]->dirty_members, cells);
         }
+    }
+    free(touched);
 
-        // Get the next token in the formula
-        token = strtok(NULL, "+");
+    for (int i = 0; i < cells->count; i++) {
+        free_cell(cells->cells[i]->row, cells->cells[i]->col);
+    }
+    cells->count = 0;
+}
 
+//// PARSE CELL NAME FUNCTION
+// Reads a name such as "B12" at 'text', returns -1 unless it is a cell of the sheet
+int parse_cell_name(char *text, ROW *row, COL *col, char **end) {
+    if (text[0] < 'A' || text[0] >= 'A' + SHEET_COLS || !isdigit((unsigned char) text[1])) {
+        return -1;
     }
+    long number = strtol(text + 1, end, 10);
+    if (number < 1 || number > SHEET_ROWS) {
+        return -1;
+    }
+    *row = (ROW) (number - 1);
+    *col = (COL) (text[0] - 'A');
+    return 0;
+}
 
-    // Set the state of the cell to UNVISITED after the evaluation, return result
-    current->state = UNVISITED;
+//// PARSE AN AGGREGATE FUNCTION
+// Parses "SUM(A1:B10)", "COUNT(...)" or "AVERAGE(...)", returns NULL if the token is not one
+aggregate *parse_aggregate(cell *owner, char *token) {
+    aggregate_function function;
+    char *range;
 
-    // If adding strings and integers together, set error for incompatible types
-    if(result_str != NULL && result != 0){
-        set_error_and_update(current, "ERROR: incompatible types");
-        return NAN;
+    // Match the function name
+    if (strncmp(token, "SUM(", 4) == 0) {
+        function = AGGREGATE_SUM;
+        range = token + 4;
+    }
+    else if (strncmp(token, "COUNT(", 6) == 0) {
+        function = AGGREGATE_COUNT;
+        range = token + 6;
+    }
+    else if (strncmp(token, "AVERAGE(", 8) == 0) {
+        function = AGGREGATE_AVERAGE;
+        range = token + 8;
+    }
+    else {
+        return NULL;
     }
 
-    // Else if result string is not NULL, update cell
-    else if (result_str != NULL) {
-        current->content.text_value = result_str;
-        current->type = TEXT;
-        return NAN;
+    // Parse both corners of the range, which must be on the sheet and followed by ')'
+    char *end;
+    ROW first_row, last_row;
+    COL first_col, last_col;
+    if (parse_cell_name(range, &first_row, &first_col, &end) != 0 || *end != ':' ||
+        parse_cell_name(end + 1, &last_row, &last_col, &end) != 0 || strcmp(end, ")") != 0) {
+        return NULL;
     }
 
-    return result;
+    // Corners may be given in either order
+    aggregate *agg = calloc(1, sizeof(aggregate));
+    agg->function = function;
+    agg->owner = owner;
+    agg->first_row = first_row < last_row ? first_row : last_row;
+    agg->last_row = first_row < last_row ? last_row : first_row;
+    agg->first_col = first_col < last_col ? first_col : last_col;
+    agg->last_col = first_col < last_col ? last_col : first_col;
+    return agg;
 }
 
-//// UPDATING DEPENDANT CELLS FUNCTION
-void update_dependencies(cell *current) {
-    for (int i = 0; i < current->dependents_count; i++) {
-        // Get dependant cell
-        cell *dependent = current->dependents[i];
-
-        // If the dependent cell is the same as the current cell, set circular reference error
-        if (dependent == current) {
-            set_error_and_update(current, "ERROR: circular dependency");
-            continue;
+//// COMPILE A FORMULA FUNCTION
+// Splits the formula into its terms once, so it is not re-tokenized on every evaluation
+void compile_formula(cell *current) {
+    // A formula has at most one term per '+' operator
+    int max_terms = 1;
+    for (char *c = current->formula; *c != '\0'; c++) {
+        if (*c == '+') {
+            max_terms++;
         }
+    }
+    current->terms = malloc(max_terms * sizeof(formula_term));
+    current->term_count = 0;
+
+    // Tokenize the formula by the '+' operator
+    char *temp_formula = strdup(current->formula);
+    char *save_ptr;
+    char *token = strtok_r(temp_formula, "+", &save_ptr);
 
-        // Reevaluate formula at dependant cell
-        double formula_result = evaluate_formula(dependent, dependent->formula);
+    // Loop over the tokens in the formula
+    while (token != NULL) {
+        formula_term *term = &current->terms[current->term_count++];
+        term->aggregate = NULL;
+
+        // If the token is a function over a range, start tracking the range
+        if (strchr(token, '(') != NULL) {
+            term->aggregate = parse_aggregate(current, token);
+            term->kind = term->aggregate != NULL ? TERM_AGGREGATE : TERM_INVALID;
+            if (term->aggregate != NULL) {
+                register_aggregate(term->aggregate);
+            }
+        }
 
-        // If result is NAN it's text or error
-        if (isnan(formula_result)) {
-            //Set error message if type is error, update display
-            if(dependent->type == ERROR)
-                set_error_and_update(dependent, "ERROR: incompatible types");
-            update_cell_display(dependent->row, dependent->col, dependent->content.text_value);
+        // Else if the token is a cell reference, compute cell position, a name off the sheet is not valid
+        else if (isalpha(token[0])) {
+            char *end;
+            term->kind = parse_cell_name(token, &term->row, &term->col, &end) == 0 ? TERM_REFERENCE : TERM_INVALID;
         }
 
-        // Else, result is number
+        // Else, token should be a number
         else {
-            // Set type and value
-            dependent->type = NUMBER;
-            dependent->content.number_value = formula_result;
+            char *end;
+            term->number = strtod(token, &end);
 
-            // Convert the number value to a string
-            char dependent_value[50];
-            snprintf(dependent_value, sizeof(dependent_value), "%.1f", dependent->content.number_value);
-
-            // Update the display
-            update_cell_display(dependent->row, dependent->col, dependent_value);
+            // Token is not valid if it is not entirely a number
+            term->kind = (end != token && *end == '\0') ? TERM_NUMBER : TERM_INVALID;
         }
-    }
+
+        // Get the next token in the formula
+        token = strtok_r(NULL, "+", &save_ptr);
+    }
+
+    free(temp_formula);
 }
 
-//// SETTING CELL VALUE FUNCTION
-void set_cell_value(ROW row, COL col, char *text) {
-    // Find the cell at the given row and column
-    cell *current = find_cell(row, col);
+//// EVALUATE A FORMULA IN A CELL FUNCTION
+// Stores the result in the cell and returns it, or NaN if it is not a number
+double evaluate_formula(cell *current) {
+    // Initialize the result of the formula to 0
+    double result = 0;
+    char *result_str = NULL;
 
-    // If the cell does not exist, create new cell
-    if (current == NULL) {
-        current = create_cell(row, col, text);
+    // Loop over the terms in the formula
+    for (int t = 0; t < current->term_count; t++) {
+        formula_term *term = &current->terms[t];
+
+        // If the term is a number, add to result
+        if (term->kind == TERM_NUMBER) {
+            result += term->number;
+            continue;
+        }
+
+        // If the term is an aggregate, add its running total
+        if (term->kind == TERM_AGGREGATE) {
+            aggregate *agg = term->aggregate;
+
+            // A range containing the cell itself, or a member depending on it, is circular
+            if (in_range(agg, current->row, current->col) || agg->range_cycle) {
+                agg->range_cycle = 0;
+                set_error_and_update(current, "ERROR: circular dependency");
+                free(result_str);
+                return NAN;
+            }
+
+            // Every member is up to date now, sum exactly when it is due
+            agg->dirty_members.count = 0;
+            if (!agg->exact || agg->updates >= AGGREGATE_EXACT_INTERVAL) {
+                recompute_aggregate(agg);
+            }
+
+            // Errors in the range are passed on
+            if (agg->errors > 0) {
+                set_error_and_update(current, "ERROR: error in range");
+                free(result_str);
+                return NAN;
+            }
+
+            if (agg->function == AGGREGATE_SUM) {
+                result += agg->sum;
+            }
+            else if (agg->function == AGGREGATE_COUNT) {
+                result += agg->numbers;
+            }
+            else if (agg->numbers > 0) {
+                result += agg->sum / agg->numbers;
+            }
+            else {
+                set_error_and_update(current, "ERROR: division by zero");
+                free(result_str);
+                return NAN;
+            }
+            continue;
+        }
+
+        //Else if term is not valid, set error
+        if (term->kind == TERM_INVALID) {
+            set_error_and_update(current, "ERROR: invalid cell reference");
+            free(result_str);
+            return NAN;
+        }
+
+        // Else, term is a cell reference, find it
+        cell *cell = find_cell(term->row, term->col);
+
+        // If the cell does not exist, set an error and return NaN
+        if (cell == NULL) {
+            set_error_and_update(current, "ERROR: invalid cell reference");
+            free(result_str);
+            return NAN;
+        }
+
+        // Add the current cell as a dependent if it is not one already
+        add_dependent(cell, current);
+
+        // Dirty precedents were evaluated by recalc_cell before this cell, so one
+        // that is still being visited means there is a circular dependency
+        if (cell->visit_mark == recalc_epoch) {
+            // In iterative mode, use its last value and let it resolve the cycle once it is evaluated
+            if (iterative_enabled) {
+                cell->cycle_head = 1;
+                result += cell->computed_value;
+                continue;
+            }
+
+            // Else, set an error for circular dependency and return NaN
+            set_error_and_update(current, "ERROR: circular dependency");
+            free(result_str);
+            return NAN;
+        }
+
+        // If the cell contains a number, add it to the result
+        if (cell->type == NUMBER) {
+            result += cell->content.number_value;
+        }
+
+        // If the cell is an error, the error is passed on
+        else if (cell->type == ERROR) {
+            set_error_and_update(current, cell->content.text_value);
+            free(result_str);
+            return NAN;
+        }
+
+        // Else, cell type is TEXT, concatenate strings
+        else if (cell->type == TEXT) {
+            // If result_string is null, set result_string to first string
+            if (result_str == NULL) {
+                result_str = strdup(cell->content.text_value);
+            }
+
+            //Else, make a new combined string by copying both strings
+            else {
+                char *new_result_str = malloc(strlen(result_str) + strlen(cell->content.text_value) + 1);
+                strcpy(new_result_str, result_str);
+                strcat(new_result_str, cell->content.text_value);
+                free(result_str);
+                result_str = new_result_str;
+            }
+        }
+    }
+
+    // If adding strings and integers together, set error for incompatible types
+    if(result_str != NULL && result != 0){
+        free(result_str);
+        set_error_and_update(current, "ERROR: incompatible types");
+        return NAN;
     }
 
-    // Else, cell exists
+    // Else if result string is not NULL, update cell
+    else if (result_str != NULL) {
+        current->content.text_value = result_str;
+        current->type = TEXT;
+        return NAN;
+    }
+
+    // Else, result is number, set type and value
+    current->type = NUMBER;
+    current->computed_value = result;
+    current->content.number_value = result;
+    return result;
+}
+
+double profile_now();
+
+//// EVALUATE A CELL IN PLACE FUNCTION
+void evaluate_cell(cell *current) {
+    contribution before = cell_contribution(current);
+
+    // Free the previous text result
+    if (current->type == TEXT || current->type == ERROR) {
+        free_cell_text(current->content.text_value);
+    }
+    current->type = FORMULA;
+    current->content.number_value = 0;
+
+    // Evaluate the formula, result is stored in the cell
+    if (!profiling_enabled) {
+        evaluate_formula(current);
+    }
+
+    // When profiling, time the evaluation
     else {
-        // If the cell contains original input free the memory
-        if (current->original_input != NULL) {
-            free(current->original_input);
+        double start = profile_now();
+        evaluate_formula(current);
+        current->profile_count++;
+        current->profile_time += profile_now() - start;
+    }
+
+    // Aggregates covering the cell take the difference
+    update_aggregates(current, before);
+}
+
+//// FIND STRONGLY CONNECTED COMPONENT FUNCTION
+// Collects the cells that both feed and depend on 'head' into scc_members
+void find_cycle_component(cell *head) {
+    // Start a new search, cells reachable through the precedents of head are marked with the epoch
+    scc_epoch += 2;
+    scc_reachable.count = 0;
+    head->scc_mark = scc_epoch;
+    cell_list_push(&scc_reachable, head);
+    for (int next = 0; next < scc_reachable.count; next++) {
+        cell *current = scc_reachable.cells[next];
+        for (int t = 0; t < current->term_count; t++) {
+            if (current->terms[t].kind != TERM_REFERENCE) {
+                continue;
+            }
+            cell *precedent = find_cell(current->terms[t].row, current->terms[t].col);
+            if (precedent != NULL && precedent->formula != NULL && precedent->scc_mark < scc_epoch) {
+                precedent->scc_mark = scc_epoch;
+                cell_list_push(&scc_reachable, precedent);
+            }
         }
+    }
+
+    // Of those, the ones that reach back to head through its dependants are the component, marked epoch + 1
+    scc_members.count = 0;
+    head->scc_mark = scc_epoch + 1;
+    cell_list_push(&scc_members, head);
+    for (int next = 0; next < scc_members.count; next++) {
+        cell *current = scc_members.cells[next];
+        for (int i = 0; i < current->dependents_count; i++) {
+            dependent_run *run = &current->dependents[i];
+            for (ROW row = run->first_row; row <= run->last_row; row++) {
+                cell *dependent = find_cell(row, run->col);
+                if (dependent != NULL && dependent->scc_mark == scc_epoch) {
+                    dependent->scc_mark = scc_epoch + 1;
+                    cell_list_push(&scc_members, dependent);
+                }
+            }
+        }
+    }
+}
+
+//// RESOLVE A CIRCULAR DEPENDENCY FUNCTION
+// Gauss-Seidel iteration over the cycle's component only, each cell uses the newest values of the others
+void resolve_cycle(cell *head) {
+    find_cycle_component(head);
+
+    for (int iteration = 0; iteration < iterative_max_iterations; iteration++) {
+        double max_change = 0;
 
-        // Set the original input to the given text
-        current->original_input = strdup(text);
+        for (int i = 0; i < scc_members.count; i++) {
+            cell *member = scc_members.cells[i];
+            double previous = member->computed_value;
 
-        // If the cell type is FORMULA, free memory
-        if (current->type == FORMULA) {
-            free(current->formula);
+            // Visiting while evaluated, so a reference to itself uses its last value
+            member->visit_mark = recalc_epoch;
+            evaluate_cell(member);
+            member->visit_mark = recalc_epoch + 1;
+
+            // Text and errors cannot converge, stop iterating
+            if (member->type != NUMBER) {
+                iteration = iterative_max_iterations;
+                break;
+            }
+
+            // Track the biggest change of this iteration
+            if (fabs(member->computed_value - previous) > max_change) {
+                max_change = fabs(member->computed_value - previous);
+            }
         }
 
-        // Else if cell type is TEXT or ERROR, free memory
-        else if (current->type == TEXT || current->type == ERROR) {
-            free(current->content.text_value);
+        // Stop once the values have settled
+        if (max_change <= iterative_max_change) {
+            break;
         }
     }
 
+    // The component is resolved, show the final values
+    for (int i = 0; i < scc_members.count; i++) {
+        scc_members.cells[i]->cycle_head = 0;
+        queue_display(scc_members.cells[i]);
+    }
+}
+
+//// PUSH ONTO EVALUATION STACK FUNCTION
+void push_evaluation(cell *current) {
+    // Clear the flag first so a cycle back to this cell is seen as visiting, not dirty
+    current->dirty = 0;
 
-    // If first character of input text is '=', evaluate as formula
+    // Only formulas have anything to recalculate
+    if (current->formula == NULL) {
+        queue_display(current);
+        return;
+    }
+
+    // Cells on the stack are VISITING until they are evaluated
+    current->visit_mark = recalc_epoch;
+    current->scan_term = 0;
+    current->scan_member = 0;
+    cell_list_push(&eval_stack, current);
+}
+
+//// ABANDON EVALUATION FUNCTION
+// Puts the cells of a chain the worker gave the lock up in back in its queues, flagged dirty, so the stack
+// can be used for something else
+void abandon_evaluation() {
+    for (int i = 0; i < eval_stack.count; i++) {
+        if (eval_stack.cells[i]->formula != NULL) {
+            mark_dirty(eval_stack.cells[i]);
+        }
+    }
+    eval_stack.count = 0;
+}
+
+//// EVALUATE STACK FUNCTION
+// Evaluates the cells on the evaluation stack, each after its dirty precedents. With 'yielding' set, as the
+// worker does, it stops between two steps once someone waits for the lock and leaves the stack as it is.
+void evaluate_stack(int yielding) {
+    while (eval_stack.count > 0) {
+        if (yielding && atomic_load(&lock_waiters) > 0) {
+            return;
+        }
+        cell *current = eval_stack.cells[eval_stack.count - 1];
+
+        // An edit made while the lock was given up may have left no formula to evaluate
+        if (current->formula == NULL) {
+            eval_stack.count--;
+            current->visit_mark = recalc_epoch + 1;
+            queue_display(current);
+            continue;
+        }
+
+        // Look for the next dirty precedent, each term is only checked once
+        cell *precedent = NULL;
+        while (current->scan_term < current->term_count && precedent == NULL) {
+            formula_term *term = &current->terms[current->scan_term];
+
+            // For aggregates, the dirty formulas in the range are the precedents
+            if (term->kind == TERM_AGGREGATE && current->scan_member < term->aggregate->dirty_members.count) {
+                cell *member = term->aggregate->dirty_members.cells[current->scan_member++];
+                if (member->visit_mark == recalc_epoch) {
+                    term->aggregate->range_cycle = 1;
+                }
+                else if (member->dirty) {
+                    precedent = member;
+                }
+                continue;
+            }
+            current->scan_term++;
+            current->scan_member = 0;
+
+            // A precedent already on the stack is a cycle, even if an edit flagged it dirty again
+            if (term->kind == TERM_REFERENCE) {
+                precedent = find_cell(term->row, term->col);
+                if (precedent != NULL && (!precedent->dirty || precedent->visit_mark == recalc_epoch)) {
+                    precedent = NULL;
+                }
+            }
+        }
+
+        // Precedents are evaluated first
+        if (precedent != NULL) {
+            push_evaluation(precedent);
+            continue;
+        }
+
+        // Else, every precedent is up to date, evaluate the formula, result is stored in the cell
+        eval_stack.count--;
+        profile_recalcs++;
+        evaluate_cell(current);
+        current->visit_mark = recalc_epoch + 1;
+
+        // If a precedent looped back to this cell, iterate its cycle
+        if (current->cycle_head) {
+            resolve_cycle(current);
+        }
+        queue_display(current);
+    }
+}
+
+//// START EVALUATION FUNCTION
+// Puts a dirty cell on the evaluation stack in a new epoch, every mark from earlier recalcs is now stale
+void start_evaluation(cell *root) {
+    abandon_evaluation();
+    recalc_epoch += 2;
+    push_evaluation(root);
+}
+
+//// RECALCULATE A DIRTY CELL FUNCTION
+// Evaluates the cell after its dirty precedents, depth first with an explicit stack
+void recalc_cell(cell *root) {
+    start_evaluation(root);
+    evaluate_stack(0);
+}
+
+//// FLAG PENDING CELLS FUNCTION
+void flag_pending_cells() {
+    abandon_evaluation();
+    propagate_dirty(INT_MAX);
+}
+
+//// RECALC IN PROGRESS FUNCTION
+int recalc_in_progress() {
+    return eval_stack.count > 0 || propagate_queue.count > 0;
+}
+
+//// TOPOLOGICAL ORDER FUNCTION
+// Depth first over the precedents of every formula, a cell is appended once all of them are
+void topological_order(cell_list *order) {
+    // A chain the worker gave the lock up in goes back in its queues, the stack is needed here
+    abandon_evaluation();
+
+    // A fresh epoch: on the stack is the epoch, ordered is epoch + 1
+    recalc_epoch += 2;
+    order->count = 0;
+
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *start = &entry->value;
+            if (start->formula == NULL || start->visit_mark >= recalc_epoch) {
+                continue;
+            }
+            start->visit_mark = recalc_epoch;
+            start->scan_term = 0;
+            start->scan_member = 0;
+            cell_list_push(&eval_stack, start);
+
+            while (eval_stack.count > 0) {
+                cell *current = eval_stack.cells[eval_stack.count - 1];
+
+                // Find the next formula precedent that is not ordered or on the stack
+                cell *precedent = NULL;
+                while (current->scan_term < current->term_count && precedent == NULL) {
+                    formula_term *term = &current->terms[current->scan_term];
+                    cell *candidate = NULL;
+
+                    // Aggregates depend on every cell of their range
+                    if (term->kind == TERM_AGGREGATE) {
+                        aggregate *agg = term->aggregate;
+                        int width = agg->last_col - agg->first_col + 1;
+                        long size = (long) (agg->last_row - agg->first_row + 1) * width;
+                        if (current->scan_member < size) {
+                            candidate = find_cell(agg->first_row + current->scan_member / width,
+                                                  agg->first_col + current->scan_member % width);
+                            current->scan_member++;
+                        }
+                        else {
+                            current->scan_term++;
+                            current->scan_member = 0;
+                        }
+                    }
+                    else {
+                        if (term->kind == TERM_REFERENCE) {
+                            candidate = find_cell(term->row, term->col);
+                        }
+                        current->scan_term++;
+                    }
+
+                    if (candidate != NULL && candidate->formula != NULL && candidate->visit_mark < recalc_epoch) {
+                        precedent = candidate;
+                    }
+                }
+
+                if (precedent != NULL) {
+                    precedent->visit_mark = recalc_epoch;
+                    precedent->scan_term = 0;
+                    precedent->scan_member = 0;
+                    cell_list_push(&eval_stack, precedent);
+                    continue;
+                }
+
+                // Every precedent is ordered, or part of a cycle through this cell
+                eval_stack.count--;
+                current->visit_mark = recalc_epoch + 1;
+                cell_list_push(order, current);
+            }
+        }
+    }
+}
+
+//// RECALCULATION WORKER FUNCTION
+void *recalc_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&model_lock);
+
+    while (!recalc_shutdown) {
+        // Step aside while the interface is waiting for the lock or a batch is open, sleep when there is nothing to do
+        if (atomic_load(&lock_waiters) > 0 || batch_depth > 0 ||
+            (!recalc_in_progress() && visible_dirty.count + offscreen_dirty.count == 0)) {
+            pthread_cond_wait(&recalc_wakeup, &model_lock);
+            continue;
+        }
+
+        // Go on with a chain the lock was given up in. Dependants it marks on the way are left for after it.
+        if (eval_stack.count > 0) {
+            evaluate_stack(1);
+        }
+
+        // Else, the dependants of the last edits are marked before the next cell is evaluated, a step at a time
+        else if (propagate_queue.count > 0) {
+            propagate_dirty(PROPAGATE_STEP);
+            continue;
+        }
+
+        // Else, take the next dirty cell, visible cells first so their precedents are evaluated before off-screen
+        // work. It may already have been evaluated as another cell's precedent.
+        else {
+            cell *next;
+            if (visible_dirty.count > 0) {
+                next = visible_dirty.cells[--visible_dirty.count];
+            }
+            else {
+                next = offscreen_dirty.cells[--offscreen_dirty.count];
+            }
+            if (next->dirty) {
+                start_evaluation(next);
+                evaluate_stack(1);
+            }
+        }
+
+        // The cells of a chain left part way have to stay in memory
+        if (eval_stack.count > 0) {
+            continue;
+        }
+
+        // A long recalc may have paged in more tiles than the budget allows, and once the queues are empty
+        // the tiles that waited for it can go as well
+        if (visible_dirty.count + offscreen_dirty.count == 0) {
+            tiles_unpin();
+        }
+        tiles_trim();
+    }
+
+    pthread_mutex_unlock(&model_lock);
+    return NULL;
+}
+
+//// PARSE CELL INPUT FUNCTION
+// Sets the type and contents of a cell from its original input, formulas are only compiled
+void parse_cell_input(cell *current) {
+    char *text = current->original_input;
+
+    // If first character of input text is '=', it is a formula
     if (text[0] == '=') {
         // Set the cell's type to FORMULA and skip '='
         current->type = FORMULA;
         current->formula = strdup(text + 1);
+        compile_formula(current);
+        return;
+    }
 
-        // Evaluate formula
-        double formula_result = evaluate_formula(current, current->formula);
+    // Else, text is not formula, try to convert the text to a number
+    char *end;
+    double number_value = strtod(text, &end);
 
-        // If formula result is not number, it returns NAN
-        if (isnan(formula_result)) {
-            // If the cell's type is FORMULA, update the cell's display with the error message
-            if (current->type == FORMULA) {
-                current->type = ERROR;
-                current->content.text_value = strdup(current->original_input);
-                update_cell_display(row, col, current->content.text_value);
-            }
+    // If the entire text is a valid number
+    if (*end == '\0') {
+        // Set the cell type to NUMBER and set its number value
+        current->type = NUMBER;
+        current->content.number_value = number_value;
+    }
 
-            //Else, update cell display with added strings
-            else {
-                update_cell_display(row, col, current->content.text_value);
-            }
+    // Else, entire text is not valid number
+    else {
+        // Set cell type and text_value
+        current->type = TEXT;
+        current->content.text_value = strdup(text);
+    }
+}
 
-            return;
+//// SETTING CELL VALUE FUNCTION
+void set_cell_value(ROW row, COL col, char *text) {
+    model_lock_acquire();
+    store_cell_input(row, col, text);
+    model_lock_release();
+}
+
+//// STORE CELL INPUT FUNCTION
+// Body of set_cell_value, for callers that already hold the model lock
+void store_cell_input(ROW row, COL col, char *text) {
+    journal_record('S', row, col, text);
+
+    // Find the cell at the given row and column, remember what it added to aggregates
+    cell *current = find_cell(row, col);
+    if (batch_import) {
+        store_raw_input(current, row, col, text);
+        return;
+    }
+    contribution before = cell_contribution(current);
+
+    // If the cell does not exist, create new cell
+    if (current == NULL) {
+        current = create_cell(row, col);
+    }
+
+    // Else, cell exists, free the memory of the old contents
+    else {
+        release_cell_contents(current);
+    }
+
+    // The cell takes ownership of the text as its original input
+    current->original_input = text;
+    parse_cell_input(current);
+
+    // Formulas are evaluated by the worker
+    if (current->formula != NULL) {
+        mark_dirty(current);
+    }
+
+    // Else, a dirty cell that was a formula no longer needs the worker, update the display
+    else {
+        current->dirty = 0;
+        queue_display(current);
+    }
+
+    // Update aggregates over the cell, mark dependencies dirty
+    update_aggregates(current, before);
+    record_edit(current);
+}
+
+//// STORE RAW INPUT FUNCTION
+// Keeps the input of an imported cell unparsed, pending until the import is committed
+void store_raw_input(cell *current, ROW row, COL col, char *text) {
+    if (current == NULL) {
+        current = create_cell(row, col);
+    }
+    else {
+        release_cell_contents(current);
+    }
+
+    // An empty number until it is parsed, shown as pending meanwhile
+    current->original_input = text;
+    current->type = NUMBER;
+    current->dirty = 1;
+    queue_display(current);
+    cell_list_push(&import_edits, current);
+}
+
+///// PART OF A PARTITIONED STORE
+// The inputs whose bucket falls in this part's stripes of the hash map. New cells are created and plain values
+// parsed by the part's thread, inputs for cells that already exist are left for the caller, in order.
+typedef struct {
+    cell_input *inputs;
+    int count;
+    int part;
+    int parts;
+    cell_list created;
+    int *existing;
+    int existing_count;
+    int existing_capacity;
+    pthread_t thread;
+} store_part;
+
+//// STORE PART FUNCTION (thread)
+// Only touches the buckets of its part, the other threads never look at them
+static void *store_part_inputs(void *argument) {
+    store_part *part = argument;
+    for (int i = 0; i < part->count; i++) {
+        cell_input *input = &part->inputs[i];
+        unsigned int index = hash(input->row, input->col);
+        if (index / STORE_STRIPE % part->parts != (unsigned int) part->part) {
+            continue;
         }
 
-        // Else, formula result is number
+        node *entry = spreadsheet[index];
+        while (entry != NULL && (entry->value.row != input->row || entry->value.col != input->col)) {
+            entry = entry->next;
+        }
+        if (entry != NULL) {
+            if (part->existing_count == part->existing_capacity) {
+                part->existing_capacity = part->existing_capacity == 0 ? 64 : part->existing_capacity * 2;
+                part->existing = realloc(part->existing, part->existing_capacity * sizeof(int));
+            }
+            part->existing[part->existing_count++] = i;
+            continue;
+        }
+
+        // Formulas are left raw as store_raw_input leaves them, compiling one registers its aggregates
+        cell *current = insert_cell(index, input->row, input->col);
+        current->original_input = input->text;
+        if (input->text[0] == '=') {
+            current->dirty = 1;
+        }
         else {
-            // Set cell type and value
-            current->computed_value = formula_result;
-            current->type = NUMBER;
-            current->content.number_value = current->computed_value;
+            parse_cell_input(current);
+        }
+        cell_list_push(&part->created, current);
+    }
+    return NULL;
+}
+
+//// STORE RAW INPUTS FUNCTION
+void store_raw_inputs(cell_input *inputs, int count, int threads) {
+    journal_record_inputs(inputs, count);
 
-            // Convert value to string and update display
-            char computed_value[50];
-            snprintf(computed_value, sizeof(computed_value), "%.1f", current->computed_value);
-            update_cell_display(row, col, computed_value);
+    // A paged workbook brings tiles in while looking cells up, that is only done one at a time
+    if (tiles_paging || threads < 2) {
+        for (int i = 0; i < count; i++) {
+            store_raw_input(find_cell(inputs[i].row, inputs[i].col), inputs[i].row, inputs[i].col, inputs[i].text);
         }
+        return;
     }
 
-    // Else, text is not formula
-    else {
-        // Try to convert the text to a number
-        char *end;
-        double number_value = strtod(text, &end);
+    // The map grows first, the threads can't move the buckets under each other
+    if (spreadsheet_count + count > spreadsheet_size) {
+        grow_spreadsheet(spreadsheet_count + count);
+    }
+
+    // Each part on its own thread, the first one on this thread
+    store_part *parts = calloc(threads, sizeof(store_part));
+    for (int p = 0; p < threads; p++) {
+        parts[p].inputs = inputs;
+        parts[p].count = count;
+        parts[p].part = p;
+        parts[p].parts = threads;
+    }
+    for (int p = 1; p < threads; p++) {
+        pthread_create(&parts[p].thread, NULL, store_part_inputs, &parts[p]);
+    }
+    store_part_inputs(&parts[0]);
+    for (int p = 1; p < threads; p++) {
+        pthread_join(parts[p].thread, NULL);
+    }
+
+    // Count and show the new cells, then replace the inputs of cells that existed. A cell is in one part, so its
+    // inputs are still replaced in order.
+    for (int p = 0; p < threads; p++) {
+        store_part *part = &parts[p];
+        spreadsheet_count += part->created.count;
+        for (int c = 0; c < part->created.count; c++) {
+            queue_display(part->created.cells[c]);
+            cell_list_push(&import_edits, part->created.cells[c]);
+        }
+        for (int e = 0; e < part->existing_count; e++) {
+            cell_input *input = &inputs[part->existing[e]];
+            store_raw_input(find_resident_cell(input->row, input->col), input->row, input->col, input->text);
+        }
+        cell_list_free(&part->created);
+        free(part->existing);
+    }
+    free(parts);
+}
+
+//// APPLY IMPORT FUNCTION
+// Parses every imported input, links the formulas to their precedents and marks them dirty
+void apply_import() {
+    // A cell still waiting and holding an empty number is unparsed, parsing a number again changes nothing. Plain
+    // values stored by store_raw_inputs were parsed there.
+    for (int i = 0; i < import_edits.count; i++) {
+        cell *current = import_edits.cells[i];
+        if (current->dirty && current->formula == NULL && current->type == NUMBER) {
+            parse_cell_input(current);
+        }
+        current->dirty = 0;
+    }
 
-        // If the entire text is a valid number
-        if (*end == '\0') {
-            // Set the cell type to NUMBER and set its number value
-            current->type = NUMBER;
-            current->content.number_value = number_value;
+    for (int i = 0; i < import_edits.count; i++) {
+        cell *current = import_edits.cells[i];
 
+        // Build the dependency graph in one pass, now that every precedent exists
+        for (int t = 0; t < current->term_count; t++) {
+            formula_term *term = &current->terms[t];
+            cell *precedent = term->kind == TERM_REFERENCE ? find_cell(term->row, term->col) : NULL;
+            if (precedent != NULL) {
+                add_dependent(precedent, current);
+            }
         }
 
+        // Aggregates over imported cells are summed exactly again when next evaluated
+        ROW first = 0, last = SHEET_ROWS - 1;
+        for (aggregate_span *span = aggregate_columns[current->col]; span != NULL;
+             span = span_toward(span, current->row, &first, &last)) {
+            for (int a = 0; a < span->count; a++) {
+                span->aggregates[a]->exact = 0;
+            }
+        }
 
-        // Else, entire text is not valid number
+        if (current->formula != NULL) {
+            mark_dirty(current);
+        }
         else {
-            // Set cell type and text_value
-            current->type = TEXT;
-            current->content.text_value = strdup(text);
+            queue_display(current);
         }
-        // Update the display
-        update_cell_display(row, col, text);
+        cell_list_push(&batch_edits, current);
     }
 
-    // Update dependencies
-    update_dependencies(current);
+    import_edits.count = 0;
+    batch_import = 0;
+}
+
+//// ORDER DIRTY CELLS FUNCTION
+// Refills the worker's queues in topological order, so each dirty formula is evaluated once, after its precedents
+void order_dirty_cells() {
+    cell_list order = {0};
+    topological_order(&order);
+    visible_dirty.count = 0;
+    offscreen_dirty.count = 0;
+
+    // The worker takes the last cell of a queue first
+    for (int i = order.count - 1; i >= 0; i--) {
+        cell *current = order.cells[i];
+        if (current->dirty) {
+            cell_list_push(in_viewport(current) ? &visible_dirty : &offscreen_dirty, current);
+        }
+    }
+    cell_list_free(&order);
 }
 
 //// RETURN ORIGINAL STRING FUNCTION
 char *get_textual_value(ROW row, COL col) {
+    model_lock_acquire();
+
     // Find cell
     cell *current = find_cell(row, col);
+    char *text = NULL;
 
     // If cell exists return the original input
     if (current != NULL) {
-            return strdup(current->original_input);
+            text = strdup(current->original_input);
     }
 
-    // Else, cell does not exist
-    else {
-        printf("Cell (%d, %d) does not exist\n", row, col);
-        return NULL;
+    model_lock_release();
+    return text;
+}
+
+/////////////////////////////////////////////////// PROFILING FUNCTIONS ///////////////////////////////////////////////////
+
+//// MONOTONIC CLOCK FUNCTION
+double profile_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//// CELL NAME FUNCTION
+void format_cell_name(cell *current, char *buffer, size_t size) {
+    snprintf(buffer, size, "%c%d", 'A' + current->col, current->row + 1);
+}
+
+//// PROFILE COMPARISON FUNCTIONS
+int compare_profile_time(const void *a, const void *b) {
+    double time_a = (*(cell **) a)->profile_time;
+    double time_b = (*(cell **) b)->profile_time;
+    return (time_a < time_b) - (time_a > time_b);
+}
+
+int compare_chain_length(const void *a, const void *b) {
+    return (*(cell **) b)->chain_length - (*(cell **) a)->chain_length;
+}
+
+int compare_fan_out(const void *a, const void *b) {
+    return (*(cell **) b)->dependent_cells - (*(cell **) a)->dependent_cells;
+}
+
+//// CHAIN LENGTH FUNCTION
+// Longest run of formulas ending at each cell, walked with an explicit stack so long chains cannot overflow
+void compute_chain_lengths(cell_list *all_cells) {
+    // Zero means unknown, -1 means the cell is on the stack
+    for (int i = 0; i < all_cells->count; i++) {
+        all_cells->cells[i]->chain_length = 0;
+        all_cells->cells[i]->chain_next = NULL;
+    }
+
+    cell_list stack = {0};
+    for (int i = 0; i < all_cells->count; i++) {
+        if (all_cells->cells[i]->formula == NULL || all_cells->cells[i]->chain_length != 0) {
+            continue;
+        }
+
+        all_cells->cells[i]->chain_length = -1;
+        cell_list_push(&stack, all_cells->cells[i]);
+
+        while (stack.count > 0) {
+            cell *current = stack.cells[stack.count - 1];
+            cell *unvisited = NULL;
+            cell *longest = NULL;
+
+            // Look for a formula precedent that still needs a length, else take the longest one
+            for (int t = 0; t < current->term_count && unvisited == NULL; t++) {
+                if (current->terms[t].kind != TERM_REFERENCE) {
+                    continue;
+                }
+                cell *precedent = find_cell(current->terms[t].row, current->terms[t].col);
+                if (precedent == NULL || precedent->formula == NULL) {
+                    continue;
+                }
+                if (precedent->chain_length == 0) {
+                    unvisited = precedent;
+                }
+                else if (precedent->chain_length > 0 && (longest == NULL || precedent->chain_length > longest->chain_length)) {
+                    longest = precedent;
+                }
+            }
+
+            // Precedents first
+            if (unvisited != NULL) {
+                unvisited->chain_length = -1;
+                cell_list_push(&stack, unvisited);
+                continue;
+            }
+
+            // Cells on the stack are part of a cycle and are not counted again
+            current->chain_length = longest == NULL ? 1 : longest->chain_length + 1;
+            current->chain_next = longest;
+            stack.count--;
+        }
+    }
+
+    cell_list_free(&stack);
+}
+
+//// PROFILING SETTING FUNCTION
+void model_set_profiling(int enabled) {
+    model_lock_acquire();
+
+    // Start counting from zero every time profiling is turned on
+    if (enabled && !profiling_enabled) {
+        for (int i = 0; i < spreadsheet_size; i++) {
+            for (node *current = spreadsheet[i]; current != NULL; current = current->next) {
+                current->value.profile_count = 0;
+                current->value.profile_time = 0;
+            }
+        }
+        profile_recalcs = 0;
+    }
+    profiling_enabled = enabled;
+
+    model_lock_release();
+}
+
+//// PROFILE REPORT FUNCTION
+int model_profile_report(const char *path, int top_n) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    model_lock_acquire();
+
+    // Collect every cell and the totals
+    cell_list all_cells = {0};
+    long total_count = 0;
+    double total_time = 0;
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *current = spreadsheet[i]; current != NULL; current = current->next) {
+            cell_list_push(&all_cells, &current->value);
+            total_count += current->value.profile_count;
+            total_time += current->value.profile_time;
+        }
     }
+    int shown = all_cells.count < top_n ? all_cells.count : top_n;
+    char name[16];
+
+    fprintf(out, "Recalculation profile\n");
+    fprintf(out, "  recalculated cells: %ld, evaluations: %ld, time: %.3f ms\n\n",
+            profile_recalcs, total_count, total_time * 1e3);
+
+    // Cells that took the most time, not counting the precedents they evaluated
+    qsort(all_cells.cells, all_cells.count, sizeof(cell *), compare_profile_time);
+    fprintf(out, "Slowest cells\n");
+    fprintf(out, "  %-8s %10s %12s %12s\n", "cell", "evals", "total ms", "avg us");
+    for (int i = 0; i < shown && all_cells.cells[i]->profile_count > 0; i++) {
+        cell *current = all_cells.cells[i];
+        format_cell_name(current, name, sizeof(name));
+        fprintf(out, "  %-8s %10ld %12.3f %12.2f\n", name, current->profile_count,
+                current->profile_time * 1e3, current->profile_time * 1e6 / current->profile_count);
+    }
+
+    // Longest chains of formulas, listed from the end of the chain back to its start
+    compute_chain_lengths(&all_cells);
+    qsort(all_cells.cells, all_cells.count, sizeof(cell *), compare_chain_length);
+    fprintf(out, "\nLongest dependency chains\n");
+    for (int i = 0; i < shown && all_cells.cells[i]->chain_length > 0; i++) {
+        fprintf(out, "  %6d ", all_cells.cells[i]->chain_length);
+        int listed = 0;
+        for (cell *link = all_cells.cells[i]; link != NULL; link = link->chain_next) {
+            if (listed == 8) {
+                fprintf(out, " <- ...");
+                break;
+            }
+            format_cell_name(link, name, sizeof(name));
+            fprintf(out, listed++ == 0 ? " %s" : " <- %s", name);
+        }
+        fprintf(out, "\n");
+    }
+
+    // Cells with the most dependants, an edit to them dirties the most work
+    qsort(all_cells.cells, all_cells.count, sizeof(cell *), compare_fan_out);
+    fprintf(out, "\nFan-out hubs\n");
+    fprintf(out, "  %-8s %10s\n", "cell", "dependants");
+    for (int i = 0; i < shown && all_cells.cells[i]->dependent_cells > 0; i++) {
+        format_cell_name(all_cells.cells[i], name, sizeof(name));
+        fprintf(out, "  %-8s %10d\n", name, all_cells.cells[i]->dependent_cells);
+    }
+
+    model_lock_release();
+
+    cell_list_free(&all_cells);
+    fclose(out);
+    return 0;
 }
 
 /////////////////////////////////////////////////// MODEL FUNCTIONS ///////////////////////////////////////////////////
 
 //// SPREADSHEET INITIALIZATION FUNCTION
 void model_init() {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        spreadsheet[i] = NULL;
+    spreadsheet_size = INITIAL_HASH_SIZE;
+    spreadsheet_count = 0;
+    spreadsheet = calloc(spreadsheet_size, sizeof(node *));
+
+    // Until the interface says otherwise, the viewport is the whole grid
+    view_row = ROW_1;
+    view_col = COL_A;
+    view_rows = NUM_ROWS;
+    view_cols = NUM_COLS;
+    reset_display_queue();
+
+    // Start the recalculation worker
+    recalc_shutdown = 0;
+    pthread_create(&recalc_thread, NULL, recalc_worker, NULL);
+}
+
+//// BATCH FUNCTIONS
+void model_begin_batch() {
+    model_lock_acquire();
+    batch_depth++;
+    model_lock_release();
+}
+
+void model_begin_import() {
+    model_lock_acquire();
+    batch_depth++;
+    batch_import = 1;
+    model_lock_release();
+}
+
+void model_commit_batch() {
+    model_lock_acquire();
+
+    // Only the outermost commit applies the batch
+    if (batch_depth > 0 && --batch_depth == 0) {
+        int imported = batch_import;
+        if (imported) {
+            apply_import();
+        }
+
+        // Mark the union of every edit's dependants in one pass, all of them before an import is ordered
+        for (int i = 0; i < batch_edits.count; i++) {
+            cell_list_push(&propagate_queue, batch_edits.cells[i]);
+        }
+        propagate_dirty(imported ? INT_MAX : PROPAGATE_STEP);
+        batch_edits.count = 0;
+
+        // A paged workbook would have to bring in every tile to order the sheet, the worker finds the order itself
+        if (imported && !tiles_paging) {
+            order_dirty_cells();
+        }
     }
+
+    // Releasing the lock wakes the worker for the single recalc
+    model_lock_release();
 }
 
-//// SPREADSHEET FREEING FUNCTION
-void model_destroy() {
-    for (int i = 0; i < HASH_SIZE; i++) {
+//// ITERATIVE CALCULATION SETTING FUNCTION
+void model_set_iterative(int enabled, int max_iterations, double max_change) {
+    model_lock_acquire();
+
+    iterative_enabled = enabled;
+    iterative_max_iterations = max_iterations;
+    iterative_max_change = max_change;
+
+    model_lock_release();
+}
+
+//// VIEWPORT SETTING FUNCTION
+void model_set_viewport(ROW first_row, COL first_col, int rows, int cols) {
+    model_lock_acquire();
+
+    view_row = first_row;
+    view_col = first_col;
+    view_rows = rows;
+    view_cols = cols;
+
+    // What was queued for the old viewport is dropped, every cell of the new one is drawn
+    reset_display_queue();
+    queue_viewport();
+
+    model_lock_release();
+}
+
+//// QUEUE VIEWPORT FUNCTION
+// Every cell in the viewport, to draw a sheet that was just paged in or scrolled to. Only the
+// viewport is looked at, so the cost does not grow with the sheet.
+void queue_viewport() {
+    for (int row = 0; row < view_rows; row++) {
+        for (int col = 0; col < view_cols; col++) {
+            cell *current = find_cell((ROW) (view_row + row), (COL) (view_col + col));
+            if (current == NULL) {
+                continue;
+            }
+
+            // Dirty cells now in view go to the front of the line, the worker skips their off-screen entry once they are evaluated
+            if (current->dirty) {
+                cell_list_push(&visible_dirty, current);
+            }
+
+            // Only shown again, a saved workbook has nothing new to write for it
+            queue_redraw(current);
+        }
+    }
+}
+
+//// DISPLAY FLUSHING FUNCTION
+int model_flush_display() {
+    model_lock_acquire();
+
+    // Nothing is drawn until an open batch is committed
+    if (batch_depth > 0) {
+        model_lock_release();
+        return 0;
+    }
+
+    // Write the current text of every queued cell
+    int flushed = display_count;
+    for (int i = 0; i < display_count; i++) {
+        *display_mark(display_queue[i].row, display_queue[i].col) = 0;
+        cell *current = find_cell(display_queue[i].row, display_queue[i].col);
+        if (current != NULL) {
+            char display[50];
+            format_cell_display(current, display, sizeof(display));
+            update_cell_display(current->row, current->col, display);
+        }
+    }
+    display_count = 0;
+
+    model_lock_release();
+    return flushed;
+}
+
+//// REMOVE ALL CELLS FUNCTION
+void remove_all_cells() {
+    for (int i = 0; i < spreadsheet_size; i++) {
         for (node *current = spreadsheet[i]; current != NULL; ) {
             node *next = current->next;
             free_cell(current->value.row, current->value.col);
             current = next;
         }
     }
-}
 
+    // No cell points into a loaded snapshot anymore
+    snapshot_release();
+
+    // The cells no longer match a saved tiled workbook
+    tiles_forget();
+
+    // Nothing is left for the worker
+    visible_dirty.count = 0;
+    offscreen_dirty.count = 0;
+    batch_edits.count = 0;
+    import_edits.count = 0;
+    batch_import = 0;
+    propagate_queue.count = 0;
+    propagate_next = propagate_run = propagate_offset = 0;
+    eval_stack.count = 0;
+}
 
+//// SPREADSHEET FREEING FUNCTION
+void model_destroy() {
+    // Stop the worker before the cells go away
+    model_lock_acquire();
+    recalc_shutdown = 1;
+    model_lock_release();
+    pthread_join(recalc_thread, NULL);
+
+    remove_all_cells();
+    free(spreadsheet);
+    spreadsheet = NULL;
+    spreadsheet_size = 0;
+
+    // Free the worker queues
+    cell_list_free(&visible_dirty);
+    cell_list_free(&offscreen_dirty);
+    cell_list_free(&propagate_queue);
+    cell_list_free(&batch_edits);
+    cell_list_free(&import_edits);
+    cell_list_free(&eval_stack);
+    cell_list_free(&scc_reachable);
+    cell_list_free(&scc_members);
+    free(display_queue);
+    display_queue = NULL;
+    display_count = display_capacity = 0;
+    free(display_marks);
+    display_marks = NULL;
+}
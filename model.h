@@ -5,11 +5,19 @@
 
 // Initializes the data structure.
 //
-// This is called once, at program start.
+// This is called once, at program start. It also starts the background worker
+// which recalculates formulas after edits.
 void model_init();
 
+// Stops the recalculation worker and frees every cell.
+void model_destroy();
+
 // Sets the value of a cell based on user input.
 //
+// Returns as soon as the cell is stored. Formulas in the cell and in its
+// dependants are marked as pending and evaluated by the recalculation worker;
+// a newer edit takes priority over any recalculation still in progress.
+//
 // The string referred to by 'text' is now owned by this function and/or the
 // cell contents data structure; it is its responsibility to ensure it is freed
 // once it is no longer needed.
@@ -25,4 +33,61 @@ void clear_cell(ROW row, COL col);
 // retain any reference to it after the function returns.
 char *get_textual_value(ROW row, COL col);
 
+// Starts a batch of edits.
+//
+// Until the matching 'model_commit_batch', 'set_cell_value' and 'clear_cell'
+// only store the new input: nothing is recalculated or drawn. Batches may be
+// nested, only the outermost commit applies them.
+void model_begin_batch();
+
+// Starts a batch of edits for a bulk import.
+//
+// As 'model_begin_batch', except that 'set_cell_value' only stores the input
+// as it is, so formulas don't see precedents that are not imported yet. At
+// the matching 'model_commit_batch' every input is parsed, the dependency
+// graph of the imported formulas is built in one pass, and the worker
+// recalculates them in topological order, each formula once.
+void model_begin_import();
+
+// Commits the current batch of edits.
+//
+// The dependants of every edited cell are marked dirty together and
+// recalculated in a single pass, and the display is flushed once afterwards.
+void model_commit_batch();
+
+// Enables or disables iterative calculation of circular dependencies.
+//
+// When disabled (the default), a formula that depends on itself shows
+// "ERROR: circular dependency". When enabled, the cells of each cycle are
+// re-evaluated in turn, using each other's latest values, until no value
+// changes by more than 'max_change' or 'max_iterations' passes were made.
+void model_set_iterative(int enabled, int max_iterations, double max_change);
+
+// Enables or disables recalculation profiling.
+//
+// While enabled, the number of evaluations and the time spent evaluating
+// each cell are recorded. Enabling it resets the counters.
+void model_set_profiling(int enabled);
+
+// Writes a profiling report to the file at 'path', listing the 'top_n'
+// slowest cells, the longest chains of dependent formulas and the cells with
+// the most dependants. Returns 0 on success, -1 if the file can't be written.
+int model_profile_report(const char *path, int top_n);
+
+// Tells the model which part of the sheet the interface is showing.
+//
+// Pending cells inside this area, and the cells they depend on, are
+// recalculated before any off-screen cell. Only cells inside it are drawn,
+// and every cell in it is drawn again at the next flush. Defaults to the
+// whole grid.
+void model_set_viewport(ROW first_row, COL first_col, int rows, int cols);
+
+// Writes the cells in the viewport whose displayed text changed since the
+// last call through 'update_cell_display', each once however often it
+// changed, and returns how many were written.
+//
+// Must be called from the interface thread, since the recalculation worker
+// never draws on its own.
+int model_flush_display();
+
 #endif //ASSIGNMENT_MODEL_H
@@ -0,0 +1,287 @@
+#ifndef ASSIGNMENT_MODEL_INTERNAL_H
+#define ASSIGNMENT_MODEL_INTERNAL_H
+
+// Definitions shared by the translation units of the model. The interface
+// only ever uses model.h.
+
+#include "defs.h"
+#include <stddef.h>
+
+// Buckets in the cell hash map before it first grows
+#define INITIAL_HASH_SIZE 1229
+
+/////////////////////////////////////////////////// STRUCTS AND DEFINITIONS ///////////////////////////////////////////////////
+
+typedef enum { NUMBER, TEXT, FORMULA, ERROR} cell_type;
+typedef enum { TERM_NUMBER, TERM_REFERENCE, TERM_AGGREGATE, TERM_INVALID} term_kind;
+typedef enum { AGGREGATE_SUM, AGGREGATE_COUNT, AGGREGATE_AVERAGE} aggregate_function;
+typedef struct cell cell;
+
+///// GROWABLE LIST OF CELLS
+typedef struct {
+    cell **cells;
+    int count;
+    int capacity;
+} cell_list;
+
+///// RANGE AGGREGATE STRUCTURE
+// SUM, COUNT and AVERAGE keep a running total of their range, updated with the
+// old and new value of each cell that changes instead of rescanning the range
+typedef struct {
+    aggregate_function function;
+
+    // Formula cell the aggregate belongs to
+    cell *owner;
+
+    // Range covered, inclusive
+    ROW first_row;
+    ROW last_row;
+    COL first_col;
+    COL last_col;
+
+    // Running total of the numbers in the range, how many there are and how many errors
+    double sum;
+    long numbers;
+    long errors;
+
+    // Incremental updates since the last exact sum, and whether there has been one
+    int updates;
+    int exact;
+
+    // Formulas in the range waiting for the worker, evaluated before the owner
+    cell_list dirty_members;
+
+    // Set when a member in the range depends on the owner
+    int range_cycle;
+} aggregate;
+
+///// RUN OF DEPENDANT CELLS
+// Rows first_row to last_row of one column, so a filled-down formula is a single run
+typedef struct {
+    COL col;
+    ROW first_row;
+    ROW last_row;
+} dependent_run;
+
+///// CONTRIBUTION OF A CELL TO AN AGGREGATE
+typedef struct {
+    double number;
+    int is_number;
+    int is_error;
+} contribution;
+
+///// COMPILED FORMULA TERM
+typedef struct {
+    term_kind kind;
+
+    // Referenced cell, or constant for number terms
+    ROW row;
+    COL col;
+    double number;
+
+    // Running state for aggregate terms
+    aggregate *aggregate;
+} formula_term;
+
+///// CELL STRUCTURE
+struct cell {
+    // Position of cell
+    ROW row;
+    COL col;
+
+    // Cell contains number or string
+    union {
+        double number_value;
+        char *text_value;
+    } content;
+
+    // Computed value if cell contains formula
+    double computed_value;
+
+    // Formula string and define cell type
+    char *formula;
+    cell_type type;
+
+    // Terms of the formula, compiled when it is set
+    formula_term *terms;
+    int term_count;
+
+    // The original input of the cell
+    char *original_input;
+
+    // Array of "dependant" cells (cells that depend on other cells i.e for their formula),
+    // stored as runs of consecutive rows, and the number of cells in them
+    dependent_run *dependents;
+    int dependents_count;
+    int dependents_capacity;
+    int dependent_cells;
+
+    // Visit mark, compared against the recalculation epoch so marks never need resetting
+    unsigned long long visit_mark;
+
+    // Set while the cell is waiting to be recalculated by the worker
+    int dirty;
+
+    // Set when a circular reference looped back to this cell during evaluation
+    int cycle_head;
+
+    // Mark used while finding a cycle's strongly connected component, compared against scc_epoch
+    unsigned long long scc_mark;
+
+    // Next formula term, and range member of an aggregate term, to check for dirty precedents while on the evaluation stack
+    int scan_term;
+    int scan_member;
+
+    // Evaluations and time spent evaluating this cell while profiling
+    long profile_count;
+    double profile_time;
+
+    // Longest chain of formulas ending at this cell, and its next link, for profile reports
+    int chain_length;
+    cell *chain_next;
+};
+
+///// NODE STRUCTURE FOR SEPARATE CHAINING HASH
+typedef struct node {
+    // Value of cell
+    cell value;
+    struct node *next;
+
+} node;
+
+///// POSITION OF A CELL WAITING FOR A DISPLAY UPDATE
+typedef struct {
+    ROW row;
+    COL col;
+} display_entry;
+
+///// INPUT WAITING TO BE STORED
+typedef struct {
+    ROW row;
+    COL col;
+    char *text;
+} cell_input;
+
+/////////////////////////////////////////////////// SHARED STATE ///////////////////////////////////////////////////
+
+// Cell hash map, 'spreadsheet_count' cells in 'spreadsheet_size' buckets
+extern node **spreadsheet;
+extern int spreadsheet_size;
+extern int spreadsheet_count;
+
+// Set while the cells are paged in and out of a tiled workbook, in tiles.c
+extern int tiles_paging;
+
+// Set while an import is open and its cells hold their inputs unparsed, in model.c
+extern int batch_import;
+
+/////////////////////////////////////////////////// SHARED FUNCTIONS ///////////////////////////////////////////////////
+
+// Every access to the cells must happen between these two calls.
+void model_lock_acquire();
+void model_lock_release();
+
+void cell_list_push(cell_list *list, cell *current);
+void cell_list_free(cell_list *list);
+
+// Looks up a cell, or creates an empty one the caller fills in. When paging,
+// find_cell brings the tile of a missing cell in, find_resident_cell doesn't.
+cell *find_cell(ROW row, COL col);
+cell *find_resident_cell(ROW row, COL col);
+cell *create_cell(ROW row, COL col);
+
+// Frees the clean cells of evicted tiles and forgets them in the worker's queues.
+void drop_cells(cell_list *cells);
+
+// Sets the type and contents of a cell from its original input. Formulas are
+// compiled but not evaluated.
+void parse_cell_input(cell *current);
+
+// Splits a cell's formula into its terms and starts tracking its aggregates.
+void compile_formula(cell *current);
+
+// Frees a string of a cell, unless it belongs to a loaded snapshot.
+void free_cell_text(char *text);
+
+// Whether a pointer is inside the loaded snapshot, and unloading it once no
+// cell uses it. Both are in snapshot.c.
+int snapshot_owns(const void *pointer);
+void snapshot_release();
+
+// Copies the model into a snapshot image with the model lock held, and writes
+// the image to 'path' later without it, in blocks of the codec if 'compressed'
+// is set. Writing frees the image. In snapshot.c.
+typedef struct snapshot_image snapshot_image;
+snapshot_image *snapshot_capture();
+int snapshot_write(snapshot_image *image, const char *path, int compressed);
+
+// Marks the tile holding a cell as changed since the tiled workbook was last
+// saved, and stops tracking once the cells are replaced. In tiles.c.
+void tiles_touch(ROW row, COL col);
+void tiles_forget();
+
+// Paging hooks, all in tiles.c. A fault loads the tile of a missing cell and
+// returns non-zero if it had cells. A reference marks a tile as recently used.
+// Trimming evicts tiles until the memory budget is met, only called where no
+// cell pointer is held but those in the worker's queues, and waits while the
+// worker is part way through a recalc. Unpinning tells it that the worker has
+// emptied its queues. The extent widens the last row and column to cover the
+// tiles that are paged out.
+int tiles_fault(ROW row, COL col);
+void tiles_reference(ROW row, COL col);
+void tiles_trim();
+void tiles_unpin();
+void tiles_extent(int *max_row, int *max_col);
+
+// Appends an edit to the open journal, if there is one: 'S' sets the cell to
+// 'text', 'C' clears it. In journal.c.
+void journal_record(char operation, ROW row, COL col, const char *text);
+
+// Appends an 'S' record for each input in order, in one go. In journal.c.
+void journal_record_inputs(const cell_input *inputs, int count);
+
+// set_cell_value with the model lock already held. Inside a batch the
+// dependants are only marked at commit.
+void store_cell_input(ROW row, COL col, char *text);
+
+// Stores an imported input without parsing it, for store_cell_input while an
+// import is open. 'current' is the cell at 'row', 'col', or NULL.
+void store_raw_input(cell *current, ROW row, COL col, char *text);
+
+// Stores the inputs of an open import as store_cell_input would, the cells
+// taking ownership of their text. The new cells are created by 'threads'
+// threads, each owning a share of the hash map's buckets.
+void store_raw_inputs(cell_input *inputs, int count, int threads);
+
+// Evaluates a dirty cell now, after its dirty precedents.
+void recalc_cell(cell *root);
+
+// Flags every cell waiting for a recalc as dirty: the dependants of edits the
+// worker has not marked yet, and the cells of a chain it gave the lock up in.
+// Called before the cells are saved or exported.
+void flag_pending_cells();
+
+// Whether the worker is part way through marking dependants or evaluating a
+// chain, holding cells that have to stay in memory until it is done.
+int recalc_in_progress();
+
+// Flags a cell for the recalculation worker, and queues a cell to be redrawn.
+void mark_dirty(cell *current);
+void queue_display(cell *current);
+
+// Queues a cell to be redrawn without marking its tile as changed.
+void queue_redraw(cell *current);
+
+// Queues every cell in the viewport to be redrawn, and puts its dirty cells
+// at the front of the worker's line.
+void queue_viewport();
+
+// Frees every cell and resets the recalculation state.
+void remove_all_cells();
+
+// Puts every formula cell in 'order' so each comes after the formulas it
+// references, including formulas in the ranges of its aggregates. Cells on a
+// circular dependency are ordered arbitrarily among themselves.
+void topological_order(cell_list *order);
+
+#endif //ASSIGNMENT_MODEL_INTERNAL_H
@@ -0,0 +1,596 @@
+#include "snapshot.h"
+#include "codec.h"
+#include "model_internal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_MMAP 1
+#endif
+
+#define SNAPSHOT_MAGIC "SHEETSNP"
+#define SNAPSHOT_VERSION 1
+
+// Written as a number and compared on load, a file from a machine with the other byte order doesn't match
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+// Offset of strings a cell doesn't have
+#define SNAPSHOT_NO_STRING UINT64_MAX
+
+// Cell flags
+#define SNAPSHOT_PENDING 1
+#define SNAPSHOT_AGGREGATES 2
+
+///// SECTIONS OF A SNAPSHOT
+// One column per cell field, then the arrays the columns index into
+typedef enum {
+    SECTION_ROWS,
+    SECTION_COLS,
+    SECTION_TYPES,
+    SECTION_FLAGS,
+    SECTION_NUMBERS,
+    SECTION_COMPUTED,
+    SECTION_INPUTS,
+    SECTION_RESULTS,
+    SECTION_TERM_FIRST,
+    SECTION_TERM_COUNT,
+    SECTION_RUN_FIRST,
+    SECTION_RUN_COUNT,
+    SECTION_TERMS,
+    SECTION_RUNS,
+    SECTION_STRINGS,
+    SECTION_COUNT
+} snapshot_section;
+
+///// SNAPSHOT HEADER
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+
+    // Layout of the structures stored as they are in memory
+    uint32_t term_size;
+    uint32_t run_size;
+
+    uint64_t cell_count;
+    uint64_t term_count;
+    uint64_t run_count;
+    uint64_t string_size;
+
+    // Where each section starts in the file, and its size in bytes
+    uint64_t offsets[SECTION_COUNT];
+    uint64_t sizes[SECTION_COUNT];
+} snapshot_header;
+
+///// SNAPSHOT COLUMNS
+// Pointers to the sections, into the snapshot being written or the file being loaded
+typedef struct {
+    int32_t *rows;
+    int32_t *cols;
+    uint8_t *types;
+    uint8_t *flags;
+    double *numbers;
+    double *computed;
+    uint64_t *inputs;
+    uint64_t *results;
+    uint32_t *term_first;
+    uint32_t *term_count;
+    uint32_t *run_first;
+    uint32_t *run_count;
+    formula_term *terms;
+    dependent_run *runs;
+    char *strings;
+} snapshot_columns;
+
+///// SNAPSHOT IMAGE
+// The file as captured from the model, written out after the model lock is released
+struct snapshot_image {
+    char *body;
+    size_t body_size;
+    char *pool;
+    uint64_t pool_size;
+};
+
+///// LOADED SNAPSHOT
+// Cells point into it until they are all removed
+static char *loaded_base = NULL;
+static size_t loaded_size = 0;
+static int loaded_mapped = 0;
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// SECTION POINTERS FUNCTION
+// Points each column at its section
+static void point_columns(snapshot_columns *columns, char *base, const snapshot_header *header) {
+    void *sections[SECTION_COUNT];
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        sections[s] = base + header->offsets[s];
+    }
+
+    columns->rows = sections[SECTION_ROWS];
+    columns->cols = sections[SECTION_COLS];
+    columns->types = sections[SECTION_TYPES];
+    columns->flags = sections[SECTION_FLAGS];
+    columns->numbers = sections[SECTION_NUMBERS];
+    columns->computed = sections[SECTION_COMPUTED];
+    columns->inputs = sections[SECTION_INPUTS];
+    columns->results = sections[SECTION_RESULTS];
+    columns->term_first = sections[SECTION_TERM_FIRST];
+    columns->term_count = sections[SECTION_TERM_COUNT];
+    columns->run_first = sections[SECTION_RUN_FIRST];
+    columns->run_count = sections[SECTION_RUN_COUNT];
+    columns->terms = sections[SECTION_TERMS];
+    columns->runs = sections[SECTION_RUNS];
+    columns->strings = sections[SECTION_STRINGS];
+}
+
+//// LAYOUT FUNCTION
+// Fills in the section sizes from the counts and places the sections one after another, 8 byte aligned
+static void lay_out(snapshot_header *header) {
+    uint64_t cells = header->cell_count;
+    header->sizes[SECTION_ROWS] = cells * sizeof(int32_t);
+    header->sizes[SECTION_COLS] = cells * sizeof(int32_t);
+    header->sizes[SECTION_TYPES] = cells;
+    header->sizes[SECTION_FLAGS] = cells;
+    header->sizes[SECTION_NUMBERS] = cells * sizeof(double);
+    header->sizes[SECTION_COMPUTED] = cells * sizeof(double);
+    header->sizes[SECTION_INPUTS] = cells * sizeof(uint64_t);
+    header->sizes[SECTION_RESULTS] = cells * sizeof(uint64_t);
+    header->sizes[SECTION_TERM_FIRST] = cells * sizeof(uint32_t);
+    header->sizes[SECTION_TERM_COUNT] = cells * sizeof(uint32_t);
+    header->sizes[SECTION_RUN_FIRST] = cells * sizeof(uint32_t);
+    header->sizes[SECTION_RUN_COUNT] = cells * sizeof(uint32_t);
+    header->sizes[SECTION_TERMS] = header->term_count * sizeof(formula_term);
+    header->sizes[SECTION_RUNS] = header->run_count * sizeof(dependent_run);
+    header->sizes[SECTION_STRINGS] = header->string_size;
+
+    uint64_t offset = (sizeof(snapshot_header) + 7) & ~(uint64_t) 7;
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        header->offsets[s] = offset;
+        offset = (offset + header->sizes[s] + 7) & ~(uint64_t) 7;
+    }
+}
+
+//// ADD STRING FUNCTION
+// Appends a string with its terminator to the pool, returns its offset
+static uint64_t add_string(char **pool, uint64_t *size, uint64_t *capacity, const char *text) {
+    size_t length = strlen(text) + 1;
+    if (*size + length > *capacity) {
+        while (*size + length > *capacity) {
+            *capacity = *capacity == 0 ? 4096 : *capacity * 2;
+        }
+        *pool = realloc(*pool, *capacity);
+    }
+    memcpy(*pool + *size, text, length);
+    *size += length;
+    return *size - length;
+}
+
+/////////////////////////////////////////////////// SAVING ///////////////////////////////////////////////////
+
+//// CAPTURE SNAPSHOT FUNCTION
+// Copies the model into a buffer laid out as the file, the model lock must be held
+snapshot_image *snapshot_capture() {
+    // Cells still waiting for the worker are captured as pending
+    flag_pending_cells();
+
+    // Count the terms and runs to size the columns
+    snapshot_header header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.term_size = sizeof(formula_term);
+    header.run_size = sizeof(dependent_run);
+    header.cell_count = spreadsheet_count;
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            header.term_count += entry->value.term_count;
+            header.run_count += entry->value.dependents_count;
+        }
+    }
+
+    // Build the sections in one buffer laid out as the file, strings in a pool of their own
+    header.string_size = 0;
+    lay_out(&header);
+    size_t body_size = header.offsets[SECTION_STRINGS];
+    char *body = calloc(1, body_size);
+    snapshot_columns columns;
+    point_columns(&columns, body, &header);
+
+    char *pool = NULL;
+    uint64_t pool_size = 0;
+    uint64_t pool_capacity = 0;
+    uint64_t terms = 0;
+    uint64_t runs = 0;
+    uint64_t index = 0;
+
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next, index++) {
+            cell *current = &entry->value;
+            columns.rows[index] = current->row;
+            columns.cols[index] = current->col;
+            columns.types[index] = (uint8_t) current->type;
+            columns.flags[index] = current->dirty || current->type == FORMULA ? SNAPSHOT_PENDING : 0;
+            columns.numbers[index] = current->type == NUMBER ? current->content.number_value : 0;
+            columns.computed[index] = current->computed_value;
+            columns.inputs[index] = add_string(&pool, &pool_size, &pool_capacity, current->original_input);
+            columns.results[index] = SNAPSHOT_NO_STRING;
+
+            // Text results of formulas, plain text is the input itself
+            if (current->formula != NULL && (current->type == TEXT || current->type == ERROR)) {
+                columns.results[index] = add_string(&pool, &pool_size, &pool_capacity, current->content.text_value);
+            }
+
+            // Compiled terms, aggregates are compiled again on load to start tracking their range
+            columns.term_first[index] = (uint32_t) terms;
+            columns.term_count[index] = (uint32_t) current->term_count;
+            for (int t = 0; t < current->term_count; t++) {
+                formula_term *term = &columns.terms[terms++];
+                *term = current->terms[t];
+                if (term->kind == TERM_AGGREGATE) {
+                    columns.flags[index] |= SNAPSHOT_AGGREGATES;
+                }
+                term->aggregate = NULL;
+            }
+
+            // Dependency runs
+            columns.run_first[index] = (uint32_t) runs;
+            columns.run_count[index] = (uint32_t) current->dependents_count;
+            if (current->dependents_count > 0) {
+                memcpy(&columns.runs[runs], current->dependents, current->dependents_count * sizeof(dependent_run));
+                runs += current->dependents_count;
+            }
+        }
+    }
+
+    // The string pool goes last, its size is only known now
+    header.string_size = pool_size;
+    header.sizes[SECTION_STRINGS] = pool_size;
+    memcpy(body, &header, sizeof(header));
+
+    snapshot_image *image = malloc(sizeof(snapshot_image));
+    image->body = body;
+    image->body_size = body_size;
+    image->pool = pool;
+    image->pool_size = pool_size;
+    return image;
+}
+
+//// COMPRESS SNAPSHOT FUNCTION
+// Hands the sections to the codec as the columns they are, the header and padding between them as bytes
+static char *compress_image(const snapshot_image *image, size_t *compressed_size) {
+    static const codec_kind kinds[SECTION_COUNT] = {
+        [SECTION_ROWS] = CODEC_INT32,       [SECTION_COLS] = CODEC_INT32,       [SECTION_TYPES] = CODEC_SMALL,
+        [SECTION_FLAGS] = CODEC_SMALL,      [SECTION_NUMBERS] = CODEC_DOUBLE,   [SECTION_COMPUTED] = CODEC_DOUBLE,
+        [SECTION_INPUTS] = CODEC_UINT64,    [SECTION_RESULTS] = CODEC_UINT64,   [SECTION_TERM_FIRST] = CODEC_INT32,
+        [SECTION_TERM_COUNT] = CODEC_INT32, [SECTION_RUN_FIRST] = CODEC_INT32,  [SECTION_RUN_COUNT] = CODEC_INT32,
+        [SECTION_TERMS] = CODEC_BYTES,      [SECTION_RUNS] = CODEC_INT32,       [SECTION_STRINGS] = CODEC_STRINGS,
+    };
+    const snapshot_header *header = (const snapshot_header *) image->body;
+    codec_region regions[2 * SECTION_COUNT + 1];
+    int count = 0;
+    regions[count++] = (codec_region) {image->body, header->offsets[0], CODEC_BYTES};
+
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        const char *section = s == SECTION_STRINGS ? image->pool : image->body + header->offsets[s];
+        regions[count++] = (codec_region) {section, header->sizes[s], kinds[s]};
+        if (s + 1 < SECTION_COUNT) {
+            uint64_t end = header->offsets[s] + header->sizes[s];
+            regions[count++] = (codec_region) {image->body + end, header->offsets[s + 1] - end, CODEC_BYTES};
+        }
+    }
+    return codec_compress(regions, count, compressed_size);
+}
+
+//// WRITE SNAPSHOT FUNCTION
+int snapshot_write(snapshot_image *image, const char *path, int compressed) {
+    // Written next to the file and renamed over it, a loaded snapshot stays intact while mapped
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+    FILE *out = fopen(temp_path, "wb");
+
+    if (out != NULL && compressed) {
+        size_t compressed_size = 0;
+        char *data = compress_image(image, &compressed_size);
+        fwrite(data, 1, compressed_size, out);
+        free(data);
+    }
+    else if (out != NULL) {
+        fwrite(image->body, 1, image->body_size, out);
+        if (image->pool_size > 0) {
+            fwrite(image->pool, 1, image->pool_size, out);
+        }
+    }
+    free(image->body);
+    free(image->pool);
+    free(image);
+    if (out == NULL) {
+        free(temp_path);
+        return -1;
+    }
+
+    // On disk before it replaces the old file, a checkpoint is followed by dropping the journal it covers
+    int failed = ferror(out) || fflush(out) != 0 || fsync(fileno(out)) != 0;
+    if (fclose(out) != 0 || failed) {
+        remove(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    // Windows can't rename over an existing file
+#ifdef _WIN32
+    remove(path);
+#endif
+    failed = rename(temp_path, path) != 0;
+    free(temp_path);
+    return failed ? -1 : 0;
+}
+
+//// SAVE SNAPSHOT FUNCTION
+int snapshot_save(const char *path) {
+    model_lock_acquire();
+    snapshot_image *image = snapshot_capture();
+    model_lock_release();
+
+    return snapshot_write(image, path, 0);
+}
+
+//// SAVE COMPRESSED SNAPSHOT FUNCTION
+int snapshot_save_compressed(const char *path) {
+    model_lock_acquire();
+    snapshot_image *image = snapshot_capture();
+    model_lock_release();
+
+    return snapshot_write(image, path, 1);
+}
+
+/////////////////////////////////////////////////// LOADING ///////////////////////////////////////////////////
+
+//// MAP FILE FUNCTION
+// Maps the file, or reads it into memory where it can't be mapped
+static char *map_file(const char *path, size_t *size, int *mapped) {
+#if defined(SNAPSHOT_MMAP)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(snapshot_header)) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t) info.st_size;
+    char *base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    *mapped = 1;
+    return base == MAP_FAILED ? NULL : base;
+#else
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    long length = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *base = length >= (long) sizeof(snapshot_header) ? malloc(length) : NULL;
+    if (base != NULL && fread(base, 1, length, in) != (size_t) length) {
+        free(base);
+        base = NULL;
+    }
+    fclose(in);
+    *size = (size_t) length;
+    *mapped = 0;
+    return base;
+#endif
+}
+
+//// UNMAP FILE FUNCTION
+static void unmap_file(char *base, size_t size, int mapped) {
+#if defined(SNAPSHOT_MMAP)
+    if (mapped) {
+        munmap(base, size);
+        return;
+    }
+#endif
+    (void) size;
+    (void) mapped;
+    free(base);
+}
+
+//// VALIDATE SNAPSHOT FUNCTION
+// Checks the header, that every index stays inside its section and that every position is on the sheet, returns
+// -1 if anything is off
+static int validate(const char *base, size_t size, snapshot_columns *columns) {
+    const snapshot_header *header = (const snapshot_header *) base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER || header->term_size != sizeof(formula_term) ||
+        header->run_size != sizeof(dependent_run) || header->cell_count > INT32_MAX) {
+        return -1;
+    }
+
+    // The sections must be where the counts put them
+    snapshot_header expected = *header;
+    lay_out(&expected);
+    for (int s = 0; s < SECTION_COUNT; s++) {
+        if (expected.offsets[s] != header->offsets[s] || expected.sizes[s] != header->sizes[s] ||
+            header->offsets[s] + header->sizes[s] > size) {
+            return -1;
+        }
+    }
+    if (header->string_size > 0 && base[header->offsets[SECTION_STRINGS] + header->string_size - 1] != '\0') {
+        return -1;
+    }
+
+    // Every cell's strings, terms and runs must be in range, and the cell on the sheet only once
+    point_columns(columns, (char *) base, header);
+    uint8_t *seen = calloc((size_t) SHEET_ROWS * SHEET_COLS / 8, 1);
+    int failed = 0;
+    for (uint64_t i = 0; i < header->cell_count && !failed; i++) {
+        int32_t row = columns->rows[i];
+        int32_t col = columns->cols[i];
+        if (row < 0 || row >= SHEET_ROWS || col < 0 || col >= SHEET_COLS || columns->inputs[i] >= header->string_size ||
+            (columns->results[i] != SNAPSHOT_NO_STRING && columns->results[i] >= header->string_size) ||
+            (uint64_t) columns->term_first[i] + columns->term_count[i] > header->term_count ||
+            (uint64_t) columns->run_first[i] + columns->run_count[i] > header->run_count ||
+            columns->types[i] > ERROR) {
+            failed = 1;
+            break;
+        }
+        size_t position = (size_t) row * SHEET_COLS + (size_t) col;
+        failed = seen[position / 8] & 1 << position % 8;
+        seen[position / 8] |= (uint8_t) (1 << position % 8);
+
+        // Terms used where they lie have no aggregate to point to
+        for (uint32_t t = 0; t < columns->term_count[i] && !(columns->flags[i] & SNAPSHOT_AGGREGATES); t++) {
+            failed |= columns->terms[columns->term_first[i] + t].kind == TERM_AGGREGATE;
+        }
+    }
+    free(seen);
+
+    // Terms and runs must name cells on the sheet
+    for (uint64_t t = 0; t < header->term_count && !failed; t++) {
+        const formula_term *term = &columns->terms[t];
+        failed = (unsigned) term->kind > TERM_INVALID ||
+                 (term->kind == TERM_REFERENCE && (term->row >= SHEET_ROWS || term->col >= SHEET_COLS));
+    }
+    for (uint64_t r = 0; r < header->run_count && !failed; r++) {
+        const dependent_run *run = &columns->runs[r];
+        failed = run->col >= SHEET_COLS || run->first_row > run->last_row || run->last_row >= SHEET_ROWS;
+    }
+    return failed ? -1 : 0;
+}
+
+//// LOAD SNAPSHOT FUNCTION
+int snapshot_load(const char *path) {
+    size_t size = 0;
+    int mapped = 0;
+    char *base = map_file(path, &size, &mapped);
+    if (base == NULL) {
+        return -1;
+    }
+
+    // Compressed snapshots are decompressed into memory and loaded from there
+    if (codec_detect(base, size)) {
+        size_t image_size = 0;
+        char *image = codec_decompress(base, size, &image_size);
+        unmap_file(base, size, mapped);
+        if (image == NULL || image_size < sizeof(snapshot_header)) {
+            free(image);
+            return -1;
+        }
+        base = image;
+        size = image_size;
+        mapped = 0;
+    }
+
+    snapshot_columns columns;
+    if (validate(base, size, &columns) != 0) {
+        unmap_file(base, size, mapped);
+        return -1;
+    }
+    const snapshot_header *header = (const snapshot_header *) base;
+
+    // Removing the cells unloads the previous snapshot, then this one takes its place
+    model_lock_acquire();
+    remove_all_cells();
+    loaded_base = base;
+    loaded_size = size;
+    loaded_mapped = mapped;
+
+    for (uint64_t i = 0; i < header->cell_count; i++) {
+        cell *current = create_cell(columns.rows[i], columns.cols[i]);
+        current->type = (cell_type) columns.types[i];
+        current->computed_value = columns.computed[i];
+        current->original_input = columns.strings + columns.inputs[i];
+
+        // Plain cells, text shares the input
+        if (current->original_input[0] != '=') {
+            if (current->type == TEXT) {
+                current->content.text_value = current->original_input;
+            }
+            else {
+                current->type = NUMBER;
+                current->content.number_value = columns.numbers[i];
+            }
+        }
+
+        // Formulas use the compiled terms where they lie, unless aggregates need tracking
+        else {
+            current->formula = current->original_input + 1;
+            if (columns.flags[i] & SNAPSHOT_AGGREGATES) {
+                compile_formula(current);
+            }
+            else {
+                current->terms = columns.terms + columns.term_first[i];
+                current->term_count = (int) columns.term_count[i];
+            }
+
+            if (columns.flags[i] & SNAPSHOT_PENDING) {
+                current->type = FORMULA;
+            }
+            else if (current->type == NUMBER) {
+                current->content.number_value = columns.numbers[i];
+            }
+            else if (columns.results[i] != SNAPSHOT_NO_STRING) {
+                current->content.text_value = columns.strings + columns.results[i];
+            }
+            else {
+                current->type = FORMULA;
+            }
+        }
+
+        // Dependency runs, copied as the cell grows them
+        uint32_t run_count = columns.run_count[i];
+        if (run_count > 0) {
+            current->dependents = malloc(run_count * sizeof(dependent_run));
+            memcpy(current->dependents, columns.runs + columns.run_first[i], run_count * sizeof(dependent_run));
+            current->dependents_count = (int) run_count;
+            current->dependents_capacity = (int) run_count;
+            for (uint32_t r = 0; r < run_count; r++) {
+                current->dependent_cells += current->dependents[r].last_row - current->dependents[r].first_row + 1;
+            }
+        }
+    }
+
+    // Formulas without a result are evaluated by the worker, once every cell exists
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            if (current->type == FORMULA) {
+                mark_dirty(current);
+            }
+            queue_display(current);
+        }
+    }
+
+    model_lock_release();
+    return 0;
+}
+
+/////////////////////////////////////////////////// MODEL HOOKS ///////////////////////////////////////////////////
+
+//// SNAPSHOT OWNS FUNCTION
+int snapshot_owns(const void *pointer) {
+    uintptr_t address = (uintptr_t) pointer;
+    return loaded_base != NULL && address >= (uintptr_t) loaded_base && address < (uintptr_t) loaded_base + loaded_size;
+}
+
+//// SNAPSHOT RELEASE FUNCTION
+void snapshot_release() {
+    if (loaded_base != NULL) {
+        unmap_file(loaded_base, loaded_size, loaded_mapped);
+        loaded_base = NULL;
+        loaded_size = 0;
+    }
+}
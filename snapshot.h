@@ -0,0 +1,33 @@
+#ifndef ASSIGNMENT_SNAPSHOT_H
+#define ASSIGNMENT_SNAPSHOT_H
+
+// Saves the whole model to a binary snapshot at 'path': the cells as columns
+// of positions, types and numbers, a pool of their strings, the compiled
+// formulas and the dependency runs. The file is replaced in one step, so a
+// snapshot that is loaded can be saved over.
+//
+// Returns 0 on success, -1 if the file can't be written.
+int snapshot_save(const char *path);
+
+// Saves the model to a compressed snapshot at 'path', the same sections in
+// independently compressed blocks: the cell columns delta or offset encoded and
+// bitpacked, and the string pool as dictionaries. The file is a fraction of
+// the size for mostly numeric sheets, at the cost of decompressing it on load.
+//
+// Returns 0 on success, -1 if the file can't be written.
+int snapshot_save_compressed(const char *path);
+
+// Replaces the contents of the model with the snapshot at 'path'.
+//
+// The file is memory mapped and its sections are used where they lie:
+// strings and compiled formulas are not copied, and are paged in by the OS
+// when a cell is shown or evaluated. Compressed snapshots are decompressed into
+// memory first, by several threads when they are large. Snapshots are only
+// read by a build with the same byte order and structure layout as the one
+// that wrote them.
+//
+// Returns 0 on success, -1 if the file can't be read or is not a snapshot
+// this build understands. The model is left as it was in that case.
+int snapshot_load(const char *path);
+
+#endif //ASSIGNMENT_SNAPSHOT_H
@@ -0,0 +1,1147 @@
+#include "tiles.h"
+#include "model_internal.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#else
+#include <unistd.h>
+#endif
+
+#define TILES_MAGIC "SHEETTIL"
+#define TILES_VERSION 2
+
+// Written as a number and compared on load, a file from a machine with the other byte order doesn't match
+#define TILES_BYTE_ORDER 0x01020304u
+
+// Cells in a tile
+#define TILE_ROWS 64
+#define TILE_COLS 8
+
+// Two header slots at the start of the file, a save writes the one the previous save didn't
+#define TILES_SLOT_SIZE 64
+#define TILES_DATA_START (2 * TILES_SLOT_SIZE)
+
+// Bytes before the cells of a block: length, checksum, tile position and cell count
+#define TILES_BLOCK_HEADER_SIZE 20
+
+// Replaced blocks are only worth rewriting the file for once there are this many bytes of them
+#define TILES_COMPACT_BYTES (1 << 20)
+
+// Empty slots of the dirty tile set
+#define TILES_NO_KEY UINT64_MAX
+
+// Manifest entry flags, a tile holding aggregates is paged in with the workbook
+#define TILE_AGGREGATES 1
+
+///// HEADER SLOT
+// Points at the manifest of one save, the slot with the highest valid sequence is the current one
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t sequence;
+    uint64_t manifest_offset;
+    uint64_t manifest_count;
+    uint32_t manifest_checksum;
+    uint32_t checksum;
+} tiles_header;
+
+///// MANIFEST ENTRY
+// Where the block of a tile is in the file, the manifest is an array of them sorted by tile
+typedef struct {
+    int32_t tile_row;
+    int32_t tile_col;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t flags;
+
+    // Last row and column of the tile with a cell in it, relative to the tile
+    uint16_t last_row;
+    uint16_t last_col;
+} tile_entry;
+
+///// RESIDENT TILE
+// A tile whose cells are in memory while paging, with what they take up and the clock's reference bit
+typedef struct {
+    uint64_t key;
+    size_t bytes;
+    int referenced;
+
+    // Positions holding a cell, a bit per cell of the tile in reading order
+    uint64_t occupied[TILE_ROWS * TILE_COLS / 64];
+} resident_tile;
+
+///// GROWABLE BYTE BUFFER
+typedef struct {
+    char *bytes;
+    size_t size;
+    size_t capacity;
+} byte_buffer;
+
+///// FILE STATE
+// The file the dirty tiles are tracked against and its manifest, NULL until a tiled workbook is saved or loaded
+static char *tiles_path = NULL;
+static tile_entry *manifest = NULL;
+static int manifest_count = 0;
+static uint64_t sequence = 0;
+
+// Bytes of blocks the manifest points at, and of replaced blocks and manifests
+static uint64_t live_bytes = 0;
+static uint64_t dead_bytes = 0;
+
+///// DIRTY TILES
+// Open addressing set of the tiles changed since the file was saved, keyed by tile row and column
+static uint64_t *dirty_tiles = NULL;
+static size_t dirty_capacity = 0;
+static size_t dirty_count = 0;
+
+///// PAGING
+// While paging, the tiles of the workbook are loaded when a cell of theirs is looked up, and clean tiles are
+// evicted again once the cells in memory take up more than the budget
+int tiles_paging = 0;
+static FILE *paged_file = NULL;
+static size_t memory_budget = 0;
+static size_t resident_bytes = 0;
+
+// Open addressing set of the tiles in memory, swept by the clock hand
+static resident_tile *resident = NULL;
+static size_t resident_capacity = 0;
+static size_t resident_count = 0;
+static size_t clock_hand = 0;
+
+// Tile last marked as referenced, a run of lookups in one tile only marks it once
+static uint64_t last_referenced = TILES_NO_KEY;
+
+// Set while a save writes tiles it no longer counts as changed, they are not evicted until it is done
+static int saving = 0;
+
+// Set when a sweep over the budget found nothing to evict. Tiles only become evictable when one comes
+// in, the footprints change, a save leaves them clean or the worker lets go of their cells, so sweeping
+// again before then is wasted.
+static int trim_stalled = 0;
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// CHECKSUM FUNCTION (FNV-1a)
+static uint32_t checksum_bytes(const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    uint32_t checksum = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+//// TILE KEY FUNCTIONS
+static uint64_t tile_key(int32_t tile_row, int32_t tile_col) {
+    return (uint64_t) (uint32_t) tile_row << 32 | (uint32_t) tile_col;
+}
+
+static size_t key_slot(uint64_t key, size_t capacity) {
+    return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const tile_entry *first = a;
+    const tile_entry *second = b;
+    uint64_t first_key = tile_key(first->tile_row, first->tile_col);
+    uint64_t second_key = tile_key(second->tile_row, second->tile_col);
+    return first_key < second_key ? -1 : first_key > second_key;
+}
+
+static int compare_cells_by_tile(const void *a, const void *b) {
+    const cell *first = *(cell *const *) a;
+    const cell *second = *(cell *const *) b;
+    uint64_t first_key = tile_key(first->row / TILE_ROWS, first->col / TILE_COLS);
+    uint64_t second_key = tile_key(second->row / TILE_ROWS, second->col / TILE_COLS);
+    return first_key < second_key ? -1 : first_key > second_key;
+}
+
+//// DIRTY SET INSERT FUNCTION
+static void insert_dirty(uint64_t key) {
+    // Grow at half full, rehashing every key
+    if (2 * (dirty_count + 1) > dirty_capacity) {
+        uint64_t *old_tiles = dirty_tiles;
+        size_t old_capacity = dirty_capacity;
+        dirty_capacity = dirty_capacity == 0 ? 64 : dirty_capacity * 2;
+        dirty_tiles = malloc(dirty_capacity * sizeof(uint64_t));
+        memset(dirty_tiles, 0xff, dirty_capacity * sizeof(uint64_t));
+        dirty_count = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_tiles[i] != TILES_NO_KEY) {
+                insert_dirty(old_tiles[i]);
+            }
+        }
+        free(old_tiles);
+    }
+
+    size_t slot = key_slot(key, dirty_capacity);
+    while (dirty_tiles[slot] != TILES_NO_KEY) {
+        if (dirty_tiles[slot] == key) {
+            return;
+        }
+        slot = (slot + 1) & (dirty_capacity - 1);
+    }
+    dirty_tiles[slot] = key;
+    dirty_count++;
+}
+
+//// DIRTY SET LOOKUP FUNCTION
+static int is_dirty(uint64_t key) {
+    if (dirty_count == 0) {
+        return 0;
+    }
+    for (size_t slot = key_slot(key, dirty_capacity); dirty_tiles[slot] != TILES_NO_KEY;
+         slot = (slot + 1) & (dirty_capacity - 1)) {
+        if (dirty_tiles[slot] == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//// DIRTY SET CLEAR FUNCTION
+static void clear_dirty() {
+    if (dirty_tiles != NULL) {
+        memset(dirty_tiles, 0xff, dirty_capacity * sizeof(uint64_t));
+    }
+    dirty_count = 0;
+    trim_stalled = 0;
+}
+
+//// RESIDENT SET FUNCTIONS
+// Slot of a tile in the resident set, or the empty slot where it would go
+static size_t resident_slot(uint64_t key) {
+    size_t slot = key_slot(key, resident_capacity);
+    while (resident[slot].key != TILES_NO_KEY && resident[slot].key != key) {
+        slot = (slot + 1) & (resident_capacity - 1);
+    }
+    return slot;
+}
+
+static resident_tile *find_resident(uint64_t key) {
+    if (resident_count == 0) {
+        return NULL;
+    }
+    size_t slot = resident_slot(key);
+    return resident[slot].key == key ? &resident[slot] : NULL;
+}
+
+static resident_tile *insert_resident(uint64_t key) {
+    // Grow at half full, rehashing every tile
+    if (2 * (resident_count + 1) > resident_capacity) {
+        resident_tile *old_tiles = resident;
+        size_t old_capacity = resident_capacity;
+        resident_capacity = resident_capacity == 0 ? 64 : resident_capacity * 2;
+        resident = malloc(resident_capacity * sizeof(resident_tile));
+        for (size_t i = 0; i < resident_capacity; i++) {
+            resident[i].key = TILES_NO_KEY;
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_tiles[i].key != TILES_NO_KEY) {
+                resident[resident_slot(old_tiles[i].key)] = old_tiles[i];
+            }
+        }
+        free(old_tiles);
+        clock_hand = 0;
+    }
+
+    size_t slot = resident_slot(key);
+    if (resident[slot].key == TILES_NO_KEY) {
+        memset(&resident[slot], 0, sizeof(resident_tile));
+        resident[slot].key = key;
+        resident[slot].referenced = 1;
+        resident_count++;
+        trim_stalled = 0;
+    }
+    return &resident[slot];
+}
+
+// Empties a slot and moves the tiles after it back, so a lookup never stops at the hole
+static void remove_resident(size_t slot) {
+    size_t mask = resident_capacity - 1;
+    for (size_t next = (slot + 1) & mask; resident[next].key != TILES_NO_KEY; next = (next + 1) & mask) {
+        size_t home = key_slot(resident[next].key, resident_capacity);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            resident[slot] = resident[next];
+            slot = next;
+        }
+    }
+    resident[slot].key = TILES_NO_KEY;
+    resident_count--;
+}
+
+//// TILE CELLS FUNCTION
+// The cells of a tile that are in memory, returns how many
+static int tile_cells(uint64_t key, cell **cells) {
+    int32_t tile_row = (int32_t) (key >> 32);
+    int32_t tile_col = (int32_t) (uint32_t) key;
+    int count = 0;
+    for (int row = tile_row * TILE_ROWS; row < (tile_row + 1) * TILE_ROWS; row++) {
+        for (int col = tile_col * TILE_COLS; col < (tile_col + 1) * TILE_COLS; col++) {
+            cell *current = find_resident_cell((ROW) row, (COL) col);
+            if (current != NULL) {
+                cells[count++] = current;
+            }
+        }
+    }
+    return count;
+}
+
+//// OCCUPIED CELLS FUNCTION
+// The cells of a resident tile, found through its occupied positions instead of every position
+static int occupied_cells(const resident_tile *tile, cell **cells) {
+    ROW first_row = (ROW) ((int32_t) (tile->key >> 32) * TILE_ROWS);
+    COL first_col = (COL) ((int32_t) (uint32_t) tile->key * TILE_COLS);
+    int count = 0;
+    for (int position = 0; position < TILE_ROWS * TILE_COLS; position++) {
+        if (tile->occupied[position / 64] & (uint64_t) 1 << (position % 64)) {
+            cell *current = find_resident_cell(first_row + position / TILE_COLS, first_col + position % TILE_COLS);
+            if (current != NULL) {
+                cells[count++] = current;
+            }
+        }
+    }
+    return count;
+}
+
+//// OCCUPY FUNCTION
+static void occupy(resident_tile *tile, ROW row, COL col) {
+    int position = (int) (row % TILE_ROWS) * TILE_COLS + (int) (col % TILE_COLS);
+    tile->occupied[position / 64] |= (uint64_t) 1 << (position % 64);
+}
+
+//// FOOTPRINT FUNCTION
+// Roughly the memory the cells of a tile take up, counted against the budget
+static size_t tile_footprint(cell **cells, int count) {
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        cell *current = cells[i];
+        bytes += sizeof(node) + strlen(current->original_input) + 1 +
+                 (size_t) current->dependents_capacity * sizeof(dependent_run);
+        if (current->formula != NULL) {
+            bytes += strlen(current->formula) + 1 + (size_t) current->term_count * sizeof(formula_term);
+        }
+        if (current->type == TEXT || current->type == ERROR) {
+            bytes += strlen(current->content.text_value) + 1;
+        }
+    }
+    return bytes;
+}
+
+//// SET FOOTPRINT FUNCTION
+static void set_footprint(uint64_t key, size_t bytes) {
+    resident_tile *tile = insert_resident(key);
+    if (tile->bytes != bytes) {
+        resident_bytes = resident_bytes - tile->bytes + bytes;
+        tile->bytes = bytes;
+        trim_stalled = 0;
+    }
+}
+
+//// BUFFER APPEND FUNCTION
+static void append(byte_buffer *buffer, const void *data, size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        while (buffer->size + size > buffer->capacity) {
+            buffer->capacity = buffer->capacity == 0 ? 4096 : buffer->capacity * 2;
+        }
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+    }
+    memcpy(buffer->bytes + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void append_int(byte_buffer *buffer, int32_t value) {
+    append(buffer, &value, sizeof(value));
+}
+
+static void append_string(byte_buffer *buffer, const char *text) {
+    uint32_t length = (uint32_t) strlen(text);
+    append(buffer, &length, sizeof(length));
+    append(buffer, text, length);
+}
+
+//// APPEND CELL FUNCTION
+// Position, input, the result of a formula and the dependency runs
+static void append_cell(byte_buffer *buffer, cell *current) {
+    append_int(buffer, current->row);
+    append_int(buffer, current->col);
+
+    // Plain values are parsed again from the input, formulas still waiting for the worker are recalculated on load
+    char kind;
+    if (current->formula == NULL) {
+        kind = '-';
+    }
+    else if (current->dirty || current->type == FORMULA) {
+        kind = 'P';
+    }
+    else {
+        kind = current->type == NUMBER ? 'N' : current->type == TEXT ? 'T' : 'E';
+    }
+    append(buffer, &kind, 1);
+    append_string(buffer, current->original_input);
+    if (kind == 'N') {
+        append(buffer, &current->content.number_value, sizeof(double));
+    }
+    else if (kind == 'T' || kind == 'E') {
+        append_string(buffer, current->content.text_value);
+    }
+
+    append_int(buffer, current->dependents_count);
+    for (int r = 0; r < current->dependents_count; r++) {
+        append_int(buffer, current->dependents[r].col);
+        append_int(buffer, current->dependents[r].first_row);
+        append_int(buffer, current->dependents[r].last_row);
+    }
+}
+
+//// APPEND BLOCK FUNCTION
+// Writes the block of a tile into 'blocks' and its entry into 'entries', relative to the start of 'blocks'.
+// Tiles without cells get no block.
+static void append_block(byte_buffer *blocks, byte_buffer *entries, int32_t tile_row, int32_t tile_col,
+                         cell **cells, int cell_count) {
+    if (cell_count == 0) {
+        return;
+    }
+
+    size_t start = blocks->size;
+    char header[TILES_BLOCK_HEADER_SIZE] = {0};
+    append(blocks, header, sizeof(header));
+    for (int i = 0; i < cell_count; i++) {
+        append_cell(blocks, cells[i]);
+    }
+
+    // Fill in the header once the length is known, the checksum covers everything after it
+    char *block = blocks->bytes + start;
+    uint32_t length = (uint32_t) (blocks->size - start - TILES_BLOCK_HEADER_SIZE);
+    uint32_t count = (uint32_t) cell_count;
+    memcpy(block, &length, 4);
+    memcpy(block + 8, &tile_row, 4);
+    memcpy(block + 12, &tile_col, 4);
+    memcpy(block + 16, &count, 4);
+    uint32_t checksum = checksum_bytes(block + 8, blocks->size - start - 8);
+    memcpy(block + 4, &checksum, 4);
+
+    tile_entry entry = {tile_row, tile_col, start, blocks->size - start, 0, 0, 0};
+    for (int i = 0; i < cell_count; i++) {
+        for (int t = 0; t < cells[i]->term_count; t++) {
+            entry.flags |= cells[i]->terms[t].kind == TERM_AGGREGATE ? TILE_AGGREGATES : 0;
+        }
+        uint16_t row = (uint16_t) (cells[i]->row % TILE_ROWS);
+        uint16_t col = (uint16_t) (cells[i]->col % TILE_COLS);
+        entry.last_row = row > entry.last_row ? row : entry.last_row;
+        entry.last_col = col > entry.last_col ? col : entry.last_col;
+    }
+    append(entries, &entry, sizeof(entry));
+}
+
+//// WRITE HEADER FUNCTION
+// Fills in a header for the manifest and writes it to its slot
+static int write_header(FILE *out, uint64_t header_sequence, uint64_t manifest_offset, const tile_entry *entries,
+                        int entry_count) {
+    char slot[TILES_SLOT_SIZE] = {0};
+    tiles_header header = {0};
+    memcpy(header.magic, TILES_MAGIC, sizeof(header.magic));
+    header.version = TILES_VERSION;
+    header.byte_order = TILES_BYTE_ORDER;
+    header.sequence = header_sequence;
+    header.manifest_offset = manifest_offset;
+    header.manifest_count = (uint64_t) entry_count;
+    header.manifest_checksum = checksum_bytes(entries, entry_count * sizeof(tile_entry));
+    header.checksum = checksum_bytes(&header, offsetof(tiles_header, checksum));
+    memcpy(slot, &header, sizeof(header));
+
+    return fseek(out, (long) (header_sequence % 2) * TILES_SLOT_SIZE, SEEK_SET) != 0 ||
+           fwrite(slot, 1, sizeof(slot), out) != sizeof(slot) ? -1 : 0;
+}
+
+//// FLUSH FUNCTION
+// On disk before anything that points at it is written
+static int flush_to_disk(FILE *out) {
+    return fflush(out) != 0 || fsync(fileno(out)) != 0 ? -1 : 0;
+}
+
+//// CHOOSE HEADER FUNCTION
+// Reads both slots, returns the valid one with the highest sequence through 'header', -1 if neither is valid
+static int read_header(FILE *in, tiles_header *header) {
+    char slots[2][TILES_SLOT_SIZE];
+    if (fread(slots, 1, sizeof(slots), in) != sizeof(slots)) {
+        return -1;
+    }
+
+    int found = 0;
+    for (int s = 0; s < 2; s++) {
+        tiles_header candidate;
+        memcpy(&candidate, slots[s], sizeof(candidate));
+        if (memcmp(candidate.magic, TILES_MAGIC, sizeof(candidate.magic)) != 0 ||
+            candidate.version != TILES_VERSION || candidate.byte_order != TILES_BYTE_ORDER ||
+            candidate.checksum != checksum_bytes(&candidate, offsetof(tiles_header, checksum)) ||
+            candidate.manifest_count > INT32_MAX) {
+            continue;
+        }
+        if (!found || candidate.sequence > header->sequence) {
+            *header = candidate;
+            found = 1;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+/////////////////////////////////////////////////// SAVING ///////////////////////////////////////////////////
+
+//// COLLECT ALL TILES FUNCTION
+// Blocks of every tile, for a file written from scratch
+static void collect_all(byte_buffer *blocks, byte_buffer *entries) {
+    cell **cells = malloc((spreadsheet_count > 0 ? spreadsheet_count : 1) * sizeof(cell *));
+    int count = 0;
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cells[count++] = &entry->value;
+        }
+    }
+
+    // Cells of a tile next to each other, in tile order so the manifest comes out sorted
+    qsort(cells, count, sizeof(cell *), compare_cells_by_tile);
+    for (int first = 0; first < count; ) {
+        int32_t tile_row = cells[first]->row / TILE_ROWS;
+        int32_t tile_col = cells[first]->col / TILE_COLS;
+        int last = first + 1;
+        while (last < count && (int32_t) (cells[last]->row / TILE_ROWS) == tile_row &&
+               (int32_t) (cells[last]->col / TILE_COLS) == tile_col) {
+            last++;
+        }
+        append_block(blocks, entries, tile_row, tile_col, cells + first, last - first);
+        first = last;
+    }
+    free(cells);
+}
+
+//// COLLECT DIRTY TILES FUNCTION
+// Blocks of the tiles changed since the last save, each found by looking up its positions
+static void collect_dirty(byte_buffer *blocks, byte_buffer *entries) {
+    cell *cells[TILE_ROWS * TILE_COLS];
+    for (size_t i = 0; i < dirty_capacity; i++) {
+        if (dirty_tiles[i] == TILES_NO_KEY) {
+            continue;
+        }
+        int32_t tile_row = (int32_t) (dirty_tiles[i] >> 32);
+        int32_t tile_col = (int32_t) (uint32_t) dirty_tiles[i];
+
+        int count = tile_cells(dirty_tiles[i], cells);
+
+        // While paging the tile can be evicted once it is written, at its current size
+        if (tiles_paging) {
+            set_footprint(dirty_tiles[i], tile_footprint(cells, count));
+        }
+
+        // A tile whose cells are all gone still needs an entry, so it is removed from the manifest
+        if (count == 0) {
+            tile_entry entry = {tile_row, tile_col, 0, 0, 0, 0, 0};
+            append(entries, &entry, sizeof(entry));
+        }
+        append_block(blocks, entries, tile_row, tile_col, cells, count);
+    }
+}
+
+//// MERGE MANIFEST FUNCTION
+// The current manifest with the entries of the new blocks in place of the old ones, counts replaced bytes
+static tile_entry *merge_manifest(tile_entry *updates, int update_count, int *merged_count, uint64_t *replaced) {
+    tile_entry *merged = malloc((manifest_count + update_count + 1) * sizeof(tile_entry));
+    qsort(updates, update_count, sizeof(tile_entry), compare_entries);
+
+    int count = 0;
+    int old = 0;
+    *replaced = 0;
+    for (int u = 0; u <= update_count; u++) {
+        // Old entries before the update are kept, the one it replaces is dropped
+        while (old < manifest_count && (u == update_count || compare_entries(&manifest[old], &updates[u]) < 0)) {
+            merged[count++] = manifest[old++];
+        }
+        if (u == update_count) {
+            break;
+        }
+        if (old < manifest_count && compare_entries(&manifest[old], &updates[u]) == 0) {
+            *replaced += manifest[old++].size;
+        }
+        if (updates[u].size > 0) {
+            merged[count++] = updates[u];
+        }
+    }
+
+    *merged_count = count;
+    return merged;
+}
+
+//// SAVE TILES FUNCTION
+int tiles_save(const char *path) {
+    model_lock_acquire();
+    flag_pending_cells();
+
+    // Only the file the changes are tracked against can be updated in place. A paged workbook only
+    // has some of its cells in memory, so it is never written from scratch.
+    int full = tiles_path == NULL || strcmp(tiles_path, path) != 0 ||
+               (dead_bytes > live_bytes && dead_bytes > TILES_COMPACT_BYTES && !tiles_paging);
+    FILE *out = full ? NULL : fopen(path, "r+b");
+    full = out == NULL;
+    if (full && tiles_paging) {
+        model_lock_release();
+        return -1;
+    }
+
+    // A new file is written next to the target and renamed over it
+    char *temp_path = NULL;
+    if (full) {
+        temp_path = malloc(strlen(path) + sizeof(".tmp"));
+        sprintf(temp_path, "%s.tmp", path);
+        out = fopen(temp_path, "wb");
+        if (out == NULL) {
+            model_lock_release();
+            free(temp_path);
+            return -1;
+        }
+    }
+
+    // Capture the blocks, edits from here on are tracked against this file for the next save
+    byte_buffer blocks = {0};
+    byte_buffer entries = {0};
+    full ? collect_all(&blocks, &entries) : collect_dirty(&blocks, &entries);
+    clear_dirty();
+    if (full) {
+        free(tiles_path);
+        tiles_path = strdup(path);
+    }
+    saving = 1;
+    model_lock_release();
+
+    // The blocks go at the end of the file, the manifest after them
+    uint64_t blocks_start = TILES_DATA_START;
+    int failed = 0;
+    if (full) {
+        char empty[TILES_DATA_START] = {0};
+        failed = fwrite(empty, 1, sizeof(empty), out) != sizeof(empty);
+    }
+    else {
+        failed = fseek(out, 0, SEEK_END) != 0;
+        blocks_start = (uint64_t) ftell(out);
+    }
+    int entry_count = (int) (entries.size / sizeof(tile_entry));
+    tile_entry *updates = (tile_entry *) entries.bytes;
+    for (int i = 0; i < entry_count; i++) {
+        updates[i].offset += blocks_start;
+    }
+
+    uint64_t replaced = 0;
+    int merged_count = entry_count;
+    tile_entry *merged = full ? updates : merge_manifest(updates, entry_count, &merged_count, &replaced);
+    uint64_t manifest_offset = blocks_start + blocks.size;
+    failed = failed || fwrite(blocks.bytes, 1, blocks.size, out) != blocks.size ||
+             fwrite(merged, sizeof(tile_entry), merged_count, out) != (size_t) merged_count ||
+             flush_to_disk(out) != 0;
+
+    // The header slot is written last, a crash before it leaves the previous save in place
+    uint64_t next_sequence = full ? 1 : sequence + 1;
+    failed = failed || write_header(out, next_sequence, manifest_offset, merged, merged_count) != 0 ||
+             flush_to_disk(out) != 0;
+    failed = fclose(out) != 0 || failed;
+#ifdef _WIN32
+    if (full && !failed) {
+        remove(path);
+    }
+#endif
+    if (full && !failed) {
+        failed = rename(temp_path, path) != 0;
+    }
+    if (full && failed) {
+        remove(temp_path);
+    }
+    free(temp_path);
+    free(blocks.bytes);
+    if (failed) {
+        // What was captured is not in the file. A paged workbook counts its tiles as changed again,
+        // anything else is written from scratch by the next save.
+        model_lock_acquire();
+        if (tiles_paging) {
+            for (int i = 0; i < entry_count; i++) {
+                insert_dirty(tile_key(updates[i].tile_row, updates[i].tile_col));
+            }
+        }
+        else {
+            free(tiles_path);
+            tiles_path = NULL;
+        }
+        saving = 0;
+        model_lock_release();
+        if (merged != updates) {
+            free(merged);
+        }
+        free(entries.bytes);
+        return -1;
+    }
+
+    // The new manifest is the current one, a full save's is the entries themselves. Paging reads it
+    // with the model lock held.
+    model_lock_acquire();
+    if (full) {
+        live_bytes = blocks.size;
+        dead_bytes = 0;
+        entries.bytes = NULL;
+    }
+    else {
+        live_bytes += blocks.size - replaced;
+        dead_bytes += replaced + (uint64_t) manifest_count * sizeof(tile_entry);
+    }
+    free(manifest);
+    manifest = merged;
+    manifest_count = merged_count;
+    sequence = next_sequence;
+    saving = 0;
+    model_lock_release();
+    free(entries.bytes);
+    return 0;
+}
+
+/////////////////////////////////////////////////// LOADING ///////////////////////////////////////////////////
+
+//// READ CURSOR
+// Hands out the bytes of a block in order, NULL once a read would go past its end
+typedef struct {
+    const char *bytes;
+    size_t size;
+    size_t offset;
+} read_cursor;
+
+static const char *take(read_cursor *cursor, size_t size) {
+    if (size > cursor->size - cursor->offset) {
+        return NULL;
+    }
+    cursor->offset += size;
+    return cursor->bytes + cursor->offset - size;
+}
+
+static int take_int(read_cursor *cursor, int32_t *value) {
+    const char *bytes = take(cursor, sizeof(*value));
+    if (bytes != NULL) {
+        memcpy(value, bytes, sizeof(*value));
+    }
+    return bytes != NULL ? 0 : -1;
+}
+
+static char *take_string(read_cursor *cursor) {
+    int32_t length;
+    const char *bytes = take_int(cursor, &length) == 0 && length >= 0 ? take(cursor, (size_t) length) : NULL;
+    if (bytes == NULL) {
+        return NULL;
+    }
+
+    char *text = malloc((size_t) length + 1);
+    memcpy(text, bytes, (size_t) length);
+    text[length] = '\0';
+    return text;
+}
+
+//// LOAD CELL FUNCTION
+// Creates the next cell of a block holding tile 'tile_row', 'tile_col', returns -1 if the block is malformed or
+// the cell is off the sheet or outside the tile
+static int load_cell(read_cursor *cursor, int32_t tile_row, int32_t tile_col) {
+    int32_t row, col;
+    const char *kind = NULL;
+    if (take_int(cursor, &row) != 0 || take_int(cursor, &col) != 0 || (kind = take(cursor, 1)) == NULL) {
+        return -1;
+    }
+    if (row < 0 || row >= SHEET_ROWS || col < 0 || col >= SHEET_COLS || row / TILE_ROWS != tile_row ||
+        col / TILE_COLS != tile_col) {
+        return -1;
+    }
+    char *input = take_string(cursor);
+    if (input == NULL || find_resident_cell((ROW) row, (COL) col) != NULL) {
+        free(input);
+        return -1;
+    }
+
+    // Store the input as an edit would, without evaluating anything
+    cell *current = create_cell((ROW) row, (COL) col);
+    current->original_input = input;
+    parse_cell_input(current);
+
+    // Formulas take their saved result, if they had one
+    if (*kind == 'N') {
+        const char *number = take(cursor, sizeof(double));
+        if (number == NULL) {
+            return -1;
+        }
+        if (current->formula != NULL) {
+            memcpy(&current->content.number_value, number, sizeof(double));
+            current->type = NUMBER;
+            current->computed_value = current->content.number_value;
+        }
+    }
+    else if (*kind == 'T' || *kind == 'E') {
+        char *text = take_string(cursor);
+        if (text == NULL) {
+            return -1;
+        }
+        if (current->formula != NULL) {
+            current->content.text_value = text;
+            current->type = *kind == 'T' ? TEXT : ERROR;
+        }
+        else {
+            free(text);
+        }
+    }
+
+    // Dependency runs, straight into the cell's array
+    int32_t run_count;
+    if (take_int(cursor, &run_count) != 0 || run_count < 0 || (size_t) run_count > cursor->size / 12) {
+        return -1;
+    }
+    if (run_count > 0) {
+        current->dependents = malloc(run_count * sizeof(dependent_run));
+        current->dependents_capacity = run_count;
+    }
+    for (int r = 0; r < run_count; r++) {
+        int32_t run_col, first_row, last_row;
+        if (take_int(cursor, &run_col) != 0 || take_int(cursor, &first_row) != 0 ||
+            take_int(cursor, &last_row) != 0 || run_col < 0 || run_col >= SHEET_COLS || first_row < 0 ||
+            first_row > last_row || last_row >= SHEET_ROWS) {
+            return -1;
+        }
+        dependent_run *run = &current->dependents[current->dependents_count++];
+        run->col = (COL) run_col;
+        run->first_row = (ROW) first_row;
+        run->last_row = (ROW) last_row;
+        current->dependent_cells += last_row - first_row + 1;
+    }
+    return 0;
+}
+
+//// LOAD BLOCK FUNCTION
+// Reads the block of a manifest entry and creates its cells, returns -1 if it is damaged
+static int load_block(FILE *in, const tile_entry *entry, char **buffer, size_t *capacity) {
+    if (entry->size < TILES_BLOCK_HEADER_SIZE || entry->size > SIZE_MAX / 2) {
+        return -1;
+    }
+    if (entry->size > *capacity) {
+        *capacity = (size_t) entry->size;
+        *buffer = realloc(*buffer, *capacity);
+    }
+    if (fseek(in, (long) entry->offset, SEEK_SET) != 0 || fread(*buffer, 1, entry->size, in) != entry->size) {
+        return -1;
+    }
+
+    uint32_t length, checksum, cell_count;
+    int32_t tile_row, tile_col;
+    memcpy(&length, *buffer, 4);
+    memcpy(&checksum, *buffer + 4, 4);
+    memcpy(&tile_row, *buffer + 8, 4);
+    memcpy(&tile_col, *buffer + 12, 4);
+    memcpy(&cell_count, *buffer + 16, 4);
+    if (length != entry->size - TILES_BLOCK_HEADER_SIZE || tile_row != entry->tile_row ||
+        tile_col != entry->tile_col || checksum != checksum_bytes(*buffer + 8, entry->size - 8)) {
+        return -1;
+    }
+
+    read_cursor cursor = {*buffer, (size_t) entry->size, TILES_BLOCK_HEADER_SIZE};
+    for (uint32_t i = 0; i < cell_count; i++) {
+        if (load_cell(&cursor, tile_row, tile_col) != 0) {
+            return -1;
+        }
+    }
+    return cursor.offset == cursor.size ? 0 : -1;
+}
+
+//// READ MANIFEST FUNCTION
+// Reads the current header and its manifest, returns NULL if either is damaged
+static tile_entry *read_manifest(FILE *in, tiles_header *header) {
+    if (read_header(in, header) != 0) {
+        return NULL;
+    }
+    int entry_count = (int) header->manifest_count;
+    tile_entry *entries = malloc((entry_count > 0 ? entry_count : 1) * sizeof(tile_entry));
+    if (fseek(in, (long) header->manifest_offset, SEEK_SET) != 0 ||
+        fread(entries, sizeof(tile_entry), entry_count, in) != (size_t) entry_count ||
+        checksum_bytes(entries, entry_count * sizeof(tile_entry)) != header->manifest_checksum) {
+        free(entries);
+        return NULL;
+    }
+    return entries;
+}
+
+//// LOAD TILES FUNCTION
+int tiles_load(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    // The current header and its manifest
+    tiles_header header;
+    tile_entry *entries = read_manifest(in, &header);
+    if (entries == NULL) {
+        fclose(in);
+        return -1;
+    }
+    int entry_count = (int) header.manifest_count;
+
+    model_lock_acquire();
+    remove_all_cells();
+
+    // Cells of every block
+    char *buffer = NULL;
+    size_t capacity = 0;
+    uint64_t blocks_size = 0;
+    int failed = 0;
+    for (int i = 0; i < entry_count && !failed; i++) {
+        failed = load_block(in, &entries[i], &buffer, &capacity) != 0;
+        blocks_size += entries[i].size;
+    }
+    free(buffer);
+    fclose(in);
+
+    if (failed) {
+        remove_all_cells();
+        model_lock_release();
+        free(entries);
+        return -1;
+    }
+
+    // Formulas without a result are evaluated by the worker
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            if (current->type == FORMULA) {
+                mark_dirty(current);
+            }
+            queue_display(current);
+        }
+    }
+
+    // Changes are tracked against this file from here on
+    clear_dirty();
+    tiles_path = strdup(path);
+    free(manifest);
+    manifest = entries;
+    manifest_count = entry_count;
+    sequence = header.sequence;
+    live_bytes = blocks_size;
+    dead_bytes = header.manifest_offset > TILES_DATA_START + blocks_size ?
+                 header.manifest_offset - TILES_DATA_START - blocks_size : 0;
+    model_lock_release();
+    return 0;
+}
+
+/////////////////////////////////////////////////// PAGING ///////////////////////////////////////////////////
+
+//// PAGE TILES FUNCTION
+int tiles_page(const char *path, size_t budget) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+    tiles_header header;
+    tile_entry *entries = read_manifest(in, &header);
+    if (entries == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    // Nothing is loaded yet, changes are tracked against this file from here on
+    model_lock_acquire();
+    remove_all_cells();
+    tiles_path = strdup(path);
+    free(manifest);
+    manifest = entries;
+    manifest_count = (int) header.manifest_count;
+    sequence = header.sequence;
+    live_bytes = 0;
+    for (int i = 0; i < manifest_count; i++) {
+        live_bytes += manifest[i].size;
+    }
+    dead_bytes = header.manifest_offset > TILES_DATA_START + live_bytes ?
+                 header.manifest_offset - TILES_DATA_START - live_bytes : 0;
+    paged_file = in;
+    memory_budget = budget;
+    tiles_paging = 1;
+
+    // Aggregates only follow their range while their formula is in memory, their tiles come in first and stay
+    for (int i = 0; i < manifest_count; i++) {
+        if (manifest[i].flags & TILE_AGGREGATES) {
+            tiles_fault((ROW) (manifest[i].tile_row * TILE_ROWS), (COL) (manifest[i].tile_col * TILE_COLS));
+        }
+    }
+    queue_viewport();
+    model_lock_release();
+    return 0;
+}
+
+//// TILES FAULT FUNCTION
+int tiles_fault(ROW row, COL col) {
+    uint64_t key = tile_key(row / TILE_ROWS, col / TILE_COLS);
+    if (find_resident(key) != NULL) {
+        return 0;
+    }
+    tile_entry probe = {row / TILE_ROWS, col / TILE_COLS, 0, 0, 0, 0, 0};
+    tile_entry *entry = bsearch(&probe, manifest, manifest_count, sizeof(tile_entry), compare_entries);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    // Resident before its cells are created, so looking them up doesn't fault again. A damaged block
+    // keeps the cells read before the damage.
+    insert_resident(key);
+    char *buffer = NULL;
+    size_t capacity = 0;
+    load_block(paged_file, entry, &buffer, &capacity);
+    free(buffer);
+
+    // Formulas saved while they waited for the worker are evaluated again
+    cell *cells[TILE_ROWS * TILE_COLS];
+    int count = tile_cells(key, cells);
+    resident_tile *tile = find_resident(key);
+    for (int i = 0; i < count; i++) {
+        occupy(tile, cells[i]->row, cells[i]->col);
+        if (cells[i]->type == FORMULA) {
+            mark_dirty(cells[i]);
+        }
+    }
+    set_footprint(key, tile_footprint(cells, count));
+    return count > 0;
+}
+
+//// TILES REFERENCE FUNCTION
+void tiles_reference(ROW row, COL col) {
+    uint64_t key = tile_key(row / TILE_ROWS, col / TILE_COLS);
+    if (key != last_referenced) {
+        resident_tile *tile = find_resident(key);
+        if (tile != NULL) {
+            tile->referenced = 1;
+        }
+        last_referenced = key;
+    }
+}
+
+//// PINNED CHECK FUNCTION
+// Cells waiting for the worker are in its queues, and aggregates keep pointers to their formula
+static int pinned(cell **cells, int count) {
+    for (int i = 0; i < count; i++) {
+        if (cells[i]->dirty) {
+            return 1;
+        }
+        for (int t = 0; t < cells[i]->term_count; t++) {
+            if (cells[i]->terms[t].kind == TERM_AGGREGATE) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//// TILES TRIM FUNCTION
+// Second chance clock over the resident set: a referenced tile loses its bit and is passed over, the next
+// clean tile that isn't pinned is evicted. Changed tiles stay until a save writes them back.
+void tiles_trim() {
+    if (!tiles_paging || saving || trim_stalled || resident_bytes <= memory_budget || recalc_in_progress()) {
+        return;
+    }
+    last_referenced = TILES_NO_KEY;
+
+    cell_list evicted = {0};
+    cell *cells[TILE_ROWS * TILE_COLS];
+    int freed = 0;
+    for (size_t step = 0; step < 2 * resident_capacity && resident_bytes > memory_budget; step++) {
+        size_t slot = clock_hand;
+        resident_tile *tile = &resident[slot];
+        clock_hand = (clock_hand + 1) & (resident_capacity - 1);
+        if (tile->key == TILES_NO_KEY) {
+            continue;
+        }
+        if (tile->referenced) {
+            tile->referenced = 0;
+            continue;
+        }
+        if (is_dirty(tile->key)) {
+            continue;
+        }
+        int count = occupied_cells(tile, cells);
+        if (pinned(cells, count)) {
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            cell_list_push(&evicted, cells[i]);
+        }
+        resident_bytes -= tile->bytes < resident_bytes ? tile->bytes : resident_bytes;
+        remove_resident(slot);
+        freed++;
+
+        // A tile moved back into the slot hasn't been looked at yet
+        clock_hand = slot;
+    }
+
+    // Two turns of the hand without an eviction, every tile left is changed or pinned
+    trim_stalled = freed == 0 && resident_bytes > memory_budget;
+
+    drop_cells(&evicted);
+    cell_list_free(&evicted);
+}
+
+//// TILES UNPIN FUNCTION
+void tiles_unpin() {
+    trim_stalled = 0;
+}
+
+//// TILES EXTENT FUNCTION
+void tiles_extent(int *max_row, int *max_col) {
+    if (!tiles_paging) {
+        return;
+    }
+    for (int i = 0; i < manifest_count; i++) {
+        int row = manifest[i].tile_row * TILE_ROWS + manifest[i].last_row;
+        int col = manifest[i].tile_col * TILE_COLS + manifest[i].last_col;
+        *max_row = row > *max_row ? row : *max_row;
+        *max_col = col > *max_col ? col : *max_col;
+    }
+}
+
+/////////////////////////////////////////////////// MODEL HOOKS ///////////////////////////////////////////////////
+
+//// TILES TOUCH FUNCTION
+void tiles_touch(ROW row, COL col) {
+    // Nothing to track until there is a file to update
+    if (tiles_path != NULL) {
+        uint64_t key = tile_key(row / TILE_ROWS, col / TILE_COLS);
+        insert_dirty(key);
+
+        // While paging, a tile that gets its first cells is in memory from then on
+        if (tiles_paging) {
+            resident_tile *tile = find_resident(key);
+            occupy(tile != NULL ? tile : insert_resident(key), row, col);
+        }
+    }
+}
+
+//// TILES FORGET FUNCTION
+void tiles_forget() {
+    free(tiles_path);
+    tiles_path = NULL;
+    clear_dirty();
+
+    // Paging stops with the cells gone
+    if (paged_file != NULL) {
+        fclose(paged_file);
+        paged_file = NULL;
+    }
+    tiles_paging = 0;
+    free(resident);
+    resident = NULL;
+    resident_capacity = 0;
+    resident_count = 0;
+    resident_bytes = 0;
+    clock_hand = 0;
+    last_referenced = TILES_NO_KEY;
+}
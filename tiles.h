@@ -0,0 +1,51 @@
+#ifndef ASSIGNMENT_TILES_H
+#define ASSIGNMENT_TILES_H
+
+#include <stddef.h>
+
+// Saves the model to a tiled workbook at 'path'. The cells are stored in
+// blocks of TILE_ROWS by TILE_COLS, each with its cells' inputs, formula
+// results and dependency runs, and a manifest lists where each block is.
+//
+// The model keeps track of the tiles changed since the file was last saved
+// or loaded. Saving to the same file again only appends those blocks and a
+// new manifest, then switches the header over to it, so the cost of a save is
+// proportional to what changed. A crash before the switch leaves the previous
+// save intact. The file is written again from scratch when it was not the
+// last one saved or loaded, or once replaced blocks take up more space than
+// the live ones.
+//
+// Returns 0 on success, -1 if the file can't be written.
+int tiles_save(const char *path);
+
+// Replaces the contents of the model with the tiled workbook at 'path'.
+//
+// Formula results and dependencies are loaded as they were saved, so the
+// sheet is usable without recalculating anything.
+//
+// Returns 0 on success, -1 if the file can't be read or is not a tiled
+// workbook. The model is left empty if a block is damaged.
+int tiles_load(const char *path);
+
+// Replaces the contents of the model with the tiled workbook at 'path', paged
+// in a tile at a time for sheets that don't fit in memory. Nothing is read
+// up front but the manifest, the tiles holding aggregates and the tiles in the
+// viewport. Any other tile is read when a cell of it is looked up, by an edit,
+// a formula, a range or the display.
+//
+// Once the cells in memory take up more than 'budget' bytes, tiles are evicted
+// in clock order, passing over the recently used ones. Tiles changed since the
+// last save stay until tiles_save writes them back, and so do tiles with cells
+// waiting for the worker or holding aggregates. The budget is checked whenever
+// the model lock is released and between the worker's recalculations.
+//
+// While paging, the workbook can only be saved with tiles_save to the same
+// file. Exports page in the tiles of their range, but an Arrow export only
+// finds the text columns among the cells in memory, and snapshots only hold
+// the cells in memory.
+//
+// Returns 0 on success, -1 if the file can't be read or is not a tiled
+// workbook. The model is left as it was in that case.
+int tiles_page(const char *path, size_t budget);
+
+#endif //ASSIGNMENT_TILES_H
@@ -0,0 +1,344 @@
+#include "workbook.h"
+#include "model_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#else
+#include <unistd.h>
+#endif
+
+#define WORKBOOK_MAGIC "WORKBOOK"
+#define WORKBOOK_VERSION 1
+
+/////////////////////////////////////////////////// HELPER FUNCTIONS ///////////////////////////////////////////////////
+
+//// CHECKSUM FUNCTION (FNV-1a)
+// Folds a cell's position and input into the checksum the saved graph was built from
+static unsigned long long checksum_cell(unsigned long long checksum, ROW row, COL col, const char *input) {
+    int position[2] = {row, col};
+    const unsigned char *bytes = (const unsigned char *) position;
+
+    for (size_t i = 0; i < sizeof(position); i++) {
+        checksum = (checksum ^ bytes[i]) * 1099511628211ULL;
+    }
+    for (const unsigned char *c = (const unsigned char *) input; *c != '\0'; c++) {
+        checksum = (checksum ^ *c) * 1099511628211ULL;
+    }
+    return checksum;
+}
+
+//// STRING WRITING FUNCTION
+// Strings are written with their length first, so they may contain spaces and newlines
+static void write_string(FILE *out, const char *text) {
+    size_t length = strlen(text);
+    fprintf(out, "%zu:", length);
+    fwrite(text, 1, length, out);
+}
+
+//// STRING READING FUNCTION
+static char *read_string(FILE *in) {
+    size_t length;
+    if (fscanf(in, " %zu:", &length) != 1) {
+        return NULL;
+    }
+
+    char *text = malloc(length + 1);
+    if (fread(text, 1, length, in) != length) {
+        free(text);
+        return NULL;
+    }
+    text[length] = '\0';
+    return text;
+}
+
+/////////////////////////////////////////////////// SAVING ///////////////////////////////////////////////////
+
+//// SAVE WORKBOOK FUNCTION
+int workbook_save(const char *path) {
+    // Written next to the file and renamed over it, the old workbook stays intact until the new one is whole
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL) {
+        free(temp_path);
+        return -1;
+    }
+
+    model_lock_acquire();
+
+    // Cells still waiting for the worker are saved as pending
+    flag_pending_cells();
+
+    // Count the cells for the header
+    int cell_count = 0;
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell_count++;
+        }
+    }
+    fprintf(out, "%s %d\n", WORKBOOK_MAGIC, WORKBOOK_VERSION);
+    fprintf(out, "CELLS %d\n", cell_count);
+
+    // One record per cell: position, input, and for formulas their current result
+    unsigned long long checksum = 14695981039346656037ULL;
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            checksum = checksum_cell(checksum, current->row, current->col, current->original_input);
+
+            fprintf(out, "C %d %d ", current->row, current->col);
+            write_string(out, current->original_input);
+
+            // Plain values are parsed again from the input
+            if (current->formula == NULL) {
+                fprintf(out, " -\n");
+            }
+
+            // Formulas still waiting for the worker are recalculated on load
+            else if (current->dirty || current->type == FORMULA) {
+                fprintf(out, " P\n");
+            }
+            else if (current->type == NUMBER) {
+                fprintf(out, " N %.17g\n", current->content.number_value);
+            }
+            else {
+                fprintf(out, current->type == TEXT ? " T " : " E ");
+                write_string(out, current->content.text_value);
+                fprintf(out, "\n");
+            }
+        }
+    }
+
+    // The dependency runs, stamped with the checksum of the cells they were built from
+    fprintf(out, "GRAPH %llu\n", checksum);
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            if (current->dependents_count == 0) {
+                continue;
+            }
+
+            fprintf(out, "D %d %d %d", current->row, current->col, current->dependents_count);
+            for (int r = 0; r < current->dependents_count; r++) {
+                dependent_run *run = &current->dependents[r];
+                fprintf(out, " %d %d %d", run->col, run->first_row, run->last_row);
+            }
+            fprintf(out, "\n");
+        }
+    }
+
+    // The order formulas are evaluated in
+    cell_list order = {0};
+    topological_order(&order);
+    fprintf(out, "ORDER %d\n", order.count);
+    for (int i = 0; i < order.count; i++) {
+        fprintf(out, "%d %d\n", order.cells[i]->row, order.cells[i]->col);
+    }
+    fprintf(out, "END\n");
+
+    model_lock_release();
+    cell_list_free(&order);
+
+    // On disk before it replaces the old file, a save is followed by emptying the journal. Writing may fail as
+    // late as the close.
+    int failed = ferror(out) || fflush(out) != 0 || fsync(fileno(out)) != 0;
+    if (fclose(out) != 0 || failed) {
+        remove(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    // Windows can't rename over an existing file
+#ifdef _WIN32
+    remove(path);
+#endif
+    failed = rename(temp_path, path) != 0;
+    free(temp_path);
+    return failed ? -1 : 0;
+}
+
+/////////////////////////////////////////////////// LOADING ///////////////////////////////////////////////////
+
+//// LOAD CELLS FUNCTION
+// Reads the cell records, returns the checksum of their inputs through 'checksum' and how many of them are
+// formulas through 'formula_count'
+static int load_cells(FILE *in, unsigned long long *checksum, int *formula_count) {
+    int cell_count;
+    if (fscanf(in, " CELLS %d", &cell_count) != 1) {
+        return -1;
+    }
+
+    *checksum = 14695981039346656037ULL;
+    *formula_count = 0;
+    for (int i = 0; i < cell_count; i++) {
+        int row, col;
+        char kind;
+        if (fscanf(in, " C %d %d", &row, &col) != 2 || row < 0 || row >= SHEET_ROWS || col < 0 ||
+            col >= SHEET_COLS || find_resident_cell(row, col) != NULL) {
+            return -1;
+        }
+        char *input = read_string(in);
+        if (input == NULL || fscanf(in, " %c", &kind) != 1) {
+            free(input);
+            return -1;
+        }
+
+        // Store the input as an edit would, without evaluating anything
+        cell *current = create_cell(row, col);
+        current->original_input = input;
+        parse_cell_input(current);
+        *checksum = checksum_cell(*checksum, row, col, input);
+
+        // Formulas take their saved result, if they had one
+        *formula_count += current->formula != NULL;
+        if (current->formula == NULL || kind == '-') {
+            continue;
+        }
+        if (kind == 'N') {
+            if (fscanf(in, " %lf", &current->content.number_value) != 1) {
+                return -1;
+            }
+            current->type = NUMBER;
+            current->computed_value = current->content.number_value;
+        }
+        else if (kind == 'T' || kind == 'E') {
+            current->content.text_value = read_string(in);
+            if (current->content.text_value == NULL) {
+                return -1;
+            }
+            current->type = kind == 'T' ? TEXT : ERROR;
+        }
+    }
+
+    return 0;
+}
+
+//// LOAD GRAPH FUNCTION
+// Reads the dependency runs and the saved order into 'order', returns -1 if they don't match the cells
+static int load_graph(FILE *in, unsigned long long checksum, int formula_count, cell_list *order) {
+    unsigned long long saved_checksum;
+    if (fscanf(in, " GRAPH %llu", &saved_checksum) != 1 || saved_checksum != checksum) {
+        return -1;
+    }
+
+    // Dependency runs, straight into each cell's array
+    int row, col, run_count;
+    while (fscanf(in, " D %d %d %d", &row, &col, &run_count) == 3) {
+        cell *current = find_cell(row, col);
+        if (current == NULL || run_count <= 0 || current->dependents != NULL) {
+            return -1;
+        }
+
+        current->dependents = malloc(run_count * sizeof(dependent_run));
+        current->dependents_capacity = run_count;
+        for (int r = 0; r < run_count; r++) {
+            dependent_run *run = &current->dependents[r];
+            int run_col, first_row, last_row;
+            if (fscanf(in, " %d %d %d", &run_col, &first_row, &last_row) != 3 || run_col < 0 ||
+                run_col >= SHEET_COLS || first_row < 0 || first_row > last_row || last_row >= SHEET_ROWS) {
+                return -1;
+            }
+            run->col = run_col;
+            run->first_row = first_row;
+            run->last_row = last_row;
+            current->dependents_count++;
+            current->dependent_cells += last_row - first_row + 1;
+        }
+    }
+
+    // The order must name every formula exactly once. The checksum matched, so it is the order of these cells.
+    int order_count;
+    if (fscanf(in, " ORDER %d", &order_count) != 1 || order_count != formula_count) {
+        return -1;
+    }
+    int failed = 0;
+    for (int i = 0; i < order_count && !failed; i++) {
+        cell *current = fscanf(in, " %d %d", &row, &col) == 2 ? find_resident_cell(row, col) : NULL;
+        failed = current == NULL || current->formula == NULL || current->scc_mark == 1;
+        if (!failed) {
+            current->scc_mark = 1;
+            cell_list_push(order, current);
+        }
+    }
+    for (int i = 0; i < order->count; i++) {
+        order->cells[i]->scc_mark = 0;
+    }
+    if (failed) {
+        return -1;
+    }
+
+    char end[8];
+    return fscanf(in, " %7s", end) == 1 && strcmp(end, "END") == 0 ? 0 : -1;
+}
+
+//// LOAD WORKBOOK FUNCTION
+int workbook_load(const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+
+    char magic[16];
+    int version;
+    if (fscanf(in, " %15s %d", magic, &version) != 2 || strcmp(magic, WORKBOOK_MAGIC) != 0 ||
+        version != WORKBOOK_VERSION) {
+        fclose(in);
+        return -1;
+    }
+
+    model_lock_acquire();
+    remove_all_cells();
+
+    // Without the cells there is nothing to show
+    unsigned long long checksum;
+    int formula_count;
+    if (load_cells(in, &checksum, &formula_count) != 0) {
+        remove_all_cells();
+        model_lock_release();
+        fclose(in);
+        return -1;
+    }
+
+    // A stale or damaged graph is dropped and rebuilt by recalculating every formula
+    cell_list order = {0};
+    int rebuild = load_graph(in, checksum, formula_count, &order) != 0;
+    fclose(in);
+
+    for (int i = 0; i < spreadsheet_size; i++) {
+        for (node *entry = spreadsheet[i]; entry != NULL; entry = entry->next) {
+            cell *current = &entry->value;
+            if (rebuild) {
+                free(current->dependents);
+                current->dependents = NULL;
+                current->dependents_count = 0;
+                current->dependents_capacity = 0;
+                current->dependent_cells = 0;
+            }
+
+            // Without the graph every formula is evaluated again
+            if (rebuild && current->formula != NULL) {
+                mark_dirty(current);
+            }
+            queue_display(current);
+        }
+    }
+
+    // Formulas saved without a result are queued in the saved order, the worker takes the last one first
+    if (!rebuild) {
+        for (int i = order.count - 1; i >= 0; i--) {
+            if (order.cells[i]->type == FORMULA) {
+                mark_dirty(order.cells[i]);
+            }
+        }
+    }
+    cell_list_free(&order);
+
+    model_lock_release();
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef ASSIGNMENT_WORKBOOK_H
+#define ASSIGNMENT_WORKBOOK_H
+
+// Saves every cell to the file at 'path', together with the results of the
+// formulas and the dependency graph. The file is written next to 'path' and
+// renamed over it once it is on disk, so a failed save leaves the old one.
+//
+// Returns 0 on success, -1 if the file can't be written.
+int workbook_save(const char *path);
+
+// Replaces the contents of the model with the workbook saved at 'path'.
+//
+// Formula results, dependencies and the evaluation order are loaded as they
+// were saved, so the sheet is usable without recalculating anything. Formulas
+// saved before the worker reached them are evaluated in the saved order. If the
+// saved graph does not match the cells (an older or hand-edited file), it is
+// ignored and every formula is recalculated instead.
+//
+// Returns 0 on success, -1 if the file can't be read. The model is left
+// empty if the file is malformed, holds a cell off the sheet or the same cell
+// twice.
+int workbook_load(const char *path);
+
+#endif //ASSIGNMENT_WORKBOOK_H